@@ -1534,6 +1534,11 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset,
     acb->bytes = bytes;
     acb->has_returned = false;
 
+    /*
+     * Not COROUTINE_STACK_SMALL: the request recurses through every node
+     * below blk, e.g. once per image of a backing chain, so its stack depth
+     * is not bounded by anything that can be checked here.
+     */
     co = qemu_coroutine_create(co_entry, acb);
     bdrv_coroutine_enter(blk_bs(blk), co);
 
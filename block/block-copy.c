@@ -24,9 +24,17 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+#define BLOCK_COPY_MAX_ADAPTIVE_BUFFER (8 * MiB)
+#define BLOCK_COPY_MAX_POOL (32 * MiB)
+/* Target write latency below which buffered chunks may grow */
+#define BLOCK_COPY_CHUNK_LAT_LOW (10 * SCALE_MS)
+/* Target write latency above which buffered chunks shrink again */
+#define BLOCK_COPY_CHUNK_LAT_HIGH (50 * SCALE_MS)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
@@ -108,6 +116,12 @@ static int64_t task_end(BlockCopyTask *task)
     return task->req.offset + task->req.bytes;
 }
 
+typedef struct BlockCopyBuffer {
+    void *buf;
+    int64_t size;
+    QSLIST_ENTRY(BlockCopyBuffer) next;
+} BlockCopyBuffer;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -133,6 +147,11 @@ typedef struct BlockCopyState {
     CoMutex lock;
     int64_t in_flight_bytes;
     BlockCopyMethod method;
+    /* Chunk size for COPY_READ_WRITE, see block_copy_account_write() */
+    int64_t rw_chunk_size;
+    /* Bounce buffers kept for reuse, see block_copy_get_buffer() */
+    QSLIST_HEAD(, BlockCopyBuffer) free_buffers;
+    int64_t free_buffers_bytes;
     BlockReqList reqs;
     QLIST_HEAD(, BlockCopyCallState) calls;
     /*
@@ -164,6 +183,7 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
+        return MIN(MAX(s->cluster_size, s->rw_chunk_size), s->max_transfer);
     case COPY_RANGE_SMALL:
         return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
                    s->max_transfer);
@@ -260,10 +280,17 @@ static void coroutine_fn block_copy_task_end(BlockCopyTask *task, int ret)
 
 void block_copy_state_free(BlockCopyState *s)
 {
+    BlockCopyBuffer *b, *b_next;
+
     if (!s) {
         return;
     }
 
+    QSLIST_FOREACH_SAFE(b, &s->free_buffers, next, b_next) {
+        qemu_vfree(b->buf);
+        g_free(b);
+    }
+    shres_put(s->mem, s->free_buffers_bytes);
     ratelimit_destroy(&s->rate_limit);
     bdrv_release_dirty_bitmap(s->copy_bitmap);
     shres_destroy(s->mem);
@@ -402,6 +429,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .max_transfer = QEMU_ALIGN_DOWN(
                                     block_copy_max_transfer(source, target),
                                     cluster_size),
+        .rw_chunk_size = BLOCK_COPY_MAX_BUFFER,
     };
 
     block_copy_set_copy_opts(s, false, false);
@@ -410,6 +438,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     qemu_co_mutex_init(&s->lock);
     QLIST_INIT(&s->reqs);
     QLIST_INIT(&s->calls);
+    QSLIST_INIT(&s->free_buffers);
 
     return s;
 }
@@ -452,6 +481,109 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+/*
+ * Get a bounce buffer of at least @bytes bytes.  Buffers are allocated in
+ * power-of-two sizes so that they can be recycled between tasks; see
+ * block_copy_put_buffer().
+ *
+ * The caller has already charged @bytes to s->mem; the rounding slack of the
+ * buffer is charged here, and pooled buffers stay charged for their whole
+ * size, so that all bounce buffers together respect BLOCK_COPY_MAX_MEM.
+ */
+static coroutine_fn BlockCopyBuffer *
+block_copy_get_buffer(BlockCopyState *s, int64_t bytes)
+{
+    int64_t size = pow2ceil(bytes);
+    BlockCopyBuffer *b, *b_next, *prev = NULL;
+    QSLIST_HEAD(, BlockCopyBuffer) drop = QSLIST_HEAD_INITIALIZER(drop);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        QSLIST_FOREACH(b, &s->free_buffers, next) {
+            if (b->size == size) {
+                if (prev) {
+                    QSLIST_REMOVE_AFTER(prev, next);
+                } else {
+                    QSLIST_REMOVE_HEAD(&s->free_buffers, next);
+                }
+                s->free_buffers_bytes -= size;
+                /* The caller's charge covers all but the slack */
+                co_put_to_shres(s->mem, bytes);
+                return b;
+            }
+            prev = b;
+        }
+
+        if (!co_try_get_from_shres(s->mem, size - bytes)) {
+            /* Release the pool to make room, and don't round up this time */
+            QSLIST_MOVE_ATOMIC(&drop, &s->free_buffers);
+            s->free_buffers_bytes = 0;
+            size = bytes;
+        }
+    }
+
+    QSLIST_FOREACH_SAFE(b, &drop, next, b_next) {
+        co_put_to_shres(s->mem, b->size);
+        qemu_vfree(b->buf);
+        g_free(b);
+    }
+
+    b = g_new(BlockCopyBuffer, 1);
+    b->buf = qemu_blockalign(s->source->bs, size);
+    b->size = size;
+    return b;
+}
+
+/*
+ * Return a buffer obtained with block_copy_get_buffer() for a request of
+ * @bytes bytes.  The caller still releases its own charge of @bytes
+ * afterwards, so a buffer that goes back to the pool must take a charge of
+ * its own for that part; if the budget is exhausted, free the buffer instead.
+ */
+static void coroutine_fn block_copy_put_buffer(BlockCopyState *s,
+                                               BlockCopyBuffer *b,
+                                               int64_t bytes)
+{
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (s->free_buffers_bytes + b->size <= BLOCK_COPY_MAX_POOL &&
+            co_try_get_from_shres(s->mem, bytes)) {
+            QSLIST_INSERT_HEAD(&s->free_buffers, b, next);
+            s->free_buffers_bytes += b->size;
+            return;
+        }
+    }
+
+    co_put_to_shres(s->mem, b->size - bytes);
+    qemu_vfree(b->buf);
+    g_free(b);
+}
+
+/*
+ * Adapt the chunk size of buffered copies to the write latency of the
+ * target: larger chunks mean fewer requests and less per-task overhead, as
+ * long as the target completes them quickly.
+ */
+static void coroutine_fn block_copy_account_write(BlockCopyState *s,
+                                                  int64_t bytes,
+                                                  int64_t latency_ns)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (latency_ns < BLOCK_COPY_CHUNK_LAT_LOW &&
+        bytes >= s->rw_chunk_size &&
+        s->rw_chunk_size < BLOCK_COPY_MAX_ADAPTIVE_BUFFER)
+    {
+        s->rw_chunk_size *= 2;
+    } else if (latency_ns > BLOCK_COPY_CHUNK_LAT_HIGH &&
+               s->rw_chunk_size > BLOCK_COPY_MAX_BUFFER)
+    {
+        s->rw_chunk_size /= 2;
+    } else {
+        return;
+    }
+
+    trace_block_copy_adjust_chunk(s, latency_ns, s->rw_chunk_size);
+}
+
 /*
  * block_copy_do_copy
  *
@@ -472,7 +604,8 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
 {
     int ret;
     int64_t nbytes = MIN(offset + bytes, s->len) - offset;
-    void *bounce_buffer = NULL;
+    BlockCopyBuffer *bounce_buffer = NULL;
+    int64_t start_ns;
 
     assert(offset >= 0 && bytes > 0 && INT64_MAX - offset >= bytes);
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
@@ -518,25 +651,38 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
          * copy_range.
          */
 
-        bounce_buffer = qemu_blockalign(s->source->bs, nbytes);
+        bounce_buffer = block_copy_get_buffer(s, nbytes);
 
-        ret = bdrv_co_pread(s->source, offset, nbytes, bounce_buffer, 0);
+        ret = bdrv_co_pread(s->source, offset, nbytes, bounce_buffer->buf, 0);
         if (ret < 0) {
             trace_block_copy_read_fail(s, offset, ret);
             *error_is_read = true;
             goto out;
         }
 
-        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                             s->write_flags);
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (buffer_is_zero(bounce_buffer->buf, nbytes)) {
+            /* Don't make the target store (or compress) all these zeroes */
+            trace_block_copy_zero_chunk(s, offset, nbytes);
+            ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes,
+                                        s->write_flags &
+                                        ~BDRV_REQ_WRITE_COMPRESSED);
+        } else {
+            ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer->buf,
+                                 s->write_flags);
+        }
         if (ret < 0) {
             trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
             goto out;
         }
+        if (*method == COPY_READ_WRITE) {
+            block_copy_account_write(s, nbytes,
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
+        }
 
     out:
-        qemu_vfree(bounce_buffer);
+        block_copy_put_buffer(s, bounce_buffer, nbytes);
         break;
 
     default:
@@ -31,6 +31,7 @@
 struct BdrvDirtyBitmap {
     BlockDriverState *bs;
     HBitmap *bitmap;            /* Dirty bitmap implementation */
+    HBitmap *meta;              /* Meta bitmap to track changes in bitmap */
     bool busy;                  /* Bitmap is busy, it can't be used via QMP */
     BdrvDirtyBitmap *successor; /* Anonymous child, if any. */
     char *name;                 /* Optional non-empty unique ID */
@@ -242,6 +243,72 @@ void bdrv_enable_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
     bitmap->disabled = false;
 }
 
+/**
+ * Create a meta dirty bitmap that tracks the changes of bits in @bitmap.
+ * When @bitmap is updated, the corresponding bit in the returned meta bitmap
+ * is set, so that the user knows which parts of @bitmap changed, e.g. since
+ * it was last written to an image.
+ *
+ * @bitmap: the block dirty bitmap for which to create a meta dirty bitmap.
+ * @chunk_size: how many bytes of bitmap data does each bit in the meta
+ *              bitmap track.
+ */
+void bdrv_create_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap, int chunk_size)
+{
+    assert(!bitmap->meta);
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    bitmap->meta = hbitmap_create_meta(bitmap->bitmap,
+                                       chunk_size * BITS_PER_BYTE);
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+/*
+ * Return whether any bit of @bitmap in the given range may have changed
+ * since the meta bitmap was created or last reset.  Without a meta bitmap,
+ * everything is considered changed.
+ */
+bool bdrv_dirty_bitmap_get_meta(BdrvDirtyBitmap *bitmap, int64_t offset,
+                                int64_t bytes)
+{
+    bool changed;
+
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    changed = !bitmap->meta ||
+              hbitmap_next_dirty(bitmap->meta, offset, bytes) >= 0;
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+
+    return changed;
+}
+
+void bdrv_dirty_bitmap_reset_meta(BdrvDirtyBitmap *bitmap)
+{
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    if (bitmap->meta) {
+        hbitmap_reset_all(bitmap->meta);
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+/*
+ * Called after bitmap->bitmap was replaced by a different HBitmap.  Nothing
+ * is known about what changed, so the new meta bitmap marks everything.
+ * Called within bdrv_dirty_bitmap_lock..unlock.
+ */
+static void bdrv_dirty_bitmap_move_meta(BdrvDirtyBitmap *bitmap,
+                                        HBitmap *old)
+{
+    int chunk_bits;
+
+    if (!bitmap->meta) {
+        return;
+    }
+
+    chunk_bits = hbitmap_granularity(bitmap->meta) - hbitmap_granularity(old);
+    hbitmap_free_meta(old);
+    bitmap->meta = hbitmap_create_meta(bitmap->bitmap, 1 << chunk_bits);
+    hbitmap_set(bitmap->meta, 0, bitmap->size);
+}
+
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_enable_successor(BdrvDirtyBitmap *bitmap)
 {
@@ -258,6 +325,9 @@ static void bdrv_release_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
     assert(!bdrv_dirty_bitmap_busy(bitmap));
     assert(!bdrv_dirty_bitmap_has_successor(bitmap));
     QLIST_REMOVE(bitmap, list);
+    if (bitmap->meta) {
+        hbitmap_free_meta(bitmap->bitmap);
+    }
     hbitmap_free(bitmap->bitmap);
     g_free(bitmap->name);
     g_free(bitmap);
@@ -663,6 +733,7 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         HBitmap *backup = bitmap->bitmap;
         bitmap->bitmap = hbitmap_alloc(bitmap->size,
                                        hbitmap_granularity(backup));
+        bdrv_dirty_bitmap_move_meta(bitmap, backup);
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -674,6 +745,7 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup)
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
     GLOBAL_STATE_CODE();
     bitmap->bitmap = backup;
+    bdrv_dirty_bitmap_move_meta(bitmap, tmp);
     hbitmap_free(tmp);
 }
 
@@ -957,6 +1029,7 @@ void bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
     if (backup) {
         *backup = dest->bitmap;
         dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        bdrv_dirty_bitmap_move_meta(dest, *backup);
         hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
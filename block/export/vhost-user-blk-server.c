@@ -17,6 +17,7 @@
 #include "vhost-user-blk-server.h"
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
+#include "qemu/bitmap.h"
 #include "util/block-helpers.h"
 #include "virtio-blk-handler.h"
 
@@ -37,16 +38,65 @@ typedef struct {
     VirtioBlkHandler handler;
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
+
+    /*
+     * Guest notifications are coalesced: completions only mark their
+     * virtqueue in @notify_pending and a single BH per event loop iteration
+     * notifies all marked virtqueues.  Protected by the export AioContext.
+     */
+    unsigned long *notify_pending;
+    bool notify_scheduled;
 } VuBlkExport;
 
-static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
+static void vu_blk_notify_bh(void *opaque)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuBlkExport *vexp = opaque;
+    VuServer *server = &vexp->vu_server;
+    VuDev *vu_dev = &server->vu_dev;
+    uint16_t num_queues = le16_to_cpu(vexp->blkcfg.num_queues);
+    unsigned long idx;
+
+    vexp->notify_scheduled = false;
+    for (idx = find_first_bit(vexp->notify_pending, num_queues);
+         idx < num_queues;
+         idx = find_next_bit(vexp->notify_pending, num_queues, idx + 1)) {
+        clear_bit(idx, vexp->notify_pending);
+        /* This honours VIRTIO_RING_F_EVENT_IDX if it was negotiated */
+        vu_queue_notify(vu_dev, vu_get_queue(vu_dev, idx));
+    }
+
+    blk_dec_in_flight(vexp->export.blk);
+    vhost_user_server_unref(server);
+}
+
+/*
+ * Push the completed request to the used ring.  Returns true if the
+ * caller's reference to the server has been handed over to the
+ * notification BH.
+ */
+static bool vu_blk_req_complete(VuBlkReq *req, size_t in_len)
+{
+    VuServer *server = req->server;
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
+    VuDev *vu_dev = &server->vu_dev;
+    bool scheduled = false;
 
     vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
-    vu_queue_notify(vu_dev, req->vq);
+    set_bit(req->vq - vu_dev->vq, vexp->notify_pending);
+
+    if (!vexp->notify_scheduled) {
+        /*
+         * The in-flight counter makes drain wait for pending notifications,
+         * so the BH never outlives an AioContext switch.
+         */
+        vexp->notify_scheduled = true;
+        blk_inc_in_flight(vexp->export.blk);
+        aio_bh_schedule_oneshot(server->ctx, vu_blk_notify_bh, vexp);
+        scheduled = true;
+    }
 
     free(req);
+    return scheduled;
 }
 
 /* Called with server refcount increased, must decrease before returning */
@@ -71,15 +121,19 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
         return;
     }
 
-    vu_blk_req_complete(req, in_len);
-    vhost_user_server_unref(server);
+    if (!vu_blk_req_complete(req, in_len)) {
+        vhost_user_server_unref(server);
+    }
 }
 
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 {
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
     VuVirtq *vq = vu_get_queue(vu_dev, idx);
 
+    /* Submit all requests popped in this iteration as one batch */
+    blk_io_plug(vexp->export.blk);
     while (1) {
         VuBlkReq *req;
 
@@ -97,6 +151,7 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
         vhost_user_server_ref(server);
         qemu_coroutine_enter(co);
     }
+    blk_io_unplug(vexp->export.blk);
 }
 
 static void vu_blk_queue_set_started(VuDev *vu_dev, int idx, bool started)
@@ -288,6 +343,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
 
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
+    vexp->notify_pending = bitmap_new(num_queues);
 
     blk_add_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                  vexp);
@@ -296,6 +352,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        g_free(vexp->notify_pending);
         g_free(vexp->handler.serial);
         return -EADDRNOTAVAIL;
     }
@@ -309,6 +366,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    g_free(vexp->notify_pending);
     g_free(vexp->handler.serial);
 }
 
@@ -2061,6 +2061,34 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+/*
+ * With aio=io_uring, run fallocate() in the io_uring instead of taking
+ * a trip through the thread pool.  Returns -ENOTSUP if this is not
+ * possible.  Callers fall back to the thread pool on -ENOTSUP, -EINVAL
+ * and -EBUSY, because the thread pool handlers know how to deal with
+ * file systems that return those errors.
+ */
+static int coroutine_fn raw_co_fallocate(BlockDriverState *bs, int mode,
+                                         int64_t offset, int64_t bytes)
+{
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_LIBURING_FALLOCATE)
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        return luring_co_fallocate(bs, aio, s->fd, mode, offset, bytes);
+    }
+#endif
+    return -ENOTSUP;
+}
+
+static bool raw_fallocate_needs_fallback(int ret)
+{
+    return ret == -ENOTSUP || ret == -EINVAL || ret == -EBUSY;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -2993,6 +3021,17 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    if (!blkdev && s->has_discard) {
+        ret = raw_co_fallocate(bs, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               offset, bytes);
+        if (!raw_fallocate_needs_fallback(ret)) {
+            raw_account_discard(s, bytes, ret);
+            return ret;
+        }
+    }
+#endif
+
     ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
     raw_account_discard(s, bytes, ret);
     return ret;
@@ -3068,6 +3107,29 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
+    /*
+     * Only the first attempt of the thread pool handlers is done through
+     * io_uring; if it fails, the handler goes through all the fallbacks.
+     */
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    if (!blkdev && (flags & BDRV_REQ_MAY_UNMAP)) {
+        int ret = raw_co_fallocate(bs,
+                                   FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                   offset, bytes);
+        if (!raw_fallocate_needs_fallback(ret)) {
+            return ret;
+        }
+    }
+#endif
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    if (!blkdev && !(flags & BDRV_REQ_MAY_UNMAP) && s->has_write_zeroes) {
+        int ret = raw_co_fallocate(bs, FALLOC_FL_ZERO_RANGE, offset, bytes);
+        if (!raw_fallocate_needs_fallback(ret)) {
+            return ret;
+        }
+    }
+#endif
+
     return raw_thread_pool_submit(bs, handler, &acb);
 }
 
@@ -57,6 +57,9 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* Whether the kernel supports IORING_OP_FALLOCATE */
+    bool has_fallocate;
 } LuringState;
 
 /**
@@ -163,10 +166,10 @@ static void luring_process_completions(LuringState *s)
 
         if (ret < 0) {
             /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
+             * Only writev/readv/fsync/fallocate requests on regular files or
+             * host block devices are submitted. Therefore -EAGAIN is not
+             * expected but it's known to happen sometimes with Linux SCSI.
+             * Submit again and hope the request completes successfully.
              *
              * For more information, see:
              * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
@@ -325,6 +328,33 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_queue_sqe:
+ * @luringcb: AIO control block, whose sqe has already been prepared
+ * @s: AIO state
+ *
+ * Adds the request to the pending queue, and submits it unless plugged
+ */
+static int luring_queue_sqe(LuringAIOCB *luringcb, LuringState *s)
+{
+    int ret;
+
+    io_uring_sqe_set_data(&luringcb->sqeq, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ret = ioq_submit(s);
+        trace_luring_do_submit_done(s, ret);
+        return ret;
+    }
+    return 0;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -339,7 +369,6 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
@@ -359,20 +388,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
-    io_uring_sqe_set_data(sqes, luringcb);
-
-    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
-    s->io_q.in_queue++;
-    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
-                           s->io_q.in_queue, s->io_q.in_flight);
-    if (!s->io_q.blocked &&
-        (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
-        ret = ioq_submit(s);
-        trace_luring_do_submit_done(s, ret);
-        return ret;
-    }
-    return 0;
+    return luring_queue_sqe(luringcb, s);
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
@@ -399,6 +415,35 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+#ifdef CONFIG_LIBURING_FALLOCATE
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t len)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+    };
+
+    if (!s->has_fallocate) {
+        return -ENOTSUP;
+    }
+
+    trace_luring_co_fallocate(bs, s, &luringcb, fd, mode, offset, len);
+    io_uring_prep_fallocate(&luringcb.sqeq, fd, mode, offset, len);
+    ret = luring_queue_sqe(&luringcb, s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+#endif
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false,
@@ -442,6 +487,18 @@ LuringState *luring_init(Error **errp)
     }
 #endif
 
+#ifdef CONFIG_LIBURING_FALLOCATE
+    {
+        struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+
+        if (probe) {
+            s->has_fallocate = io_uring_opcode_supported(probe,
+                                                         IORING_OP_FALLOCATE);
+            io_uring_free_probe(probe);
+        }
+    }
+#endif
+
     return s;
 }
 
@@ -29,6 +29,10 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* How often the in-flight limit and the convergence rate are updated */
+#define MIRROR_ADJUST_INTERVAL_NS (100 * SCALE_MS)
+#define MIRROR_RATE_INTERVAL_NS NANOSECONDS_PER_SECOND
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -73,7 +77,20 @@ typedef struct MirrorBlockJob {
 
     uint64_t last_pause_ns;
     unsigned long *in_flight_bitmap;
+    /* Chunks copied since the dirty bitmap iterator last wrapped around */
+    unsigned long *copied_bitmap;
+    /* Chunks copied in the previous pass; see mirror_next_dirty_locked() */
+    unsigned long *hot_bitmap;
     unsigned in_flight;
+    /* Adaptive limit for in_flight, see mirror_account_write() */
+    unsigned max_in_flight;
+    int64_t write_lat_ns;
+    int64_t write_lat_min_ns;
+    int64_t last_adjust_ns;
+    /* Bytes per second by which the remaining work shrinks */
+    int64_t convergence_rate;
+    int64_t last_remaining;
+    int64_t last_rate_ns;
     int64_t bytes_in_flight;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
@@ -238,9 +255,44 @@ static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
     mirror_iteration_done(op, ret);
 }
 
+/*
+ * Adapt the number of concurrent background operations to the latency of
+ * the target.  The limit grows while the write latency stays close to the
+ * lowest latency seen so far, and is halved once the target starts to
+ * queue requests.  With fewer operations in flight, mirror_iteration()
+ * issues larger requests instead.
+ */
+static void mirror_account_write(MirrorBlockJob *s, int64_t latency_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    s->write_lat_ns = s->write_lat_ns ?
+                      (7 * s->write_lat_ns + latency_ns) / 8 : latency_ns;
+    if (!s->write_lat_min_ns || s->write_lat_ns < s->write_lat_min_ns) {
+        s->write_lat_min_ns = s->write_lat_ns;
+    }
+
+    if (now - s->last_adjust_ns < MIRROR_ADJUST_INTERVAL_NS) {
+        return;
+    }
+    s->last_adjust_ns = now;
+
+    if (s->write_lat_ns < 2 * s->write_lat_min_ns) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT);
+    } else {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+    }
+    /* Let the baseline follow a target that got slower for good */
+    s->write_lat_min_ns += s->write_lat_min_ns / 64;
+
+    trace_mirror_adjust_in_flight(s, s->write_lat_ns, s->write_lat_min_ns,
+                                  s->max_in_flight);
+}
+
 static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
+    int64_t start_ns;
 
     if (ret < 0) {
         BlockErrorAction action;
@@ -255,7 +307,12 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
         return;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    if (ret >= 0) {
+        mirror_account_write(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                start_ns);
+    }
     mirror_write_complete(op, ret);
 }
 
@@ -473,6 +530,47 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+/*
+ * Return the offset of the next dirty chunk to copy.  Called with the dirty
+ * bitmap lock held.
+ *
+ * Chunks that were copied in the previous pass over the bitmap and are
+ * dirty again are hot: the guest keeps rewriting them, so copying them
+ * right away is likely wasted work.  Each of them is skipped once per pass
+ * so that cold data goes first.  The skip clears the chunk's bit in
+ * hot_bitmap, so the search terminates, but it can wrap around twice: the
+ * first wrap makes the chunks copied earlier in the current pass hot, and
+ * only once a whole pass has copied nothing is the hot set empty.
+ */
+static int64_t mirror_next_dirty_locked(MirrorBlockJob *s)
+{
+    for (;;) {
+        int64_t offset = bdrv_dirty_iter_next(s->dbi);
+
+        if (offset < 0) {
+            unsigned long *copied = s->copied_bitmap;
+
+            bdrv_set_dirty_iter(s->dbi, 0);
+            offset = bdrv_dirty_iter_next(s->dbi);
+            trace_mirror_restart_iter(s,
+                                      bdrv_get_dirty_count(s->dirty_bitmap));
+            assert(offset >= 0);
+
+            /* A new pass begins */
+            s->copied_bitmap = s->hot_bitmap;
+            s->hot_bitmap = copied;
+            bitmap_zero(s->copied_bitmap,
+                        DIV_ROUND_UP(s->bdev_length, s->granularity));
+        }
+
+        if (s->should_complete ||
+            !test_and_clear_bit(offset / s->granularity, s->hot_bitmap)) {
+            return offset;
+        }
+        trace_mirror_defer_hot_chunk(s, offset);
+    }
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
@@ -482,16 +580,11 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    /* Fewer concurrent operations mean larger requests */
+    int max_io_bytes = MAX(s->buf_size / s->max_in_flight, MAX_IO_BYTES);
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    offset = bdrv_dirty_iter_next(s->dbi);
-    if (offset < 0) {
-        bdrv_set_dirty_iter(s->dbi, 0);
-        offset = bdrv_dirty_iter_next(s->dbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
-        assert(offset >= 0);
-    }
+    offset = mirror_next_dirty_locked(s);
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
     mirror_wait_on_conflicts(NULL, s, offset, 1);
@@ -530,6 +623,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     bdrv_reset_dirty_bitmap_locked(s->dirty_bitmap, offset,
                                    nb_chunks * s->granularity);
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
+    bitmap_set(s->copied_bitmap, offset / s->granularity, nb_chunks);
 
     /* Before claiming an area in the in-flight bitmap, we have to
      * create a MirrorOp for it so that conflicting requests can wait
@@ -579,7 +673,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -888,6 +982,35 @@ static int mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+/*
+ * Track how fast the remaining work shrinks.  A negative rate means that
+ * the guest dirties data faster than the job copies it, i.e. the job does
+ * not converge.
+ */
+static void mirror_update_convergence_rate(MirrorBlockJob *s,
+                                           int64_t remaining)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed_ms, rate;
+
+    if (!s->last_rate_ns) {
+        s->last_rate_ns = now;
+        s->last_remaining = remaining;
+        return;
+    }
+    if (now - s->last_rate_ns < MIRROR_RATE_INTERVAL_NS) {
+        return;
+    }
+
+    elapsed_ms = (now - s->last_rate_ns) / SCALE_MS;
+    rate = (s->last_remaining - remaining) / elapsed_ms * 1000;
+    /* Only written here, but read by mirror_query() from the main loop */
+    qatomic_set_i64(&s->convergence_rate,
+                    (3 * s->convergence_rate + rate) / 4);
+    s->last_rate_ns = now;
+    s->last_remaining = remaining;
+}
+
 static int coroutine_fn mirror_run(Job *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -945,6 +1068,9 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
+    s->copied_bitmap = bitmap_new(length);
+    s->hot_bitmap = bitmap_new(length);
+    s->max_in_flight = MAX_IN_FLIGHT;
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -1010,6 +1136,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
          * the number of bytes currently being processed; together those are
          * the current remaining operation length */
         job_progress_set_remaining(&s->common.job, s->bytes_in_flight + cnt);
+        mirror_update_convergence_rate(s, s->bytes_in_flight + cnt);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that bdrv_drain_all() returns.
@@ -1018,7 +1145,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1107,6 +1234,8 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    g_free(s->copied_bitmap);
+    g_free(s->hot_bitmap);
     bdrv_dirty_iter_free(s->dbi);
 
     if (need_drain) {
@@ -1203,6 +1332,14 @@ static bool commit_active_cancel(Job *job, bool force)
     return force || !job_is_ready(job);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_convergence_rate = true;
+    info->convergence_rate = qatomic_read_i64(&s->convergence_rate);
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1217,6 +1354,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1233,6 +1371,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .cancel                 = commit_active_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
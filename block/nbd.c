@@ -35,6 +35,7 @@
 #include "qemu/option.h"
 #include "qemu/cutils.h"
 #include "qemu/main-loop.h"
+#include "qemu/error-report.h"
 
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/qmp/qstring.h"
@@ -49,6 +50,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_MULTI_CONN  16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -72,7 +74,7 @@ typedef struct BDRVNBDState {
 
     /*
      * Protects state, free_sema, in_flight, requests[].coroutine,
-     * reconnect_delay_timer.
+     * reconnect_delay_timer, reconnect_scheduled.
      */
     QemuMutex requests_lock;
     NBDClientState state;
@@ -80,6 +82,7 @@ typedef struct BDRVNBDState {
     unsigned in_flight;
     NBDClientRequest requests[MAX_NBD_REQUESTS];
     QEMUTimer *reconnect_delay_timer;
+    bool reconnect_scheduled;
 
     /* Protects sending data on the socket.  */
     CoMutex send_mutex;
@@ -107,13 +110,61 @@ typedef struct BDRVNBDState {
     bool alloc_depth;
 
     NBDClientConnection *conn;
+
+    /*
+     * All connections of the node, @conns[0] being the node state itself.
+     * With multi-conn, the additional connections are BDRVNBDState objects
+     * as well, but only their per-connection fields (channel, export info,
+     * request tracking and reconnect state) are used.  The connection
+     * parameters are always taken from the node state.
+     */
+    struct BDRVNBDState **conns;
+    unsigned nr_conns;
+    unsigned multi_conn; /* number of connections requested by the user */
+    unsigned next_conn;
 } BDRVNBDState;
 
 static void nbd_yank(void *opaque);
 
+/* Allocate an additional connection for the node state @s */
+static BDRVNBDState *nbd_conn_new(BDRVNBDState *s)
+{
+    BDRVNBDState *c = g_new0(BDRVNBDState, 1);
+
+    c->bs = s->bs;
+    c->reconnect_delay = s->reconnect_delay;
+    qemu_mutex_init(&c->requests_lock);
+    qemu_co_queue_init(&c->free_sema);
+    qemu_co_mutex_init(&c->send_mutex);
+    qemu_co_mutex_init(&c->receive_mutex);
+    c->conn = nbd_client_connection_new(s->saddr, true, s->export,
+                                        s->x_dirty_bitmap, s->tlscreds,
+                                        s->tlshostname);
+    return c;
+}
+
+static void nbd_conn_free(BDRVNBDState *c)
+{
+    /* Must not leave timers behind that would access freed data */
+    assert(!c->reconnect_delay_timer);
+    assert(!c->ioc);
+
+    nbd_client_connection_release(c->conn);
+    qemu_mutex_destroy(&c->requests_lock);
+    g_free(c);
+}
+
 static void nbd_clear_bdrvstate(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    unsigned i;
+
+    for (i = 1; i < s->nr_conns; i++) {
+        nbd_conn_free(s->conns[i]);
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nr_conns = 0;
 
     nbd_client_connection_release(s->conn);
     s->conn = NULL;
@@ -216,16 +267,14 @@ static void reconnect_delay_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
     timer_mod(s->reconnect_delay_timer, expire_time_ns);
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
     assert(!s->in_flight);
 
     if (s->ioc) {
         qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, s->bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
     }
@@ -271,26 +320,37 @@ static bool nbd_client_will_reconnect(BDRVNBDState *s)
 }
 
 /*
- * Update @bs with information learned during a completed negotiation process.
- * Return failure if the server's advertised options are incompatible with the
- * client's needs.
+ * Update the node with information learned during a completed negotiation
+ * process on connection @s.  Return failure if the server's advertised
+ * options are incompatible with the client's needs.
  */
-static int nbd_handle_updated_info(BlockDriverState *bs, Error **errp)
+static int nbd_handle_updated_info(BDRVNBDState *s, Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
+    BDRVNBDState *first = bs->opaque;
     int ret;
 
-    if (s->x_dirty_bitmap) {
+    if (first->x_dirty_bitmap) {
         if (!s->info.base_allocation) {
             error_setg(errp, "requested x-dirty-bitmap %s not found",
-                       s->x_dirty_bitmap);
+                       first->x_dirty_bitmap);
             return -EINVAL;
         }
-        if (strcmp(s->x_dirty_bitmap, "qemu:allocation-depth") == 0) {
+        if (strcmp(first->x_dirty_bitmap, "qemu:allocation-depth") == 0) {
             s->alloc_depth = true;
         }
     }
 
+    if (s != first &&
+        (s->info.size != first->info.size ||
+         s->info.flags != first->info.flags ||
+         s->info.structured_reply != first->info.structured_reply ||
+         s->info.base_allocation != first->info.base_allocation)) {
+        error_setg(errp, "NBD server reported different export properties "
+                   "on another connection");
+        return -EINVAL;
+    }
+
     if (s->info.flags & NBD_FLAG_READ_ONLY) {
         ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only", errp);
         if (ret < 0) {
@@ -310,17 +370,17 @@ static int nbd_handle_updated_info(BlockDriverState *bs, Error **errp)
         }
     }
 
-    trace_nbd_client_handshake_success(s->export);
+    trace_nbd_client_handshake_success(first->export);
 
     return 0;
 }
 
-int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
-                                                bool blocking, Error **errp)
+static int coroutine_fn nbd_co_establish_one_connection(BDRVNBDState *s,
+                                                        bool blocking,
+                                                        Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
     int ret;
-    IO_CODE();
 
     assert(!s->ioc);
 
@@ -330,9 +390,9 @@ int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
     }
 
     yank_register_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name), nbd_yank,
-                           bs);
+                           s);
 
-    ret = nbd_handle_updated_info(s->bs, NULL);
+    ret = nbd_handle_updated_info(s, errp);
     if (ret < 0) {
         /*
          * We have connected, but must fail for other reasons.
@@ -343,7 +403,7 @@ int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
         nbd_send_request(s->ioc, &request);
 
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
 
@@ -361,6 +421,49 @@ int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
     return 0;
 }
 
+/*
+ * Connect the node to the server.  If more than one connection was
+ * requested and the server allows it, the additional connections are
+ * opened as well; failing to open them is not fatal.
+ */
+int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
+                                                bool blocking, Error **errp)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int ret;
+    IO_CODE();
+
+    ret = nbd_co_establish_one_connection(s, blocking, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->nr_conns < s->multi_conn &&
+        !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        warn_report("NBD server does not allow multiple connections to "
+                    "export '%s', using a single connection",
+                    s->export ?: "");
+        return 0;
+    }
+
+    while (s->nr_conns < s->multi_conn) {
+        BDRVNBDState *c = nbd_conn_new(s);
+        Error *local_err = NULL;
+
+        ret = nbd_co_establish_one_connection(c, true, &local_err);
+        if (ret < 0) {
+            warn_reportf_err(local_err, "Using %u of %u NBD connections: ",
+                             s->nr_conns, s->multi_conn);
+            nbd_conn_free(c);
+            break;
+        }
+        nbd_client_connection_enable_retry(c->conn);
+        s->conns[s->nr_conns++] = c;
+    }
+
+    return 0;
+}
+
 /* Called with s->requests_lock held.  */
 static bool nbd_client_connecting(BDRVNBDState *s)
 {
@@ -398,13 +501,13 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
     if (s->ioc) {
         qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, s->bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
     }
 
     qemu_mutex_unlock(&s->requests_lock);
-    ret = nbd_co_do_establish_connection(s->bs, blocking, NULL);
+    ret = nbd_co_establish_one_connection(s, blocking, NULL);
     trace_nbd_reconnect_attempt_result(ret, s->bs->in_flight);
     qemu_mutex_lock(&s->requests_lock);
 
@@ -480,11 +583,78 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t handle)
     }
 }
 
-static int coroutine_fn nbd_co_send_request(BlockDriverState *bs,
+/*
+ * A connection that gave up waiting for the server gets no requests from
+ * nbd_pick_conn(), so nothing would drive its reconnection.  Check in the
+ * background whether the connection thread has reached the server again.
+ */
+static void coroutine_fn nbd_co_reconnect_conn(void *opaque)
+{
+    BDRVNBDState *c = opaque;
+    BlockDriverState *bs = c->bs;
+
+    WITH_QEMU_LOCK_GUARD(&c->requests_lock) {
+        c->reconnect_scheduled = false;
+        if (c->state == NBD_CLIENT_CONNECTING_NOWAIT && !c->in_flight) {
+            c->in_flight++;
+            nbd_reconnect_attempt(c);
+            c->in_flight--;
+            qemu_co_queue_restart_all(&c->free_sema);
+        }
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+/* Called with c->requests_lock held.  */
+static void nbd_schedule_reconnect(BDRVNBDState *c)
+{
+    if (c->reconnect_scheduled || c->in_flight) {
+        return;
+    }
+    c->reconnect_scheduled = true;
+    bdrv_inc_in_flight(c->bs);
+    aio_co_schedule(bdrv_get_aio_context(c->bs),
+                    qemu_coroutine_create(nbd_co_reconnect_conn, c));
+}
+
+/*
+ * Pick the connection for a new request of the node with state @s.
+ * Requests are spread round-robin over the connections that are up or
+ * waiting for a reconnect.  If there is none, the first connection is
+ * used and reports the error.
+ *
+ * With NBD_FLAG_CAN_MULTI_CONN, the server guarantees that a flush on any
+ * connection also covers the writes completed on the other ones, so any
+ * request type can go to any connection.
+ */
+static BDRVNBDState *nbd_pick_conn(BDRVNBDState *s)
+{
+    unsigned i;
+
+    if (s->nr_conns <= 1) {
+        return s;
+    }
+
+    for (i = 0; i < s->nr_conns; i++) {
+        BDRVNBDState *c = s->conns[qatomic_fetch_inc(&s->next_conn) %
+                                   s->nr_conns];
+
+        QEMU_LOCK_GUARD(&c->requests_lock);
+        if (c->state == NBD_CLIENT_CONNECTED ||
+            c->state == NBD_CLIENT_CONNECTING_WAIT) {
+            return c;
+        }
+        if (c->state == NBD_CLIENT_CONNECTING_NOWAIT) {
+            nbd_schedule_reconnect(c);
+        }
+    }
+    return s;
+}
+
+static int coroutine_fn nbd_co_send_request(BDRVNBDState *s,
                                             NBDRequest *request,
                                             QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
     qemu_mutex_lock(&s->requests_lock);
@@ -1175,7 +1345,7 @@ static int coroutine_fn nbd_co_request(BlockDriverState *bs, NBDRequest *request
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_pick_conn(bs->opaque);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1186,7 +1356,7 @@ static int coroutine_fn nbd_co_request(BlockDriverState *bs, NBDRequest *request
     }
 
     do {
-        ret = nbd_co_send_request(bs, request, write_qiov);
+        ret = nbd_co_send_request(s, request, write_qiov);
         if (ret < 0) {
             continue;
         }
@@ -1245,8 +1415,9 @@ static int coroutine_fn nbd_client_co_preadv(BlockDriverState *bs, int64_t offse
         request.len -= slop;
     }
 
+    s = nbd_pick_conn(s);
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1402,8 +1573,9 @@ static int coroutine_fn nbd_client_co_block_status(
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
+    s = nbd_pick_conn(s);
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1448,8 +1620,7 @@ static int nbd_client_reopen_prepare(BDRVReopenState *state,
 
 static void nbd_yank(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = opaque;
 
     QEMU_LOCK_GUARD(&s->requests_lock);
     qio_channel_shutdown(QIO_CHANNEL(s->ioc), QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -1460,12 +1631,17 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    unsigned i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
-    }
+    for (i = 0; i < s->nr_conns; i++) {
+        BDRVNBDState *c = s->conns[i];
+
+        if (c->ioc) {
+            nbd_send_request(c->ioc, &request);
+        }
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(c);
+    }
 }
 
 
@@ -1803,6 +1979,13 @@ static QemuOptsList nbd_runtime_opts = {
                     "attempts until successful or until @open-timeout seconds "
                     "have elapsed. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server if it "
+                    "allows multiple connections to the export.  Requests "
+                    "are spread over the connections. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1859,6 +2042,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
     s->open_timeout = qemu_opt_get_number(opts, "open-timeout", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_MULTI_CONN) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_MULTI_CONN);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1890,6 +2080,9 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     s->conn = nbd_client_connection_new(s->saddr, true, s->export,
                                         s->x_dirty_bitmap, s->tlscreds,
                                         s->tlshostname);
+    s->conns = g_new0(BDRVNBDState *, s->multi_conn);
+    s->conns[0] = s;
+    s->nr_conns = 1;
 
     if (s->open_timeout) {
         nbd_client_connection_enable_retry(s->conn);
@@ -2058,23 +2251,29 @@ static const char *const nbd_strong_runtime_opts[] = {
 
 static void nbd_cancel_in_flight(BlockDriverState *bs)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    reconnect_delay_timer_del(s);
+    for (i = 0; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
 
-    qemu_mutex_lock(&s->requests_lock);
-    if (s->state == NBD_CLIENT_CONNECTING_WAIT) {
-        s->state = NBD_CLIENT_CONNECTING_NOWAIT;
-    }
-    qemu_mutex_unlock(&s->requests_lock);
+        reconnect_delay_timer_del(s);
 
-    nbd_co_establish_connection_cancel(s->conn);
+        qemu_mutex_lock(&s->requests_lock);
+        if (s->state == NBD_CLIENT_CONNECTING_WAIT) {
+            s->state = NBD_CLIENT_CONNECTING_NOWAIT;
+        }
+        qemu_mutex_unlock(&s->requests_lock);
+
+        nbd_co_establish_connection_cancel(s->conn);
+    }
 }
 
 static void nbd_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
     BDRVNBDState *s = bs->opaque;
+    unsigned i;
 
     /* The open_timer is used only during nbd_open() */
     assert(!s->open_timer);
@@ -2088,22 +2287,32 @@ static void nbd_attach_aio_context(BlockDriverState *bs,
      * Since the AioContext can only be changed when a node is drained,
      * the reconnect_delay_timer cannot be active here.
      */
-    assert(!s->reconnect_delay_timer);
+    for (i = 0; i < s->nr_conns; i++) {
+        BDRVNBDState *c = s->conns[i];
 
-    if (s->ioc) {
-        qio_channel_attach_aio_context(s->ioc, new_context);
+        assert(!c->reconnect_delay_timer);
+
+        if (c->ioc) {
+            qio_channel_attach_aio_context(c->ioc, new_context);
+        }
     }
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    unsigned i;
 
     assert(!s->open_timer);
-    assert(!s->reconnect_delay_timer);
 
-    if (s->ioc) {
-        qio_channel_detach_aio_context(s->ioc);
+    for (i = 0; i < s->nr_conns; i++) {
+        BDRVNBDState *c = s->conns[i];
+
+        assert(!c->reconnect_delay_timer);
+
+        if (c->ioc) {
+            qio_channel_detach_aio_context(c->ioc);
+        }
     }
 }
 
@@ -33,6 +33,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
+#define NVME_MAX_IO_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -63,6 +64,8 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    /* If set, receives dword 0 of the completion queue entry */
+    uint32_t *result;
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -107,6 +110,8 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    /* Round-robin cursor used to spread requests over the I/O queues */
+    unsigned next_ioq;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -141,6 +146,9 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
+#define NVME_BLOCK_OPT_COMPLETION_BATCH "completion-batch"
+#define NVME_BLOCK_OPT_COMPLETION_BATCH_TIME "completion-batch-time"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -158,6 +166,23 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
+        {
+            .name = NVME_BLOCK_OPT_COMPLETION_BATCH,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of completions the controller may aggregate "
+                    "before raising an interrupt (default: 1, no batching)",
+        },
+        {
+            .name = NVME_BLOCK_OPT_COMPLETION_BATCH_TIME,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum time in microseconds the controller may delay "
+                    "an interrupt for completion batching (default: 0)",
+        },
         { /* end of list */ }
     },
 };
@@ -421,8 +446,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -499,7 +528,8 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+static int nvme_admin_cmd_sync_result(BlockDriverState *bs, NvmeCmd *cmd,
+                                      uint32_t *result)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -510,12 +540,18 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    return nvme_admin_cmd_sync_result(bs, cmd, NULL);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -679,12 +715,25 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
-        goto out_error;
+        goto out_delete_cq;
     }
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->queue_count++;
     return true;
+out_delete_cq:
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n),
+    };
+    if (nvme_admin_cmd_sync(bs, &cmd)) {
+        /*
+         * The controller may still post completions to the CQ, so its
+         * memory must stay mapped; leak the queue pair rather than free it.
+         */
+        warn_report("NVMe: failed to delete CQ io queue [%u]", n);
+        return false;
+    }
 out_error:
     nvme_free_queue_pair(q);
     return false;
@@ -721,8 +770,61 @@ static void nvme_poll_ready(EventNotifier *e)
     nvme_poll_queues(s);
 }
 
+/*
+ * Request @nr_io_queues I/O queue pairs.  Returns the number of queue
+ * pairs that the controller granted, at most @nr_io_queues, or 0 on
+ * failure.
+ */
+static unsigned nvme_set_queue_count(BlockDriverState *bs,
+                                     unsigned nr_io_queues, Error **errp)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) | (nr_io_queues - 1)),
+    };
+    uint32_t result;
+    unsigned nsqa, ncqa;
+
+    if (nvme_admin_cmd_sync_result(bs, &cmd, &result)) {
+        error_setg(errp, "Failed to request %u I/O queues", nr_io_queues);
+        return 0;
+    }
+
+    /* Both counts are zero-based */
+    nsqa = (result & 0xffff) + 1;
+    ncqa = (result >> 16) + 1;
+    return MIN(nr_io_queues, MIN(nsqa, ncqa));
+}
+
+/*
+ * Let the controller aggregate up to @batch completions, or delay the
+ * interrupt by up to @batch_time_us, before signalling the host.  This
+ * only affects I/O completion queues; the admin queue is never coalesced.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool nvme_set_completion_batching(BlockDriverState *bs, unsigned batch,
+                                         unsigned batch_time_us, Error **errp)
+{
+    /* Aggregation time is in 100 microsecond increments */
+    unsigned batch_time = DIV_ROUND_UP(batch_time_us, 100);
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_INTERRUPT_COALESCING),
+        .cdw11 = cpu_to_le32((batch_time << 8) | (batch - 1)),
+    };
+
+    if (nvme_admin_cmd_sync(bs, &cmd)) {
+        error_setg(errp, "Failed to configure NVMe interrupt coalescing");
+        return false;
+    }
+    return true;
+}
+
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned nr_io_queues, unsigned completion_batch,
+                     unsigned completion_batch_time, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -782,6 +884,13 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     s->page_size = 1u << (12 + NVME_CAP_MPSMIN(cap));
     s->doorbell_scale = (4 << NVME_CAP_DSTRD(cap)) / sizeof(uint32_t);
+    if (INDEX_IO(nr_io_queues) * s->doorbell_scale * sizeof(*s->doorbells) >
+        NVME_DOORBELL_SIZE) {
+        error_setg(errp, "Doorbell stride of the device is too large for "
+                   "%u I/O queues", nr_io_queues);
+        ret = -EINVAL;
+        goto out;
+    }
     bs->bl.opt_mem_alignment = s->page_size;
     bs->bl.request_alignment = s->page_size;
     timeout_ms = MIN(500 * NVME_CAP_TO(cap), 30000);
@@ -861,9 +970,42 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    if (nr_io_queues > 1) {
+        unsigned granted = nvme_set_queue_count(bs, nr_io_queues, errp);
+
+        if (!granted) {
+            ret = -EIO;
+            goto out;
+        }
+        if (granted < nr_io_queues) {
+            warn_report("NVMe: controller granted %u of %u I/O queues",
+                        granted, nr_io_queues);
+            nr_io_queues = granted;
+        }
+    }
+
+    if (completion_batch > 1 || completion_batch_time) {
+        if (!nvme_set_completion_batching(bs, completion_batch,
+                                          completion_batch_time, errp)) {
+            ret = -EIO;
+            goto out;
+        }
+    }
+
     /* Set up command queues. */
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
+        goto out;
+    }
+    for (unsigned i = 1; i < nr_io_queues; i++) {
+        Error *local_err = NULL;
+
+        /* Carry on with the queues that could be created */
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            warn_reportf_err(local_err, "Using %u of %u NVMe I/O queues: ",
+                             i, nr_io_queues);
+            break;
+        }
     }
 out:
     if (regs) {
@@ -954,6 +1096,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t nr_io_queues, completion_batch, completion_batch_time;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -969,7 +1112,31 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    nr_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES, 1);
+    if (nr_io_queues < 1 || nr_io_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 and %d",
+                   NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    completion_batch = qemu_opt_get_number(opts,
+                                           NVME_BLOCK_OPT_COMPLETION_BATCH, 1);
+    if (completion_batch < 1 || completion_batch > 256) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_COMPLETION_BATCH
+                   "' must be between 1 and 256");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    completion_batch_time =
+        qemu_opt_get_number(opts, NVME_BLOCK_OPT_COMPLETION_BATCH_TIME, 0);
+    if (completion_batch_time > 25500) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_COMPLETION_BATCH_TIME
+                   "' must not exceed 25500 microseconds");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, nr_io_queues, completion_batch,
+                    completion_batch_time, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1161,6 +1328,22 @@ static void nvme_rw_cb(void *opaque, int ret)
     replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
 }
 
+/*
+ * Pick the I/O queue pair for a new request.  Requests are spread
+ * round-robin so that the controller can process several submission
+ * queues in parallel.
+ */
+static NVMeQueuePair *nvme_get_ioq(BDRVNVMeState *s)
+{
+    unsigned n = s->queue_count - INDEX_IO(0);
+
+    assert(s->queue_count > 1);
+    if (n == 1) {
+        return s->queues[INDEX_IO(0)];
+    }
+    return s->queues[INDEX_IO(qatomic_fetch_inc(&s->next_ioq) % n)];
+}
+
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
                                             uint64_t offset, uint64_t bytes,
                                             QEMUIOVector *qiov,
@@ -1169,7 +1352,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_ioq(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1187,7 +1370,6 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->queue_count > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1288,7 +1470,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_ioq(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1299,7 +1481,6 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
         .ret = -EINPROGRESS,
     };
 
-    assert(s->queue_count > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1319,7 +1500,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_ioq(s);
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1361,7 +1542,6 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     cmd.cdw12 = cpu_to_le32(cdw12);
 
     trace_nvme_write_zeroes(s, offset, bytes, flags);
-    assert(s->queue_count > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1382,7 +1562,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_ioq(s);
     NVMeRequest *req;
     QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
     QEMUIOVector local_qiov;
@@ -1404,8 +1584,6 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         return -ENOTSUP;
     }
 
-    assert(s->queue_count > 1);
-
     /*
      * Filling the @buf requires @offset and @bytes to satisfy restrictions
      * defined in nvme_refresh_limits().
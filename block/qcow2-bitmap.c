@@ -28,6 +28,8 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
+#include "qemu/units.h"
 
 #include "qcow2.h"
 
@@ -45,6 +47,9 @@
 /* Size of bitmap table entries */
 #define BME_TABLE_ENTRY_SIZE (sizeof(uint64_t))
 
+/* Maximum size of a single read when loading contiguous bitmap clusters */
+#define BME_MAX_LOAD_SIZE (1 * MiB)
+
 QEMU_BUILD_BUG_ON(BME_MAX_NAME_SIZE != BDRV_BITMAP_MAX_NAME_SIZE);
 
 #if BME_MAX_TABLE_SIZE * 8ULL > INT_MAX
@@ -79,6 +84,12 @@ typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
 typedef struct Qcow2BitmapTable {
     uint64_t offset;
     uint32_t size; /* number of 64bit entries */
+    /*
+     * Entries whose data clusters are shared between an old and a new table
+     * of the same bitmap and must not be freed with this table; see
+     * store_bitmap_data().  Owned by the old table.
+     */
+    unsigned long *reused;
     QSIMPLEQ_ENTRY(Qcow2BitmapTable) entry;
 } Qcow2BitmapTable;
 
@@ -89,6 +100,8 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    /* Table that is being replaced by the one stored for dirty_bitmap */
+    Qcow2BitmapTable *old_table;
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -202,15 +215,20 @@ static int check_constraints_on_bitmap(BlockDriverState *bs,
     return 0;
 }
 
+/*
+ * Free the data clusters referenced by @bitmap_table, except for the
+ * entries set in @keep (if not NULL).
+ */
 static void clear_bitmap_table(BlockDriverState *bs, uint64_t *bitmap_table,
-                               uint32_t bitmap_table_size)
+                               uint32_t bitmap_table_size,
+                               const unsigned long *keep)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
 
     for (i = 0; i < bitmap_table_size; ++i) {
         uint64_t addr = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
-        if (!addr) {
+        if (!addr || (keep && test_bit(i, keep))) {
             continue;
         }
 
@@ -267,7 +285,7 @@ static int free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
         return ret;
     }
 
-    clear_bitmap_table(bs, bitmap_table, tb->size);
+    clear_bitmap_table(bs, bitmap_table, tb->size, tb->reused);
     qcow2_free_clusters(bs, tb->offset, tb->size * BME_TABLE_ENTRY_SIZE,
                         QCOW2_DISCARD_OTHER);
     g_free(bitmap_table);
@@ -291,7 +309,7 @@ static int load_bitmap_data(BlockDriverState *bs,
     uint64_t offset, limit;
     uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
     uint8_t *buf = NULL;
-    uint64_t i, tab_size =
+    uint64_t i, j, run, max_run, tab_size =
             size_to_clusters(s,
                 bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
 
@@ -299,29 +317,46 @@ static int load_bitmap_data(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    buf = g_malloc(s->cluster_size);
+    /* Clusters that are contiguous in the image are read in one go */
+    max_run = MAX(BME_MAX_LOAD_SIZE / s->cluster_size, 1);
+    buf = g_malloc(max_run * s->cluster_size);
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
-    for (i = 0, offset = 0; i < tab_size; ++i, offset += limit) {
-        uint64_t count = MIN(bm_size - offset, limit);
+    for (i = 0; i < tab_size; i += run) {
         uint64_t entry = bitmap_table[i];
         uint64_t data_offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
 
         assert(check_table_entry(entry, s->cluster_size) == 0);
 
+        run = 1;
+        offset = i * limit;
         if (data_offset == 0) {
             if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
-                bdrv_dirty_bitmap_deserialize_ones(bitmap, offset, count,
+                bdrv_dirty_bitmap_deserialize_ones(bitmap, offset,
+                                                   MIN(bm_size - offset, limit),
                                                    false);
             } else {
                 /* No need to deserialize zeros because the dirty bitmap is
                  * already cleared */
             }
-        } else {
-            ret = bdrv_pread(bs->file, data_offset, s->cluster_size, buf, 0);
-            if (ret < 0) {
-                goto finish;
-            }
-            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, offset, count,
+            continue;
+        }
+
+        while (i + run < tab_size && run < max_run &&
+               (bitmap_table[i + run] & BME_TABLE_ENTRY_OFFSET_MASK) ==
+               data_offset + run * s->cluster_size) {
+            run++;
+        }
+
+        ret = bdrv_pread(bs->file, data_offset, run * s->cluster_size, buf, 0);
+        if (ret < 0) {
+            goto finish;
+        }
+
+        for (j = 0; j < run; j++, offset += limit) {
+            bdrv_dirty_bitmap_deserialize_part(bitmap,
+                                               buf + j * s->cluster_size,
+                                               offset,
+                                               MIN(bm_size - offset, limit),
                                                false);
         }
     }
@@ -369,6 +404,12 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * Track which bitmap clusters change from now on, so that storing the
+     * bitmap can keep the clusters that still match the image.
+     */
+    bdrv_create_meta_dirty_bitmap(bitmap, s->cluster_size);
+
     g_free(bitmap_table);
     return bitmap;
 
@@ -1266,19 +1307,25 @@ out:
 
 /* store_bitmap_data()
  * Store bitmap to image, filling bitmap table accordingly.
+ *
+ * If @old_tb is the table that the bitmap was loaded from, clusters that
+ * did not change since then are not written again; the new table refers to
+ * the old data clusters instead, and old_tb->reused records them.
  */
 static uint64_t *store_bitmap_data(BlockDriverState *bs,
                                    BdrvDirtyBitmap *bitmap,
+                                   Qcow2BitmapTable *old_tb,
                                    uint32_t *bitmap_table_size, Error **errp)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
     int64_t offset;
-    uint64_t limit;
+    uint64_t limit, cluster;
     uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
     const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
     uint8_t *buf = NULL;
     uint64_t *tb;
+    uint64_t *old_table = NULL;
     uint64_t tb_size =
             size_to_clusters(s,
                 bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
@@ -1296,25 +1343,42 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
         return NULL;
     }
 
+    if (old_tb && tb_size && old_tb->size == tb_size &&
+        bitmap_table_load(bs, old_tb, &old_table) == 0)
+    {
+        old_tb->reused = bitmap_new(tb_size);
+    }
+
     buf = g_malloc(s->cluster_size);
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
     assert(DIV_ROUND_UP(bm_size, limit) == tb_size);
 
-    offset = 0;
-    while ((offset = bdrv_dirty_bitmap_next_dirty(bitmap, offset, INT64_MAX))
-           >= 0)
+    for (cluster = 0, offset = 0; cluster < tb_size;
+         cluster++, offset += limit)
     {
-        uint64_t cluster = offset / limit;
-        uint64_t end, write_size;
+        uint64_t end = MIN(bm_size, offset + limit);
+        uint64_t write_size;
         int64_t off;
 
-        /*
-         * We found the first dirty offset, but want to write out the
-         * entire cluster of the bitmap that includes that offset,
-         * including any leading zero bits.
-         */
-        offset = QEMU_ALIGN_DOWN(offset, limit);
-        end = MIN(bm_size, offset + limit);
+        if (old_table &&
+            !bdrv_dirty_bitmap_get_meta(bitmap, offset, end - offset))
+        {
+            tb[cluster] = old_table[cluster];
+            if (tb[cluster] & BME_TABLE_ENTRY_OFFSET_MASK) {
+                set_bit(cluster, old_tb->reused);
+            }
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, end - offset) < 0) {
+            /* All zeroes, tb[cluster] is already 0 */
+            continue;
+        }
+        if (bdrv_dirty_bitmap_next_zero(bitmap, offset, end - offset) < 0) {
+            tb[cluster] = BME_TABLE_ENTRY_FLAG_ALL_ONES;
+            continue;
+        }
+
         write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
                                                           end - offset);
         assert(write_size <= s->cluster_size);
@@ -1345,19 +1409,23 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
                              bm_name);
             goto fail;
         }
-
-        offset = end;
     }
 
     *bitmap_table_size = tb_size;
     g_free(buf);
+    g_free(old_table);
 
     return tb;
 
 fail:
-    clear_bitmap_table(bs, tb, tb_size);
+    clear_bitmap_table(bs, tb, tb_size, old_tb ? old_tb->reused : NULL);
+    if (old_tb) {
+        g_free(old_tb->reused);
+        old_tb->reused = NULL;
+    }
     g_free(buf);
     g_free(tb);
+    g_free(old_table);
 
     return NULL;
 }
@@ -1379,7 +1447,7 @@ static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 
     bm_name = bdrv_dirty_bitmap_name(bitmap);
 
-    tb = store_bitmap_data(bs, bitmap, &tb_size, errp);
+    tb = store_bitmap_data(bs, bitmap, bm->old_table, &tb_size, errp);
     if (tb == NULL) {
         return -EINVAL;
     }
@@ -1413,11 +1481,17 @@ static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 
     bm->table.offset = tb_offset;
     bm->table.size = tb_size;
+    bm->table.reused = bm->old_table ? bm->old_table->reused : NULL;
 
     return 0;
 
 fail:
-    clear_bitmap_table(bs, tb, tb_size);
+    clear_bitmap_table(bs, tb, tb_size,
+                       bm->old_table ? bm->old_table->reused : NULL);
+    if (bm->old_table) {
+        g_free(bm->old_table->reused);
+        bm->old_table->reused = NULL;
+    }
 
     if (tb_offset > 0) {
         qcow2_free_clusters(bs, tb_offset, tb_size * sizeof(tb[0]),
@@ -1603,6 +1677,7 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             bm->table.offset = 0;
             bm->table.size = 0;
             QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            bm->old_table = tb;
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1638,13 +1713,24 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
         goto fail;
     }
 
-    /* Bitmap directory was successfully updated, so, old data can be dropped.
-     * TODO it is better to reuse these clusters */
+    /*
+     * Bitmap directory was successfully updated, so, old data can be dropped,
+     * except for the clusters that the new tables still use.
+     */
     QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
         free_bitmap_clusters(bs, tb);
+        g_free(tb->reused);
         g_free(tb);
     }
 
+    /* The image is now up to date with all stored bitmaps */
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->dirty_bitmap &&
+            !bdrv_dirty_bitmap_readonly(bm->dirty_bitmap)) {
+            bdrv_dirty_bitmap_reset_meta(bm->dirty_bitmap);
+        }
+    }
+
 success:
     if (release_stored) {
         QSIMPLEQ_FOREACH(bm, bm_list, entry) {
@@ -1671,6 +1757,7 @@ fail:
     }
 
     QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
+        g_free(tb->reused);
         g_free(tb);
     }
 
@@ -39,6 +39,12 @@ static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
 static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
 
+/*
+ * Length of the interval covered by the budget that is handed out to each
+ * member of a group, see throttle_group_grant_credit()
+ */
+#define THROTTLE_GROUP_CREDIT_NS (10 * SCALE_MS)
+
 /* The ThrottleGroup structure (with its ThrottleState) is shared
  * among different ThrottleGroupMembers and it's independent from
  * AioContext, so in order to use it from different threads it needs
@@ -62,6 +68,13 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Going through the lock for every single request does not scale when many
+ * members in different iothreads share a group, so when nobody else is
+ * waiting the group hands out a share of its budget to the member that just
+ * got a request through. The budget is charged to the group in advance and
+ * the following requests of that member consume it without taking the lock
+ * until it runs out or expires, see throttle_group_take_credit().
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,11 +83,14 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
+    unsigned nr_members;
+    /* Incremented when the configuration changes, also read atomically */
+    unsigned credit_epoch;
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
@@ -292,6 +308,119 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     return must_wait;
 }
 
+/*
+ * Try to account an I/O request against the local budget of a
+ * ThrottleGroupMember, without taking the ThrottleGroup lock.
+ *
+ * This must be called from tgm->aio_context.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the request was accounted
+ */
+static bool throttle_group_take_credit(ThrottleGroupMember *tgm,
+                                       int64_t bytes, bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleCredit *credit = &tgm->credit[is_write];
+    double units = 1.0;
+
+    /* Requests of this type queued before us must go first */
+    if (!credit->expires || tgm->pending_reqs[is_write]) {
+        return false;
+    }
+
+    if (credit->epoch != qatomic_read(&tg->credit_epoch) ||
+        qemu_clock_get_ns(tg->clock_type) >= credit->expires) {
+        return false;
+    }
+
+    /* Same as throttle_account() */
+    if (credit->op_size && bytes > credit->op_size) {
+        units = (double) bytes / credit->op_size;
+    }
+
+    if (credit->bytes < bytes || credit->units < units) {
+        return false;
+    }
+
+    credit->bytes -= bytes;
+    credit->units -= units;
+    return true;
+}
+
+/*
+ * Give the unused local budget of a ThrottleGroupMember back to the group.
+ * The budget is simply dropped if the configuration has changed in the
+ * meantime, because throttle_config() resets the buckets anyway.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_return_credit(ThrottleGroupMember *tgm,
+                                         bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleCredit *credit = &tgm->credit[is_write];
+
+    if (credit->expires && credit->epoch == tg->credit_epoch) {
+        throttle_charge(ts, is_write, -credit->bytes, -credit->units);
+    }
+    credit->expires = 0;
+}
+
+/*
+ * Hand out a share of the group budget to a ThrottleGroupMember so that its
+ * next requests can skip the ThrottleGroup lock. The share covers
+ * THROTTLE_GROUP_CREDIT_NS worth of the average limits split evenly among
+ * the members, and it is charged to the group right away so the group
+ * limits still hold. Nothing is handed out while requests are waiting in
+ * the group, so they still get served in round-robin order.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_grant_credit(ThrottleGroupMember *tgm,
+                                        bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleCredit *credit = &tgm->credit[is_write];
+    double bytes, units;
+
+    if (qatomic_read(&tgm->io_limits_disabled) ||
+        tg->any_timer_armed[is_write] ||
+        tgm_has_pending_reqs(tgm, is_write) ||
+        next_throttle_token(tgm, is_write) != tgm) {
+        return;
+    }
+
+    throttle_get_budget(ts, is_write, THROTTLE_GROUP_CREDIT_NS,
+                        &bytes, &units);
+    bytes /= tg->nr_members;
+    units /= tg->nr_members;
+
+    /* Not worth it if the limits are that low, take the slow path instead */
+    if (bytes < 1 || units < 1) {
+        return;
+    }
+
+    throttle_charge(ts, is_write, bytes, units);
+
+    credit->bytes = bytes;
+    credit->units = units;
+    credit->op_size = ts->cfg.op_size;
+    credit->epoch = tg->credit_epoch;
+    credit->expires = qemu_clock_get_ns(tg->clock_type) +
+                      THROTTLE_GROUP_CREDIT_NS;
+}
+
 /* Start the next pending I/O request for a ThrottleGroupMember. Return whether
  * any request was actually pending.
  *
@@ -367,8 +496,16 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    /* Fast path: the request fits in the local budget */
+    if (throttle_group_take_credit(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* Whatever is left of the local budget is of no use now */
+    throttle_group_return_credit(tgm, is_write);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -391,6 +528,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /* Let the next requests skip the lock if nobody else is waiting */
+    throttle_group_grant_credit(tgm, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -439,7 +579,9 @@ static void throttle_group_restart_queue(ThrottleGroupMember *tgm, bool is_write
 
     qatomic_inc(&tgm->restart_pending);
 
-    co = qemu_coroutine_create(throttle_group_restart_queue_entry, rd);
+    /* This only wakes up other coroutines, a small stack is enough */
+    co = qemu_coroutine_create_with_stack(throttle_group_restart_queue_entry,
+                                          rd, COROUTINE_STACK_SMALL);
     aio_co_enter(tgm->aio_context, co);
 }
 
@@ -475,6 +617,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    qatomic_set(&tg->credit_epoch, tg->credit_epoch + 1);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -558,6 +701,8 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
+    memset(tgm->credit, 0, sizeof(tgm->credit));
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -600,6 +745,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[i] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[i]));
             assert(!timer_pending(tgm->throttle_timers.timers[i]));
+            throttle_group_return_credit(tgm, i);
             if (tg->tokens[i] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -612,6 +758,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nr_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -900,6 +1047,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    qatomic_set(&tg->credit_epoch, tg->credit_epoch + 1);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -339,6 +339,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
     info->status    = job->job.status;
     info->auto_finalize = job->job.auto_finalize;
     info->auto_dismiss  = job->job.auto_dismiss;
+    if (block_job_driver(job)->query) {
+        block_job_driver(job)->query(job, info);
+    }
     if (job->job.ret) {
         info->has_error = true;
         info->error = job->job.err ?
@@ -358,6 +358,23 @@ SRST
     Show host USB devices.
 ERST
 
+    {
+        .name       = "virtio-batch",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show virtqueue batch size and notification statistics",
+        .cmd_info_hrt = qmp_x_query_virtio_batch,
+    },
+
+SRST
+  ``info virtio-batch``
+    Show, for each virtqueue, how many elements were popped from and
+    returned to the ring at once.  For virtqueues that coalesce
+    notifications (``notify-max-usecs``), also show the number of
+    interrupts, the average number of used elements per interrupt and the
+    average time an interrupt was held back.
+ERST
+
 #if defined(CONFIG_TCG)
     {
         .name       = "profile",
@@ -673,6 +690,25 @@ SRST
     Show iothread's identifiers.
 ERST
 
+    {
+        .name       = "aio",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show time spent in event loop callbacks",
+        .cmd        = hmp_info_aio,
+        .flags      = "p",
+    },
+
+SRST
+  ``info aio``
+    Show how often the main loop and each iothread invoked each file
+    descriptor handler, bottom half and timer callback, and how much time
+    they spent in it.  The file descriptor handlers of devices and backends
+    run in the main loop and are listed under ``iohandler``.  For event
+    loops that have a thread pool, also show how many of its requests
+    completed within each latency range.
+ERST
+
     {
         .name       = "rocker",
         .args_type  = "name:s",
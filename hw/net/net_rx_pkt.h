@@ -19,6 +19,7 @@
 #define NET_RX_PKT_H
 
 #include "net/eth.h"
+#include "net/checksum.h"
 
 /* defines to enable packet dump functions */
 /*#define NET_RX_PKT_DEBUG*/
@@ -154,6 +155,20 @@ net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
                          NetRxPktRssType type,
                          uint8_t *key);
 
+/**
+ * calculates RSS hash for packet with a precomputed Toeplitz table
+ *
+ * @pkt:            packet
+ * @type:           RSS hash type
+ * @table:          table built from the hash key by net_toeplitz_table_init()
+ *
+ * Return:  Toeplitz RSS hash, same as net_rx_pkt_calc_rss_hash().
+ */
+uint32_t
+net_rx_pkt_calc_rss_hash_table(struct NetRxPkt *pkt,
+                               NetRxPktRssType type,
+                               const NetToeplitzTable *table);
+
 /**
 * fetches IP identification for the packet
 *
@@ -31,6 +31,7 @@
 #include "net/vhost_net.h"
 #include "net/announce.h"
 #include "hw/virtio/virtio-bus.h"
+#include "block/aio-wait.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/qdev-properties.h"
@@ -59,6 +60,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Packets popped from the tx virtqueue at once by virtio_net_flush_tx() */
+#define VIRTIO_NET_TX_BATCH 64
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -353,11 +357,406 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/*
+ * Queue pairs that are bound to an IOThread are protected by the AioContext
+ * lock of that IOThread rather than by the QEMU global mutex.  Code that
+ * runs under the global mutex and touches per-queue state, or state that
+ * the datapath reads, must hold the lock of every queue pair.
+ */
+static void virtio_net_queue_acquire(VirtIONetQueue *q)
+{
+    if (q->iothread) {
+        aio_context_acquire(q->ctx);
+    }
+}
+
+static void virtio_net_queue_release(VirtIONetQueue *q)
+{
+    if (q->iothread) {
+        aio_context_release(q->ctx);
+    }
+}
+
+static void virtio_net_acquire_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        virtio_net_queue_acquire(&n->vqs[i]);
+    }
+}
+
+static void virtio_net_release_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = n->max_queue_pairs - 1; i >= 0; i--) {
+        virtio_net_queue_release(&n->vqs[i]);
+    }
+}
+
+/*
+ * Software RSS can pick a queue pair that is served by another IOThread.
+ * Such packets are copied to a backlog of the destination queue and
+ * delivered from its own AioContext; the backlog is bounded like a NIC
+ * ring, and packets that do not fit are dropped.
+ */
+#define VIRTIO_NET_RSS_BACKLOG 256
+
+typedef struct VirtIONetRssPacket {
+    QSIMPLEQ_ENTRY(VirtIONetRssPacket) next;
+    size_t size;
+    uint8_t data[];
+} VirtIONetRssPacket;
+
+/* Context: any thread */
+static void virtio_net_rss_backlog_add(VirtIONetQueue *q, const uint8_t *buf,
+                                       size_t size)
+{
+    VirtIONetRssPacket *pkt;
+
+    QEMU_LOCK_GUARD(&q->rss_lock);
+
+    if (q->rss_backlog_len >= VIRTIO_NET_RSS_BACKLOG) {
+        trace_virtio_net_rss_backlog_drop(q, size);
+        return;
+    }
+
+    pkt = g_malloc(sizeof(*pkt) + size);
+    pkt->size = size;
+    memcpy(pkt->data, buf, size);
+    QSIMPLEQ_INSERT_TAIL(&q->rss_backlog, pkt, next);
+    q->rss_backlog_len++;
+    qemu_bh_schedule(q->rss_bh);
+}
+
+static VirtIONetRssPacket *virtio_net_rss_backlog_peek(VirtIONetQueue *q)
+{
+    QEMU_LOCK_GUARD(&q->rss_lock);
+    return QSIMPLEQ_FIRST(&q->rss_backlog);
+}
+
+static void virtio_net_rss_backlog_pop(VirtIONetQueue *q)
+{
+    VirtIONetRssPacket *pkt;
+
+    qemu_mutex_lock(&q->rss_lock);
+    pkt = QSIMPLEQ_FIRST(&q->rss_backlog);
+    QSIMPLEQ_REMOVE_HEAD(&q->rss_backlog, next);
+    q->rss_backlog_len--;
+    qemu_mutex_unlock(&q->rss_lock);
+    g_free(pkt);
+}
+
+/* Context: queue pair lock held */
+static void virtio_net_rss_backlog_purge(VirtIONetQueue *q)
+{
+    if (!q->rss_bh) {
+        return;
+    }
+    while (virtio_net_rss_backlog_peek(q)) {
+        virtio_net_rss_backlog_pop(q);
+    }
+}
+
+/* Context: queue pair lock held */
+static void virtio_net_rss_backlog_kick(VirtIONetQueue *q)
+{
+    if (q->rss_bh && qatomic_read(&q->rss_backlog_len)) {
+        qemu_bh_schedule(q->rss_bh);
+    }
+}
+
+static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, bool no_rss,
+                                      const struct virtio_net_hdr *gro_hdr);
+
+/* Context: BH in IOThread */
+static void virtio_net_rss_backlog_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    VirtIONetRssPacket *pkt;
+
+    virtio_net_queue_acquire(q);
+    /* Like the TX bottom half, stay away from a queue owned by the main loop */
+    while (n->dataplane_started && (pkt = virtio_net_rss_backlog_peek(q))) {
+        ssize_t ret;
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = virtio_net_receive_rcu(nc, pkt->data, pkt->size, true,
+                                         NULL);
+        }
+        if (ret <= 0) {
+            /* Out of rx buffers; virtio_net_handle_rx() kicks us again */
+            break;
+        }
+        virtio_net_rss_backlog_pop(q);
+    }
+    virtio_net_queue_release(q);
+}
+
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static bool virtio_net_dataplane_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(n));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_auto(GStrv) ids = NULL;
+    int i, num_ids;
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp, "device is incompatible with iothreads "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothreads");
+        return false;
+    }
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT) ||
+        n->gro) {
+        error_setg(errp, "iothreads cannot be used with guest_rsc_ext or gro");
+        return false;
+    }
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!peer || !peer->info->set_aio_context) {
+            error_setg(errp, "iothreads require a tap or af-xdp netdev");
+            return false;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothreads cannot be used with vhost");
+            return false;
+        }
+    }
+
+    ids = g_strsplit(n->net_conf.iothreads, ":", -1);
+    num_ids = g_strv_length(ids);
+    if (!num_ids) {
+        error_setg(errp, "'iothreads' must list at least one iothread");
+        return false;
+    }
+
+    /*
+     * Queue pair i is served by iothread i modulo the number of iothreads,
+     * so that e.g. iothreads=io0:io1 with four queue pairs spreads them
+     * over two host threads.
+     */
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        IOThread *iothread = iothread_by_id(ids[i % num_ids]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", ids[i % num_ids]);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        q->iothread = iothread;
+        q->ctx = iothread_get_aio_context(iothread);
+    }
+
+    /* Guest notifier masking is only implemented by vhost */
+    vdev->use_guest_notifier_mask = false;
+    return true;
+}
+
+static void virtio_net_dataplane_cleanup(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->iothread) {
+            object_unref(OBJECT(q->iothread));
+            q->iothread = NULL;
+            q->ctx = NULL;
+        }
+    }
+}
+
+static bool virtio_net_dataplane_wanted(VirtIONet *n, uint8_t status)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    return n->vqs[0].iothread && (status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+        vdev->vm_running;
+}
+
+/* Context: QEMU global mutex held, no queue pair lock held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(n));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+    int nvqs = queue_pairs * 2;
+    int i, r;
+
+    if (n->dataplane_started) {
+        return;
+    }
+
+    /*
+     * Like vhost, take the host notifiers away from the transport's own
+     * ioeventfd handling: virtio_pci_start_ioeventfd() runs right after
+     * virtio_set_status() and must not assign them a second time, and
+     * stopping the VM must not tear them down behind our back.
+     */
+    r = virtio_device_grab_ioeventfd(vdev);
+    if (r < 0) {
+        error_report("virtio-net failed to grab ioeventfd (%d)", r);
+        goto fail_grab_ioeventfd;
+    }
+
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d)", r);
+        goto fail_guest_notifiers;
+    }
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            int j = i;
+
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+
+            /*
+             * The transaction expects the ioeventfds to be open when it
+             * commits. Do it now, before the cleanup loop.
+             */
+            memory_region_transaction_commit();
+
+            while (j--) {
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), j);
+            }
+            goto fail_host_notifiers;
+        }
+    }
+
+    memory_region_transaction_commit();
+
+    n->dataplane_started = true;
+    trace_virtio_net_dataplane_start(n, queue_pairs);
+
+    for (i = 0; i < queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        aio_context_acquire(q->ctx);
+        qemu_set_aio_context(nc->peer, q->ctx);
+        virtio_queue_aio_attach_host_notifier(q->rx_vq, q->ctx);
+        virtio_queue_aio_attach_host_notifier(q->tx_vq, q->ctx);
+        aio_context_release(q->ctx);
+
+        /* Kick right away to pick up buffers that are already in the vring */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+    }
+    return;
+
+fail_host_notifiers:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+fail_guest_notifiers:
+    virtio_device_release_ioeventfd(vdev);
+fail_grab_ioeventfd:
+    virtio_error(vdev, "virtio-net failed to start iothread datapath");
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, q->ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, q->ctx);
+    qemu_set_aio_context(nc->peer, NULL);
+}
+
+/* Context: QEMU global mutex held, no queue pair lock held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(n));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+    int nvqs = queue_pairs * 2;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    trace_virtio_net_dataplane_stop(n);
+
+    /*
+     * Detach in the IOThread itself, so that no handler is running there
+     * once the tap is handed back to the main loop.
+     */
+    for (i = 0; i < queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        aio_context_release(q->ctx);
+    }
+
+    /* From here on the datapath runs under the QEMU global mutex again */
+    n->dataplane_started = false;
+
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /*
+     * The transaction expects the ioeventfds to be open when it
+     * commits. Do it now, before the cleanup loop.
+     */
+    memory_region_transaction_commit();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+
+    /* Hands the notifiers back to the transport if ioeventfd is running */
+    virtio_device_release_ioeventfd(vdev);
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -367,10 +766,20 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
+    bool dataplane = virtio_net_dataplane_wanted(n, status);
+
+    if (!dataplane) {
+        virtio_net_dataplane_stop(n);
+    }
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    if (dataplane) {
+        virtio_net_dataplane_start(n);
+    }
+
+    virtio_net_acquire_queues(n);
     for (i = 0; i < n->max_queue_pairs; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -386,6 +795,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
+            virtio_net_rss_backlog_kick(q);
         }
 
         if (!q->tx_waiting) {
@@ -416,6 +826,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_release_queues(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -561,10 +972,14 @@ static void virtio_net_reset(VirtIODevice *vdev)
     /* Flush any async TX */
     for (i = 0;  i < n->max_queue_pairs; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
+        VirtIONetQueue *q = virtio_net_get_subqueue(nc);
 
         if (nc->peer) {
+            virtio_net_queue_acquire(q);
             qemu_flush_or_purge_queued_packets(nc->peer, true);
-            assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
+            assert(!q->async_tx.elem);
+            virtio_net_rss_backlog_purge(q);
+            virtio_net_queue_release(q);
         }
     }
 }
@@ -726,9 +1141,12 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        /* With gro, QEMU itself builds TSO packets for the guest */
+        if (!n->gro) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
 
         virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
@@ -876,6 +1294,23 @@ static void failover_add_primary(VirtIONet *n, Error **errp)
     error_propagate(errp, err);
 }
 
+/*
+ * Receive segment coalescing runs for guests that negotiated guest_rsc_ext,
+ * and as host GRO for peers without a virtio-net header.  Both need the
+ * guest to accept TSO packets of the protocol.
+ */
+static void virtio_net_update_rsc(VirtIONet *n, uint64_t offloads)
+{
+    bool gro = n->gro && !n->has_vnet_hdr &&
+               virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_CSUM);
+    bool rsc = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) || gro;
+
+    n->rsc4_enabled = rsc &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
+    n->rsc6_enabled = rsc &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+}
+
 static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -887,6 +1322,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         features &= ~(1ULL << VIRTIO_NET_F_MTU);
     }
 
+    virtio_net_acquire_queues(n);
     virtio_net_set_multiqueue(n,
                               virtio_has_feature(features, VIRTIO_NET_F_RSS) ||
                               virtio_has_feature(features, VIRTIO_NET_F_MQ));
@@ -899,10 +1335,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_HASH_REPORT));
 
-    n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
-        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
-    n->rsc6_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
-        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
+    virtio_net_update_rsc(n, features);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
 
     if (n->has_vnet_hdr) {
@@ -925,6 +1358,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     } else {
         memset(n->vlans, 0xff, MAX_VLAN >> 3);
     }
+    virtio_net_release_queues(n);
 
     if (virtio_has_feature(features, VIRTIO_NET_F_STANDBY)) {
         qapi_event_send_failover_negotiated(n->netclient_name);
@@ -994,14 +1428,11 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->gro) {
             return VIRTIO_NET_ERR;
         }
 
-        n->rsc4_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
-            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
-        n->rsc6_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
-            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+        virtio_net_update_rsc(n, offloads);
         virtio_clear_feature(&offloads, VIRTIO_NET_F_RSC_EXT);
 
         supported_offloads = virtio_net_supported_guest_offloads(n);
@@ -1010,7 +1441,9 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -1161,6 +1594,15 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
 
 static void virtio_net_detach_epbf_rss(VirtIONet *n);
 
+static void virtio_net_rss_init_toeplitz(VirtIONet *n)
+{
+    if (!n->rss_data.toeplitz) {
+        n->rss_data.toeplitz = g_new(NetToeplitzTable, 1);
+    }
+    net_toeplitz_table_init(n->rss_data.toeplitz, n->rss_data.key,
+                            sizeof(n->rss_data.key));
+}
+
 static void virtio_net_disable_rss(VirtIONet *n)
 {
     if (n->rss_data.enabled) {
@@ -1364,6 +1806,9 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         virtio_net_detach_epbf_rss(n);
         n->rss_data.enabled_software_rss = true;
     }
+    if (n->rss_data.enabled_software_rss) {
+        virtio_net_rss_init_toeplitz(n);
+    }
 
     trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                 n->rss_data.indirections_len,
@@ -1478,8 +1923,11 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
 
+    /* Commands change filters and offloads that the datapath reads */
+    virtio_net_acquire_queues(n);
     for (;;) {
         size_t written;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -1499,6 +1947,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+    virtio_net_release_queues(n);
 }
 
 /* RX */
@@ -1507,8 +1956,12 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    VirtIONetQueue *q = &n->vqs[queue_index];
 
+    virtio_net_queue_acquire(q);
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    virtio_net_rss_backlog_kick(q);
+    virtio_net_queue_release(q);
 }
 
 static bool virtio_net_can_receive(NetClientState *nc)
@@ -1715,7 +2168,7 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     unsigned int index = nc->queue_index, new_index = index;
-    struct NetRxPkt *pkt = n->rx_pkt;
+    struct NetRxPkt *pkt = virtio_net_get_subqueue(nc)->rx_pkt;
     uint8_t net_hash_type;
     uint32_t hash;
     bool isip4, isip6, isudp, istcp;
@@ -1749,7 +2202,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
         return n->rss_data.redirect ? n->rss_data.default_queue : -1;
     }
 
-    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, n->rss_data.key);
+    hash = net_rx_pkt_calc_rss_hash_table(pkt, net_hash_type,
+                                          n->rss_data.toeplitz);
 
     if (n->rss_data.populate_hash) {
         virtio_set_packet_hash(buf, reports[net_hash_type], hash);
@@ -1764,7 +2218,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
 }
 
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size, bool no_rss)
+                                      size_t size, bool no_rss,
+                                      const struct virtio_net_hdr *gro_hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1783,9 +2238,15 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 
     if (!no_rss && n->rss_data.enabled && n->rss_data.enabled_software_rss) {
         int index = virtio_net_process_rss(nc, buf, size);
-        if (index >= 0) {
+
+        if (index >= 0 && n->dataplane_started &&
+            n->vqs[index].ctx != q->ctx) {
+            /* Served by another IOThread, which cannot be entered here */
+            virtio_net_rss_backlog_add(&n->vqs[index], buf, size);
+            return size;
+        } else if (index >= 0) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
-            return virtio_net_receive_rcu(nc2, buf, size, true);
+            return virtio_net_receive_rcu(nc2, buf, size, true, gro_hdr);
         }
     }
 
@@ -1846,7 +2307,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            if (gro_hdr) {
+                iov_from_buf(sg, elem->in_num, 0, gro_hdr, sizeof(*gro_hdr));
+            } else {
+                receive_header(n, sg, elem->in_num, buf, size);
+            }
             if (n->rss_data.populate_hash) {
                 offset = sizeof(mhdr);
                 iov_from_buf(sg, elem->in_num, offset,
@@ -1893,7 +2358,12 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (nc->peer && nc->peer->sending_batch) {
+        /* Notify once in virtio_net_receive_batch_end() */
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 
@@ -1906,12 +2376,39 @@ err:
     return err;
 }
 
+static void virtio_net_rsc_flush(VirtIONet *n, NetClientState *nc);
+
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    /* Like GRO at the end of a NAPI poll, do not wait for the timer */
+    if (n->gro && (n->rsc4_enabled || n->rsc6_enabled)) {
+        virtio_net_rsc_flush(n, nc);
+    }
+
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(n, q->rx_vq);
+    }
+}
+
 static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size, false);
+    return virtio_net_receive_rcu(nc, buf, size, false, NULL);
+}
+
+/*
+ * Length of the virtio-net header in front of the packets that go through
+ * RSC.  Peers without a header only get there for host GRO.
+ */
+static size_t virtio_net_rsc_hdr_len(VirtIONet *n)
+{
+    return n->has_vnet_hdr ? n->guest_hdr_len : 0;
 }
 
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
@@ -1921,7 +2418,7 @@ static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
     uint16_t ip_hdrlen;
     struct ip_header *ip;
 
-    ip = (struct ip_header *)(buf + chain->n->guest_hdr_len
+    ip = (struct ip_header *)(buf + virtio_net_rsc_hdr_len(chain->n)
                               + sizeof(struct eth_header));
     unit->ip = (void *)ip;
     ip_hdrlen = (ip->ip_ver_len & 0xF) << 2;
@@ -1937,7 +2434,7 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
 {
     struct ip6_header *ip6;
 
-    ip6 = (struct ip6_header *)(buf + chain->n->guest_hdr_len
+    ip6 = (struct ip6_header *)(buf + virtio_net_rsc_hdr_len(chain->n)
                                  + sizeof(struct eth_header));
     unit->ip = ip6;
     unit->ip_plen = &(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
@@ -1950,12 +2447,71 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
     unit->payload = htons(*unit->ip_plen) - unit->tcp_hdrlen;
 }
 
+/*
+ * Host GRO: hand a segment to the guest the way a tap device with TSO
+ * offloads would.  Single packets had their checksum verified before they
+ * were cached; coalesced ones carry a partial TCP checksum for the guest to
+ * complete, as after GRO in the host kernel.
+ */
+static ssize_t virtio_net_gro_receive_seg(VirtioNetRscChain *chain,
+                                          VirtioNetRscSeg *seg)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(chain->n);
+    VirtioNetRscUnit *unit = &seg->unit;
+    uint16_t csum_start = (uint8_t *)unit->tcp - seg->buf;
+    uint16_t len = unit->tcp_hdrlen + unit->payload;
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_DATA_VALID,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+    uint32_t sum;
+
+    if (seg->is_coalesced) {
+        if (chain->proto == ETH_P_IP) {
+            struct ip_header *ip = unit->ip;
+
+            ip->ip_sum = 0;
+            ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip,
+                                                      sizeof(*ip)));
+            sum = net_checksum_add(2 * sizeof(ip->ip_src),
+                                   (uint8_t *)&ip->ip_src);
+        } else {
+            struct ip6_header *ip6 = unit->ip;
+
+            sum = net_checksum_add(2 * sizeof(ip6->ip6_src),
+                                   (uint8_t *)&ip6->ip6_src);
+        }
+        sum += IP_PROTO_TCP + len;
+        unit->tcp->th_sum = cpu_to_be16(~net_checksum_finish(sum));
+
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        virtio_stw_p(vdev, &hdr.csum_start, csum_start);
+        virtio_stw_p(vdev, &hdr.csum_offset,
+                     offsetof(struct tcp_header, th_sum));
+    }
+
+    if (seg->packets > 1 && unit->payload > seg->mss) {
+        hdr.gso_type = chain->gso_type;
+        virtio_stw_p(vdev, &hdr.hdr_len, csum_start + unit->tcp_hdrlen);
+        virtio_stw_p(vdev, &hdr.gso_size, seg->mss);
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    return virtio_net_receive_rcu(seg->nc, seg->buf, seg->size, false, &hdr);
+}
+
 static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
                                        VirtioNetRscSeg *seg)
 {
     int ret;
     struct virtio_net_hdr_v1 *h;
 
+    if (!chain->n->has_vnet_hdr) {
+        ret = virtio_net_gro_receive_seg(chain, seg);
+        goto out;
+    }
+
     h = (struct virtio_net_hdr_v1 *)seg->buf;
     h->flags = 0;
     h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
@@ -1972,6 +2528,8 @@ static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
     }
 
     ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
+
+out:
     QTAILQ_REMOVE(&chain->buffers, seg, next);
     g_free(seg->buf);
     g_free(seg);
@@ -1998,6 +2556,21 @@ static void virtio_net_rsc_purge(void *opq)
     }
 }
 
+/* Deliver the segments that arrived through @nc */
+static void virtio_net_rsc_flush(VirtIONet *n, NetClientState *nc)
+{
+    VirtioNetRscChain *chain;
+    VirtioNetRscSeg *seg, *rn;
+
+    QTAILQ_FOREACH(chain, &n->rsc_chains, next) {
+        QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
+            if (seg->nc == nc && virtio_net_rsc_drain_seg(chain, seg) == 0) {
+                chain->stat.purge_failed++;
+            }
+        }
+    }
+}
+
 static void virtio_net_rsc_cleanup(VirtIONet *n)
 {
     VirtioNetRscChain *chain, *rn_chain;
@@ -2023,13 +2596,14 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscSeg *seg;
 
-    hdr_len = chain->n->guest_hdr_len;
+    hdr_len = virtio_net_rsc_hdr_len(chain->n);
     seg = g_new(VirtioNetRscSeg, 1);
     seg->buf = g_malloc(hdr_len + sizeof(struct eth_header)
         + sizeof(struct ip6_header) + VIRTIO_NET_MAX_TCP_PAYLOAD);
     memcpy(seg->buf, buf, size);
     seg->size = size;
     seg->packets = 1;
+    seg->mss = 0;
     seg->dup_ack = 0;
     seg->is_coalesced = 0;
     seg->nc = nc;
@@ -2047,6 +2621,7 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     default:
         g_assert_not_reached();
     }
+    seg->mss = seg->unit.payload;
 }
 
 static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
@@ -2145,6 +2720,7 @@ coalesce:
         memmove(seg->buf + seg->size, data, n_unit->payload);
         seg->size += n_unit->payload;
         seg->packets++;
+        seg->mss = MAX(seg->mss, n_unit->payload);
         chain->stat.coalesced++;
         return RSC_COALESCE;
     }
@@ -2291,6 +2867,40 @@ static size_t virtio_net_rsc_drain_flow(VirtioNetRscChain *chain,
     return virtio_net_do_receive(nc, buf, size);
 }
 
+/*
+ * Host GRO tells the guest not to verify checksums, so only segments with a
+ * correct one may be coalesced.
+ */
+static bool virtio_net_gro_csum_ok(VirtioNetRscChain *chain,
+                                   VirtioNetRscUnit *unit)
+{
+    uint16_t len = unit->tcp_hdrlen + unit->payload;
+    uint32_t sum;
+
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip = unit->ip;
+
+        if (net_raw_checksum((uint8_t *)ip, sizeof(*ip))) {
+            chain->stat.bad_csum++;
+            return false;
+        }
+        sum = net_checksum_add(2 * sizeof(ip->ip_src), (uint8_t *)&ip->ip_src);
+    } else {
+        struct ip6_header *ip6 = unit->ip;
+
+        sum = net_checksum_add(2 * sizeof(ip6->ip6_src),
+                               (uint8_t *)&ip6->ip6_src);
+    }
+    sum += net_checksum_add(len, (uint8_t *)unit->tcp);
+    sum += IP_PROTO_TCP + len;
+
+    if (net_checksum_finish(sum)) {
+        chain->stat.bad_csum++;
+        return false;
+    }
+    return true;
+}
+
 static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
                                             struct ip_header *ip,
                                             const uint8_t *buf, size_t size)
@@ -2328,7 +2938,7 @@ static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
 
     ip_len = htons(ip->ip_len);
     if (ip_len < (sizeof(struct ip_header) + sizeof(struct tcp_header))
-        || ip_len > (size - chain->n->guest_hdr_len -
+        || ip_len > (size - virtio_net_rsc_hdr_len(chain->n) -
                      sizeof(struct eth_header))) {
         chain->stat.ip_hacked++;
         return RSC_BYPASS;
@@ -2345,7 +2955,7 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscUnit unit;
 
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
+    hdr_len = virtio_net_rsc_hdr_len(chain->n);
 
     if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header)
         + sizeof(struct tcp_header))) {
@@ -2369,6 +2979,10 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
                 hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header));
     }
 
+    if (!chain->n->has_vnet_hdr && !virtio_net_gro_csum_ok(chain, &unit)) {
+        return virtio_net_do_receive(nc, buf, size);
+    }
+
     return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
 }
 
@@ -2391,8 +3005,8 @@ static int32_t virtio_net_rsc_sanity_check6(VirtioNetRscChain *chain,
 
     ip_len = htons(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
     if (ip_len < sizeof(struct tcp_header) ||
-        ip_len > (size - chain->n->guest_hdr_len - sizeof(struct eth_header)
-                  - sizeof(struct ip6_header))) {
+        ip_len > (size - virtio_net_rsc_hdr_len(chain->n) -
+                  sizeof(struct eth_header) - sizeof(struct ip6_header))) {
         chain->stat.ip_hacked++;
         return RSC_BYPASS;
     }
@@ -2415,7 +3029,7 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
     VirtioNetRscUnit unit;
 
     chain = (VirtioNetRscChain *)opq;
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
+    hdr_len = virtio_net_rsc_hdr_len(chain->n);
 
     if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip6_header)
         + sizeof(tcp_header))) {
@@ -2439,6 +3053,10 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
                 + sizeof(struct ip6_header));
     }
 
+    if (!chain->n->has_vnet_hdr && !virtio_net_gro_csum_ok(chain, &unit)) {
+        return virtio_net_do_receive(nc, buf, size);
+    }
+
     return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
 }
 
@@ -2492,7 +3110,7 @@ static ssize_t virtio_net_rsc_receive(NetClientState *nc,
         return virtio_net_do_receive(nc, buf, size);
     }
 
-    eth = (struct eth_header *)(buf + n->guest_hdr_len);
+    eth = (struct eth_header *)(buf + virtio_net_rsc_hdr_len(n));
     proto = htons(eth->h_proto);
 
     chain = virtio_net_rsc_lookup_chain(n, nc, proto);
@@ -2512,7 +3130,16 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     if ((n->rsc4_enabled || n->rsc6_enabled)) {
-        return virtio_net_rsc_receive(nc, buf, size);
+        ssize_t ret = virtio_net_rsc_receive(nc, buf, size);
+
+        /*
+         * Host GRO only coalesces within a batch; a peer that sends packets
+         * one at a time gets them delivered right away, not on the timer.
+         */
+        if (n->gro && !(nc->peer && nc->peer->sending_batch)) {
+            virtio_net_rsc_flush(n, nc);
+        }
+        return ret;
     } else {
         return virtio_net_do_receive(nc, buf, size);
     }
@@ -2524,10 +3151,9 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2536,14 +3162,84 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtio_net_flush_tx(q);
 }
 
+/*
+ * Send one packet to the peer.  Returns 1 if the element can be returned to
+ * the guest, 0 if the peer queued the packet and will complete it with
+ * virtio_net_tx_complete(), or -EINVAL if the device is broken; the element
+ * has been detached in that case.
+ */
+static int virtio_net_tx_packet(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        virtqueue_detach_element(q->tx_vq, elem, 0);
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            virtqueue_detach_element(q->tx_vq, elem, 0);
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                /* drop */
+                return 1;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    return ret == 0 ? 0 : 1;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, j, count;
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    int ret = 1;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2553,81 +3249,54 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+    while (num_packets < n->tx_burst) {
+        count = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                    (void **)elems,
+                                    MIN(ARRAY_SIZE(elems),
+                                        n->tx_burst - num_packets));
+        if (!count) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (i = 0; i < count; i++) {
+            ret = virtio_net_tx_packet(q, elems[i]);
+            if (ret <= 0) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-                }
-                out_num += 1;
-                out_sg = sg2;
+        if (i < count) {
+            /* Give back what was popped after the packet that stopped us */
+            for (j = count - 1; j > i; j--) {
+                virtqueue_unpop(q->tx_vq, elems[j], 0);
+                g_free(elems[j]);
             }
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+
+        /* Return the packets that were sent with a single used ring update */
+        virtqueue_push_batch(q->tx_vq, elems, NULL, i);
+        for (j = 0; j < i; j++) {
+            g_free(elems[j]);
+        }
+        num_packets += i;
+
+        if (ret < 0) {
+            g_free(elems[i]);
+            return ret;
+        }
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+            q->async_tx.elem = elems[i];
+            if (num_packets) {
+                virtio_net_notify(n, q->tx_vq);
+            }
             return -EBUSY;
         }
+    }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
+    /* Signal the whole burst at once */
+    if (num_packets) {
+        virtio_net_notify(n, q->tx_vq);
     }
     return num_packets;
 }
@@ -2637,30 +3306,32 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    virtio_net_queue_acquire(q);
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
         virtio_net_drop_tx_queue_data(vdev, vq);
-        return;
+        goto out;
     }
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
         q->tx_waiting = 1;
-        return;
+        goto out;
     }
 
     if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
         timer_del(q->tx_timer);
         q->tx_waiting = 0;
-        if (virtio_net_flush_tx(q) == -EINVAL) {
-            return;
-        }
+        virtio_net_flush_tx(q);
     } else {
         timer_mod(q->tx_timer,
                        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
         q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
+
+out:
+    virtio_net_queue_release(q);
 }
 
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
@@ -2668,28 +3339,48 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    virtio_net_queue_acquire(q);
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
         virtio_net_drop_tx_queue_data(vdev, vq);
-        return;
+        goto out;
     }
 
     if (unlikely(q->tx_waiting)) {
-        return;
+        goto out;
     }
     q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
-        return;
+        goto out;
     }
     virtio_queue_set_notification(vq, 0);
     qemu_bh_schedule(q->tx_bh);
+
+out:
+    virtio_net_queue_release(q);
 }
 
-static void virtio_net_tx_timer(void *opaque)
+/*
+ * The TX timer and bottom half of a queue pair bound to an IOThread always
+ * run in that IOThread.  They may only touch the virtqueue while the
+ * dataplane is started; otherwise the queue is owned by the QEMU global
+ * mutex and virtio_net_set_status() reschedules them if tx_waiting is set.
+ * They can also still run once after being cancelled from the main loop,
+ * so tx_waiting cannot be asserted here.
+ */
+static bool virtio_net_tx_deferred(VirtIONetQueue *q)
+{
+    return q->iothread && !q->n->dataplane_started;
+}
+
+static void virtio_net_tx_timer_locked(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    if (virtio_net_tx_deferred(q)) {
+        return;
+    }
+
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
@@ -2708,13 +3399,25 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+static void virtio_net_tx_timer(void *opaque)
 {
     VirtIONetQueue *q = opaque;
+
+    virtio_net_queue_acquire(q);
+    virtio_net_tx_timer_locked(q);
+    virtio_net_queue_release(q);
+}
+
+static void virtio_net_tx_bh_locked(VirtIONetQueue *q)
+{
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int32_t ret;
 
+    if (virtio_net_tx_deferred(q)) {
+        return;
+    }
+
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
@@ -2757,6 +3460,15 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_queue_acquire(q);
+    virtio_net_tx_bh_locked(q);
+    virtio_net_queue_release(q);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2768,18 +3480,43 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_timer);
-        n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                              virtio_net_tx_timer,
-                                              &n->vqs[index]);
+        if (n->vqs[index].iothread) {
+            n->vqs[index].tx_timer = aio_timer_new(n->vqs[index].ctx,
+                                                   QEMU_CLOCK_VIRTUAL,
+                                                   SCALE_NS,
+                                                   virtio_net_tx_timer,
+                                                   &n->vqs[index]);
+        } else {
+            n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                  virtio_net_tx_timer,
+                                                  &n->vqs[index]);
+        }
     } else {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_bh);
-        n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
+        if (n->vqs[index].iothread) {
+            n->vqs[index].tx_bh = aio_bh_new(n->vqs[index].ctx,
+                                             virtio_net_tx_bh,
+                                             &n->vqs[index]);
+        } else {
+            n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh,
+                                              &n->vqs[index]);
+        }
     }
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+
+    net_rx_pkt_init(&n->vqs[index].rx_pkt, false);
+    if (n->vqs[index].iothread) {
+        qemu_mutex_init(&n->vqs[index].rss_lock);
+        QSIMPLEQ_INIT(&n->vqs[index].rss_backlog);
+        n->vqs[index].rss_backlog_len = 0;
+        n->vqs[index].rss_bh = aio_bh_new(n->vqs[index].ctx,
+                                          virtio_net_rss_backlog_bh,
+                                          &n->vqs[index]);
+    }
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -2800,6 +3537,15 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
+
+    net_rx_pkt_uninit(q->rx_pkt);
+    q->rx_pkt = NULL;
+    if (q->rss_bh) {
+        virtio_net_rss_backlog_purge(q);
+        qemu_bh_delete(q->rss_bh);
+        q->rss_bh = NULL;
+        qemu_mutex_destroy(&q->rss_lock);
+    }
 }
 
 static void virtio_net_change_num_queue_pairs(VirtIONet *n, int new_max_queue_pairs)
@@ -2920,6 +3666,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
                 }
             }
         }
+        if (n->rss_data.enabled_software_rss) {
+            virtio_net_rss_init_toeplitz(n);
+        }
 
         trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                     n->rss_data.indirections_len,
@@ -3194,12 +3943,21 @@ static NetClientInfo net_virtio_info = {
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
+    .receive_batch_end = virtio_net_receive_batch_end,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc;
+
+    if (n->dataplane_started) {
+        VirtQueue *vq = virtio_get_queue(vdev, idx);
+
+        return event_notifier_test_and_clear(
+            virtio_queue_get_guest_notifier(vq));
+    }
+
     assert(n->vhost_started);
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_MQ) && idx == 2) {
         /* Must guard against invalid features and bogus queue index
@@ -3501,6 +4259,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
+    if (n->net_conf.iothreads && !virtio_net_dataplane_init(n, errp)) {
+        virtio_net_dataplane_cleanup(n);
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
 
@@ -3576,8 +4340,6 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
 
-    net_rx_pkt_init(&n->rx_pkt, false);
-
     if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
         virtio_net_load_ebpf(n);
     }
@@ -3619,11 +4381,12 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     /* delete also control vq */
     virtio_del_queue(vdev, max_queue_pairs * 2);
     qemu_announce_timer_del(&n->announce_timer, false);
+    virtio_net_dataplane_cleanup(n);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
-    net_rx_pkt_uninit(n->rx_pkt);
+    g_free(n->rss_data.toeplitz);
     virtio_cleanup(vdev);
 }
 
@@ -3745,11 +4508,13 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
+    DEFINE_PROP_BOOL("gro", VirtIONet, gro, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_STRING("iothreads", VirtIONet, net_conf.iothreads),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_UINT16("tx_queue_size", VirtIONet, net_conf.tx_queue_size,
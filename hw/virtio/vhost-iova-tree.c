@@ -28,6 +28,9 @@ struct VhostIOVATree {
 
     /* IOVA address to qemu memory maps. */
     IOVATree *iova_taddr_map;
+
+    /* Incremented every time a mapping is removed */
+    uint64_t generation;
 };
 
 /**
@@ -44,6 +47,7 @@ VhostIOVATree *vhost_iova_tree_new(hwaddr iova_first, hwaddr iova_last)
     tree->iova_last = iova_last;
 
     tree->iova_taddr_map = iova_tree_new();
+    tree->generation = 0;
     return tree;
 }
 
@@ -70,6 +74,19 @@ const DMAMap *vhost_iova_tree_find_iova(const VhostIOVATree *tree,
     return iova_tree_find_iova(tree->iova_taddr_map, map);
 }
 
+/**
+ * Get the generation of the tree
+ *
+ * @tree: The iova tree
+ *
+ * Lookups made with vhost_iova_tree_find_iova remain valid as long as the
+ * generation does not change.
+ */
+uint64_t vhost_iova_tree_get_generation(const VhostIOVATree *tree)
+{
+    return tree->generation;
+}
+
 /**
  * Allocate a new mapping
  *
@@ -107,4 +124,5 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map)
 void vhost_iova_tree_remove(VhostIOVATree *iova_tree, const DMAMap *map)
 {
     iova_tree_remove(iova_tree->iova_taddr_map, map);
+    iova_tree->generation++;
 }
@@ -16,6 +16,10 @@
 #include "qemu/log.h"
 #include "qemu/memalign.h"
 #include "linux-headers/linux/vhost.h"
+#include "trace.h"
+
+/* Guest available elements to pop at once before forwarding them */
+#define VHOST_SVQ_POP_BATCH 32
 
 /**
  * Validate the transport device features that both guests can use with the SVQ
@@ -70,6 +74,56 @@ static uint16_t vhost_svq_available_slots(const VhostShadowVirtqueue *svq)
     return svq->vring.num - (svq->shadow_avail_idx - svq->shadow_used_idx);
 }
 
+/**
+ * Find the IOVA mapping of a qemu's virtual address.
+ *
+ * @svq: Shadow VirtQueue
+ * @needle: The map with the memory address
+ *
+ * Guest buffers tend to come from a few big mappings of guest memory, so
+ * look at the most recently used ones before walking the whole iova tree.
+ * The cache is dropped whenever a mapping is removed from the tree.
+ *
+ * Return the mapping, or NULL if not found.
+ */
+static const DMAMap *vhost_svq_find_map(VhostShadowVirtqueue *svq,
+                                        const DMAMap *needle)
+{
+    uint64_t gen = vhost_iova_tree_get_generation(svq->iova_tree);
+    const DMAMap *map;
+    DMAMap found;
+    unsigned i;
+
+    if (svq->map_cache_gen != gen) {
+        svq->map_cache_len = 0;
+        svq->map_cache_gen = gen;
+    }
+
+    for (i = 0; i < svq->map_cache_len; ++i) {
+        map = &svq->map_cache[i];
+        if (needle->translated_addr >= map->translated_addr &&
+            needle->translated_addr - map->translated_addr <= map->size) {
+            found = *map;
+            goto hit;
+        }
+    }
+
+    map = vhost_iova_tree_find_iova(svq->iova_tree, needle);
+    if (unlikely(!map)) {
+        return NULL;
+    }
+    found = *map;
+    i = MIN(svq->map_cache_len, VHOST_SVQ_MAP_CACHE_SIZE - 1);
+    if (svq->map_cache_len < VHOST_SVQ_MAP_CACHE_SIZE) {
+        svq->map_cache_len++;
+    }
+
+hit:
+    memmove(&svq->map_cache[1], &svq->map_cache[0], i * sizeof(DMAMap));
+    svq->map_cache[0] = found;
+    return &svq->map_cache[0];
+}
+
 /**
  * Translate addresses between the qemu's virtual address and the SVQ IOVA
  *
@@ -78,7 +132,7 @@ static uint16_t vhost_svq_available_slots(const VhostShadowVirtqueue *svq)
  * @iovec: Source qemu's VA addresses
  * @num: Length of iovec and minimum length of vaddr
  */
-static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
+static bool vhost_svq_translate_addr(VhostShadowVirtqueue *svq,
                                      hwaddr *addrs, const struct iovec *iovec,
                                      size_t num)
 {
@@ -94,7 +148,7 @@ static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
         Int128 needle_last, map_last;
         size_t off;
 
-        const DMAMap *map = vhost_iova_tree_find_iova(svq->iova_tree, &needle);
+        const DMAMap *map = vhost_svq_find_map(svq, &needle);
         /*
          * Map cannot be NULL since iova map contains all guest space and
          * qemu already has a physical address mapped
@@ -209,15 +263,23 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
     avail->ring[avail_idx] = cpu_to_le16(*head);
     svq->shadow_avail_idx++;
 
-    /* Update the avail index after write the descriptor */
-    smp_wmb();
-    avail->idx = cpu_to_le16(svq->shadow_avail_idx);
-
     return true;
 }
 
+/**
+ * Expose the descriptors added since the last kick to the device, and notify
+ * it if it wants to.
+ */
 static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 {
+    if (svq->vring.avail->idx == cpu_to_le16(svq->shadow_avail_idx)) {
+        return;
+    }
+
+    /* Update the avail index after write the descriptor */
+    smp_wmb();
+    svq->vring.avail->idx = cpu_to_le16(svq->shadow_avail_idx);
+
     /*
      * We need to expose the available array entries before checking the used
      * flags
@@ -230,17 +292,14 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
     event_notifier_set(&svq->hdev_kick);
 }
 
-/**
- * Add an element to a SVQ.
- *
- * The caller must check that there is enough slots for the new element. It
- * takes ownership of the element: In case of failure not ENOSPC, it is free.
- *
- * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+/*
+ * Like vhost_svq_add, but do not expose the element to the device until the
+ * next vhost_svq_kick.
  */
-int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
-                  size_t out_num, const struct iovec *in_sg, size_t in_num,
-                  VirtQueueElement *elem)
+static int vhost_svq_add_no_kick(VhostShadowVirtqueue *svq,
+                                 const struct iovec *out_sg, size_t out_num,
+                                 const struct iovec *in_sg, size_t in_num,
+                                 VirtQueueElement *elem)
 {
     unsigned qemu_head;
     unsigned ndescs = in_num + out_num;
@@ -258,16 +317,38 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
 
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
     return 0;
 }
 
-/* Convenience wrapper to add a guest's element to SVQ */
+/**
+ * Add an element to a SVQ.
+ *
+ * The caller must check that there is enough slots for the new element. It
+ * takes ownership of the element: In case of failure not ENOSPC, it is free.
+ *
+ * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+ */
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const struct iovec *in_sg, size_t in_num,
+                  VirtQueueElement *elem)
+{
+    int r = vhost_svq_add_no_kick(svq, out_sg, out_num, in_sg, in_num, elem);
+
+    if (likely(r == 0)) {
+        vhost_svq_kick(svq);
+    }
+    return r;
+}
+
+/*
+ * Convenience wrapper to add a guest's element to SVQ.  The caller kicks the
+ * device once for the whole batch.
+ */
 static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
                                  VirtQueueElement *elem)
 {
-    return vhost_svq_add(svq, elem->out_sg, elem->out_num, elem->in_sg,
-                         elem->in_num, elem);
+    return vhost_svq_add_no_kick(svq, elem->out_sg, elem->out_num,
+                                 elem->in_sg, elem->in_num, elem);
 }
 
 /**
@@ -293,24 +374,34 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
         virtio_queue_set_notification(svq->vq, false);
 
         while (true) {
-            VirtQueueElement *elem;
-            int r;
+            VirtQueueElement *elems[VHOST_SVQ_POP_BATCH];
+            unsigned n = 0, i;
+            int r = 0;
 
             if (svq->next_guest_avail_elem) {
-                elem = g_steal_pointer(&svq->next_guest_avail_elem);
-            } else {
-                elem = virtqueue_pop(svq->vq, sizeof(*elem));
+                elems[n++] = g_steal_pointer(&svq->next_guest_avail_elem);
             }
-
-            if (!elem) {
+            n += virtqueue_pop_batch(svq->vq, sizeof(VirtQueueElement),
+                                     (void **)elems + n, ARRAY_SIZE(elems) - n);
+            if (!n) {
                 break;
             }
 
-            if (svq->ops) {
-                r = svq->ops->avail_handler(svq, elem, svq->ops_opaque);
-            } else {
-                r = vhost_svq_add_element(svq, elem);
+            for (i = 0; i < n; i++) {
+                if (svq->ops) {
+                    r = svq->ops->avail_handler(svq, elems[i],
+                                                svq->ops_opaque);
+                } else {
+                    r = vhost_svq_add_element(svq, elems[i]);
+                }
+                if (unlikely(r != 0)) {
+                    break;
+                }
             }
+
+            /* Expose the whole batch to the device with a single kick */
+            vhost_svq_kick(svq);
+
             if (unlikely(r != 0)) {
                 if (r == -ENOSPC) {
                     /*
@@ -324,7 +415,13 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                      * queue the current guest descriptor and ignore kicks
                      * until some elements are used.
                      */
-                    svq->next_guest_avail_elem = elem;
+                    svq->next_guest_avail_elem = elems[i];
+                }
+
+                /* Give back the rest of the batch, last popped first */
+                while (--n > i) {
+                    virtqueue_unpop(svq->vq, elems[n], 0);
+                    g_free(elems[n]);
                 }
 
                 /* VQ is full or broken, just return and ignore kicks */
@@ -332,22 +429,14 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
             }
         }
 
+        if (svq->polling) {
+            /* vhost_svq_busy_poll enables guest notifications when done */
+            return;
+        }
         virtio_queue_set_notification(svq->vq, true);
     } while (!virtio_queue_empty(svq->vq));
 }
 
-/**
- * Handle guest's kick.
- *
- * @n: guest kick event notifier, the one that guest set to notify svq.
- */
-static void vhost_handle_guest_kick_notifier(EventNotifier *n)
-{
-    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
-    event_notifier_test_and_clear(n);
-    vhost_handle_guest_kick(svq);
-}
-
 static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
 {
     uint16_t *used_idx = &svq->vring.used->idx;
@@ -486,7 +575,72 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
              */
             vhost_handle_guest_kick(svq);
         }
-    } while (!vhost_svq_enable_notification(svq));
+
+        /* vhost_svq_busy_poll enables device notifications when done */
+    } while (!svq->polling && !vhost_svq_enable_notification(svq));
+}
+
+/**
+ * Keep forwarding buffers in both directions without guest kicks or device
+ * calls after one of them arrived, for svq->poll_us.
+ *
+ * @svq: The svq
+ *
+ * The caller has just drained both rings, so the first rounds usually find
+ * nothing; under load, the guest and the device produce more buffers within
+ * a few microseconds, and each batch picked up here saves a notification on
+ * either side.  This runs in the main loop with the BQL held, which is why
+ * x-svq-poll-us is bounded.
+ */
+static void vhost_svq_busy_poll(VhostShadowVirtqueue *svq)
+{
+    int64_t deadline = g_get_monotonic_time() + svq->poll_us;
+    unsigned rounds = 0;
+    bool progress;
+
+    if (!svq->poll_us || svq->polling || !svq->vq) {
+        return;
+    }
+
+    svq->polling = true;
+    virtio_queue_set_notification(svq->vq, false);
+    vhost_svq_disable_notification(svq);
+
+    do {
+        progress = false;
+        if (!svq->next_guest_avail_elem && !virtio_queue_empty(svq->vq)) {
+            vhost_handle_guest_kick(svq);
+            progress = true;
+        }
+        if (vhost_svq_more_used(svq)) {
+            vhost_svq_flush(svq, true);
+            progress = true;
+        }
+        rounds += progress;
+        cpu_relax();
+    } while (g_get_monotonic_time() < deadline);
+
+    svq->polling = false;
+    trace_vhost_svq_busy_poll(svq, rounds);
+
+    /* Enable notifications again, and catch what arrived meanwhile */
+    if (!svq->next_guest_avail_elem) {
+        vhost_handle_guest_kick(svq);
+    }
+    vhost_svq_flush(svq, true);
+}
+
+/**
+ * Handle guest's kick.
+ *
+ * @n: guest kick event notifier, the one that guest set to notify svq.
+ */
+static void vhost_handle_guest_kick_notifier(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
+    event_notifier_test_and_clear(n);
+    vhost_handle_guest_kick(svq);
+    vhost_svq_busy_poll(svq);
 }
 
 /**
@@ -530,6 +684,7 @@ static void vhost_svq_handle_call(EventNotifier *n)
                                              hdev_call);
     event_notifier_test_and_clear(n);
     vhost_svq_flush(svq, true);
+    vhost_svq_busy_poll(svq);
 }
 
 /**
@@ -614,6 +769,17 @@ void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
     }
 }
 
+/**
+ * Set how long the SVQ polls the guest and device vrings after a notification
+ *
+ * @svq: The svq
+ * @poll_us: Polling time in microseconds, 0 to disable polling
+ */
+void vhost_svq_set_poll_time(VhostShadowVirtqueue *svq, uint32_t poll_us)
+{
+    svq->poll_us = poll_us;
+}
+
 /**
  * Start the shadow virtqueue operation.
  *
@@ -630,6 +796,8 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
     svq->shadow_avail_idx = 0;
     svq->shadow_used_idx = 0;
     svq->last_used_idx = 0;
+    svq->map_cache_len = 0;
+    svq->polling = false;
     svq->vdev = vdev;
     svq->vq = vq;
 
@@ -27,6 +27,9 @@ typedef struct SVQDescState {
 
 typedef struct VhostShadowVirtqueue VhostShadowVirtqueue;
 
+/* Number of recently used IOVA mappings that SVQ remembers */
+#define VHOST_SVQ_MAP_CACHE_SIZE 4
+
 /**
  * Callback to handle an avail buffer.
  *
@@ -78,6 +81,24 @@ typedef struct VhostShadowVirtqueue {
     /* IOVA mapping */
     VhostIOVATree *iova_tree;
 
+    /* Recently used iova_tree mappings, most recent first */
+    DMAMap map_cache[VHOST_SVQ_MAP_CACHE_SIZE];
+
+    /* Number of valid map_cache entries */
+    unsigned map_cache_len;
+
+    /* iova_tree generation that map_cache entries belong to */
+    uint64_t map_cache_gen;
+
+    /*
+     * Time to keep polling both vrings after a kick or call, in microseconds.
+     * Zero disables polling.
+     */
+    uint32_t poll_us;
+
+    /* True while SVQ is polling with guest and device notifications off */
+    bool polling;
+
     /* SVQ vring descriptors state */
     SVQDescState *desc_state;
 
@@ -119,6 +140,7 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
 size_t vhost_svq_poll(VhostShadowVirtqueue *svq);
 
 void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd);
+void vhost_svq_set_poll_time(VhostShadowVirtqueue *svq, uint32_t poll_us);
 void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd);
 void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
                               struct vhost_vring_addr *addr);
@@ -426,6 +426,7 @@ static int vhost_vdpa_init_svq(struct vhost_dev *hdev, struct vhost_vdpa *v,
             error_setg(errp, "Cannot create svq %u", n);
             return -1;
         }
+        vhost_svq_set_poll_time(svq, v->shadow_vq_poll_us);
         g_ptr_array_add(shadow_vqs, g_steal_pointer(&svq));
     }
 
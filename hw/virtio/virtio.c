@@ -22,11 +22,16 @@
 #include "hw/virtio/virtio.h"
 #include "migration/qemu-file-types.h"
 #include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/units.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/qdev-properties.h"
 #include "hw/virtio/virtio-access.h"
+#include "qapi/qapi-commands-machine.h"
+#include "qapi/type-helpers.h"
 #include "sysemu/dma.h"
 #include "sysemu/runstate.h"
+#include "sysemu/xen.h"
 #include "standard-headers/linux/virtio_ids.h"
 
 /*
@@ -94,6 +99,36 @@ typedef struct VRingPackedDescEvent {
     uint16_t flags;
 } VRingPackedDescEvent ;
 
+/* Buckets 1, 2-3, 4-7, ..., 128-255 and 256 or more */
+#define VIRTQUEUE_BATCH_HIST_SIZE 9
+
+/* Used elements written to the used ring with one access */
+#define VIRTQUEUE_FILL_CHUNK 64
+
+/*
+ * Translations of guest buffer addresses are cached per virtqueue, in a
+ * direct-mapped table of naturally aligned windows of guest memory.
+ */
+#define VIRTQUEUE_MAP_CACHE_SIZE 32
+#define VIRTQUEUE_MAP_CACHE_WINDOW (2 * MiB)
+
+typedef struct VirtQueueMapCacheEntry {
+    hwaddr addr;
+    hwaddr len;
+    MemoryRegion *mr;
+    void *host;
+    /* Entry is valid while this matches VirtIODevice::map_cache_gen */
+    unsigned int gen;
+} VirtQueueMapCacheEntry;
+
+typedef struct VirtQueueCoalesceStats {
+    uint64_t irqs;          /* interrupts sent */
+    uint64_t frames;        /* used elements covered by them */
+    uint64_t timer_irqs;    /* held back until max-usecs expired */
+    uint64_t frame_irqs;    /* held back until max-frames was reached */
+    uint64_t delay_ns;      /* total time interrupts were held back */
+} VirtQueueCoalesceStats;
+
 struct VirtQueue
 {
     VRing vring;
@@ -130,6 +165,24 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* see virtqueue_map_cached() */
+    VirtQueueMapCacheEntry *map_cache;
+
+    /* Notification coalescing, see virtio_notify_coalesce() */
+    uint32_t coal_max_usecs;
+    uint32_t coal_max_frames;
+    uint32_t coal_frames;       /* used elements since the last interrupt */
+    bool coal_deferred;         /* an interrupt is being held back */
+    bool coal_irqfd;            /* ... and will be sent through irqfd */
+    int64_t coal_deferred_ns;
+    QEMUTimer *coal_timer;
+    AioContext *coal_ctx;       /* AioContext of coal_timer */
+    VirtQueueCoalesceStats coal_stats;
+
+    /* log2 histograms of virtqueue_pop_batch() and virtqueue_fill_batch() */
+    uint64_t pop_batch_hist[VIRTQUEUE_BATCH_HIST_SIZE];
+    uint64_t fill_batch_hist[VIRTQUEUE_BATCH_HIST_SIZE];
 };
 
 const char *virtio_device_names[] = {
@@ -755,6 +808,10 @@ static void virtqueue_split_rewind(VirtQueue *vq, unsigned int num)
     vq->last_avail_idx -= num;
 }
 
+/*
+ * Rewind by @num descriptors.  The shadow index must follow, as it is
+ * what event suppression advertises to the driver.
+ */
 static void virtqueue_packed_rewind(VirtQueue *vq, unsigned int num)
 {
     if (vq->last_avail_idx < num) {
@@ -763,6 +820,8 @@ static void virtqueue_packed_rewind(VirtQueue *vq, unsigned int num)
     } else {
         vq->last_avail_idx -= num;
     }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
 }
 
 /* virtqueue_unpop:
@@ -778,7 +837,8 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
 {
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        virtqueue_packed_rewind(vq, 1);
+        /* A packed element spans all the descriptors of its chain */
+        virtqueue_packed_rewind(vq, elem->ndescs);
     } else {
         virtqueue_split_rewind(vq, 1);
     }
@@ -894,6 +954,92 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     }
 }
 
+static void virtqueue_batch_hist_add(uint64_t *hist, unsigned int count)
+{
+    hist[MIN(31 - clz32(count), VIRTQUEUE_BATCH_HIST_SIZE - 1)]++;
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_fill_batch(VirtQueue *vq, VirtQueueElement **elems,
+                                       const unsigned int *lens,
+                                       unsigned int count)
+{
+    VRingUsedElem uelems[VIRTQUEUE_FILL_CHUNK];
+    VRingMemoryRegionCaches *caches;
+    unsigned int i, j, idx, n;
+    hwaddr pa;
+
+    if (unlikely(!vq->vring.used)) {
+        return;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        return;
+    }
+
+    /*
+     * Write the used elements with as few accesses to the used ring as
+     * possible: one per chunk, split where the ring wraps around.
+     */
+    for (i = 0; i < count; i += n) {
+        idx = (vq->used_idx + i) % vq->vring.num;
+        n = MIN(MIN(count - i, vq->vring.num - idx), VIRTQUEUE_FILL_CHUNK);
+        for (j = 0; j < n; j++) {
+            uelems[j].id = virtio_tswap32(vq->vdev, elems[i + j]->index);
+            uelems[j].len = virtio_tswap32(vq->vdev, lens ? lens[i + j] : 0);
+        }
+
+        pa = offsetof(VRingUsed, ring[idx]);
+        address_space_write_cached(&caches->used, pa, uelems,
+                                   n * sizeof(VRingUsedElem));
+        address_space_cache_invalidate(&caches->used, pa,
+                                       n * sizeof(VRingUsedElem));
+    }
+}
+
+/*
+ * virtqueue_fill_batch:
+ * @vq: The #VirtQueue
+ * @elems: The elements to return to the guest
+ * @lens: Number of bytes written to each element, or NULL if none were
+ * @count: Number of elements in @elems
+ *
+ * Like calling virtqueue_fill() for each element with idx 0 to @count - 1,
+ * but the used ring is written in bulk.  Follow with virtqueue_flush(vq,
+ * @count).
+ *
+ * Called within rcu_read_lock().
+ */
+void virtqueue_fill_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    trace_virtqueue_fill_batch(vq, count);
+    virtqueue_batch_hist_add(vq->fill_batch_hist, count);
+
+    for (i = 0; i < count; i++) {
+        virtqueue_unmap_sg(vq, elems[i], lens ? lens[i] : 0);
+    }
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        for (i = 0; i < count; i++) {
+            virtqueue_packed_fill(vq, elems[i], lens ? lens[i] : 0, i);
+        }
+    } else {
+        virtqueue_split_fill_batch(vq, elems, lens, count);
+    }
+}
+
 /* Called within rcu_read_lock().  */
 static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
 {
@@ -922,12 +1068,17 @@ static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
+    /*
+     * Each used descriptor is followed by as many free slots as the element
+     * had descriptors.  The first one is written last, so that the driver
+     * sees the whole batch at once.
+     */
+    ndescs = vq->used_elems[0].ndescs;
     for (i = 1; i < count; i++) {
-        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], i, false);
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], ndescs, false);
         ndescs += vq->used_elems[i].ndescs;
     }
     virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
-    ndescs += vq->used_elems[0].ndescs;
 
     vq->inuse -= ndescs;
     vq->used_idx += ndescs;
@@ -950,6 +1101,7 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     } else {
         virtqueue_split_flush(vq, count);
     }
+    vq->coal_frames += count;
 }
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
@@ -960,6 +1112,28 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/*
+ * virtqueue_push_batch:
+ * @vq: The #VirtQueue
+ * @elems: The elements to return to the guest
+ * @lens: Number of bytes written to each element, or NULL if none were
+ * @count: Number of elements in @elems
+ *
+ * Return @count elements to the guest with a single update of the used
+ * index.  The elements are not freed.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    virtqueue_fill_batch(vq, elems, lens, count);
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1330,11 +1504,107 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+static bool virtqueue_map_cache_covers(VirtQueueMapCacheEntry *e,
+                                       hwaddr pa, hwaddr len)
+{
+    return pa >= e->addr && len <= e->len && pa - e->addr <= e->len - len;
+}
+
+/*
+ * Translate the window containing @pa and store it in @e.  Returns false if
+ * [@pa, @pa + @len) is not directly accessible RAM covered by the result.
+ * Called within rcu_read_lock().
+ */
+static bool virtqueue_map_cache_fill(VirtQueueMapCacheEntry *e,
+                                     AddressSpace *as, unsigned int gen,
+                                     hwaddr pa, hwaddr len, bool is_write)
+{
+    FlatView *fv = address_space_to_flatview(as);
+    hwaddr start = QEMU_ALIGN_DOWN(pa, VIRTQUEUE_MAP_CACHE_WINDOW);
+    hwaddr l = VIRTQUEUE_MAP_CACHE_WINDOW;
+    hwaddr xlat;
+    MemoryRegion *mr;
+
+    mr = flatview_translate(fv, start, &xlat, &l, is_write,
+                            MEMTXATTRS_UNSPECIFIED);
+    if (start + l <= pa) {
+        /* The start of the window is in a different section */
+        l = start + VIRTQUEUE_MAP_CACHE_WINDOW - pa;
+        start = pa;
+        mr = flatview_translate(fv, start, &xlat, &l, is_write,
+                                MEMTXATTRS_UNSPECIFIED);
+    }
+
+    if (!memory_access_is_direct(mr, is_write)) {
+        return false;
+    }
+
+    e->addr = start;
+    e->len = l;
+    e->mr = mr;
+    e->host = memory_region_get_ram_ptr(mr) + xlat;
+    e->gen = gen;
+
+    return virtqueue_map_cache_covers(e, pa, len);
+}
+
+/*
+ * Like dma_memory_map(), but look up the translation of @pa in the
+ * virtqueue's cache first.  Buffers that guests reuse over and over, such as
+ * network receive buffers, then skip the flatview walk.
+ *
+ * The cache does not hold references to the memory regions.  Entries are
+ * tagged with the memory topology generation, which the memory listener
+ * bumps whenever the topology changes.  Each mapping still takes a
+ * reference on its memory region, like address_space_map() does, so
+ * elements are unmapped with address_space_unmap() as usual.
+ *
+ * Mappings through an IOMMU are not cached, because IOTLB invalidations
+ * are not tracked.
+ *
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_map_cached(VirtQueue *vq, hwaddr pa, hwaddr *len,
+                                  bool is_write)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueMapCacheEntry *e;
+    unsigned int gen;
+
+    if (!vq->map_cache || vdev->dma_as != &address_space_memory ||
+        xen_enabled()) {
+        goto slow;
+    }
+
+    gen = qatomic_load_acquire(&vdev->map_cache_gen);
+    e = &vq->map_cache[(pa / VIRTQUEUE_MAP_CACHE_WINDOW) %
+                       VIRTQUEUE_MAP_CACHE_SIZE];
+    if (e->gen != gen || !virtqueue_map_cache_covers(e, pa, *len)) {
+        trace_virtqueue_map_cache_miss(vq, pa, *len);
+        if (!virtqueue_map_cache_fill(e, vdev->dma_as, gen, pa, *len,
+                                      is_write)) {
+            goto slow;
+        }
+    } else if (!memory_access_is_direct(e->mr, is_write)) {
+        goto slow;
+    }
+
+    memory_region_ref(e->mr);
+    return e->host + (pa - e->addr);
+
+slow:
+    return dma_memory_map(vdev->dma_as, pa, len,
+                          is_write ? DMA_DIRECTION_FROM_DEVICE :
+                          DMA_DIRECTION_TO_DEVICE,
+                          MEMTXATTRS_UNSPECIFIED);
+}
+
+static bool virtqueue_map_desc(VirtQueue *vq, unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
 {
+    VirtIODevice *vdev = vq->vdev;
     bool ok = false;
     unsigned num_sg = *p_num_sg;
     assert(num_sg <= max_num_sg);
@@ -1353,11 +1623,7 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
             goto out;
         }
 
-        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
-                                              is_write ?
-                                              DMA_DIRECTION_FROM_DEVICE :
-                                              DMA_DIRECTION_TO_DEVICE,
-                                              MEMTXATTRS_UNSPECIFIED);
+        iov[num_sg].iov_base = virtqueue_map_cached(vq, pa, &len, is_write);
         if (!iov[num_sg].iov_base) {
             virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
@@ -1448,10 +1714,34 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_desc_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+/*
+ * Pop the element at last_avail_idx.  The caller has checked that the ring
+ * is not empty and looked up @caches with virtqueue_desc_caches().
+ * Called within rcu_read_lock().
+ */
+static VirtQueueElement *
+virtqueue_split_pop_rcu(VirtQueue *vq, size_t sz,
+                        VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1463,14 +1753,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1485,23 +1767,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1529,7 +1796,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vq, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1538,7 +1805,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vq, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1585,10 +1852,83 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtQueueElement *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /*
+     * Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads().
+     */
+    smp_rmb();
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    elem = virtqueue_split_pop_rcu(vq, sz, caches);
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
 {
-    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
+    unsigned int i;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* A single load of avail->idx covers the whole batch */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    for (i = 0; i < max; i++) {
+        elems[i] = virtqueue_split_pop_rcu(vq, sz, caches);
+        if (!elems[i]) {
+            break;
+        }
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return i;
+}
+
+/*
+ * Pop the element at last_avail_idx.  The caller has checked that the ring
+ * is not empty and looked up @caches with virtqueue_desc_caches().
+ * Called within rcu_read_lock().
+ */
+static VirtQueueElement *
+virtqueue_packed_pop_rcu(VirtQueue *vq, size_t sz,
+                         VRingMemoryRegionCaches *caches)
+{
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1601,11 +1941,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     uint16_t id;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1618,17 +1953,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     i = vq->last_avail_idx;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
     id = desc.id;
@@ -1657,7 +1981,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vq, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1666,7 +1990,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vq, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1720,6 +2044,52 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    return virtqueue_packed_pop_rcu(vq, sz, caches);
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return 0;
+    }
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    for (i = 0; i < max; i++) {
+        if (i && virtio_queue_packed_empty_rcu(vq)) {
+            break;
+        }
+        elems[i] = virtqueue_packed_pop_rcu(vq, sz, caches);
+        if (!elems[i]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -1733,6 +2103,42 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/*
+ * virtqueue_pop_batch:
+ * @vq: The #VirtQueue
+ * @sz: Size of the element structure, as for virtqueue_pop()
+ * @elems: Array that receives the popped elements
+ * @max: Number of entries in @elems
+ *
+ * Pop up to @max elements at once.  The avail index is read and the ring
+ * caches are looked up once for the whole batch rather than once per
+ * element.  Elements are popped in ring order, so unused ones can be given
+ * back with virtqueue_unpop() starting from the last one.
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int count;
+
+    if (virtio_device_disabled(vq->vdev) || !max) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        count = virtqueue_packed_pop_batch(vq, sz, elems, max);
+    } else {
+        count = virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+
+    if (count) {
+        trace_virtqueue_pop_batch(vq, count, max);
+        virtqueue_batch_hist_add(vq->pop_batch_hist, count);
+    }
+    return count;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -2065,6 +2471,11 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        vdev->vq[i].coal_frames = 0;
+        vdev->vq[i].coal_deferred = false;
+        if (vdev->vq[i].coal_timer) {
+            timer_del(vdev->vq[i].coal_timer);
+        }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
 }
@@ -2431,6 +2842,10 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].used_elems = g_new0(VirtQueueElement, queue_size);
+    vdev->vq[i].map_cache = g_new0(VirtQueueMapCacheEntry,
+                                   VIRTQUEUE_MAP_CACHE_SIZE);
+    vdev->vq[i].coal_max_usecs = vdev->notify_max_usecs;
+    vdev->vq[i].coal_max_frames = vdev->notify_max_frames;
 
     return &vdev->vq[i];
 }
@@ -2442,6 +2857,12 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    g_free(vq->map_cache);
+    vq->map_cache = NULL;
+    timer_free(vq->coal_timer);
+    vq->coal_timer = NULL;
+    vq->coal_ctx = NULL;
+    vq->coal_deferred = false;
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2543,16 +2964,8 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
-void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_irqfd(VirtQueue *vq)
 {
-    WITH_RCU_READ_LOCK_GUARD() {
-        if (!virtio_should_notify(vdev, vq)) {
-            return;
-        }
-    }
-
-    trace_virtio_notify_irqfd(vdev, vq);
-
     /*
      * virtio spec 1.0 says ISR bit 0 should be ignored with MSI, but
      * windows drivers included in virtio-win 1.8.0 (circa 2015) are
@@ -2578,14 +2991,153 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+/* Account for an interrupt sent on a queue that coalesces notifications */
+static void virtio_notify_coalesce_done(VirtQueue *vq)
+{
+    VirtQueueCoalesceStats *stats = &vq->coal_stats;
+
+    if (vq->coal_deferred) {
+        stats->delay_ns += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
+                           vq->coal_deferred_ns;
+        vq->coal_deferred = false;
+        timer_del(vq->coal_timer);
+    }
+    stats->irqs++;
+    stats->frames += vq->coal_frames;
+    vq->coal_frames = 0;
+}
+
+static void virtio_notify_coalesce_timer(void *opaque)
+{
+    VirtQueue *vq = opaque;
+    AioContext *ctx = vq->coal_ctx;
+
+    aio_context_acquire(ctx);
+    if (vq->coal_deferred) {
+        trace_virtio_notify_coalesce_timer(vq->vdev, vq, vq->coal_frames);
+        vq->coal_stats.timer_irqs++;
+        virtio_notify_coalesce_done(vq);
+        if (vq->coal_irqfd) {
+            virtio_irqfd(vq);
+        } else {
+            virtio_irq(vq);
+        }
+    }
+    aio_context_release(ctx);
+}
+
+/*
+ * Decide whether an interrupt the guest asked for can be held back, so that
+ * completions arriving within the next max-usecs share it.  The interrupt is
+ * sent right away once max-frames used elements have been returned since
+ * the previous one.  The timer lives in the AioContext of the caller, which
+ * processes the queue and is therefore the only one touching the state here.
+ *
+ * Returns true if the interrupt is deferred.
+ */
+static bool virtio_notify_coalesce(VirtQueue *vq, bool irqfd)
+{
+    AioContext *ctx;
+
+    if (!vq->coal_max_usecs) {
+        return false;
+    }
+
+    if (vq->coal_max_frames && vq->coal_frames >= vq->coal_max_frames) {
+        if (vq->coal_deferred) {
+            vq->coal_stats.frame_irqs++;
+        }
+        virtio_notify_coalesce_done(vq);
+        return false;
+    }
+
+    if (vq->coal_deferred) {
+        return true;
+    }
+
+    ctx = qemu_get_current_aio_context();
+    if (!ctx) {
+        virtio_notify_coalesce_done(vq);
+        return false;
+    }
+
+    if (ctx != vq->coal_ctx) {
+        timer_free(vq->coal_timer);
+        vq->coal_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                       virtio_notify_coalesce_timer, vq);
+        vq->coal_ctx = ctx;
+    }
+
+    vq->coal_deferred = true;
+    vq->coal_irqfd = irqfd;
+    vq->coal_deferred_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    timer_mod(vq->coal_timer,
+              vq->coal_deferred_ns + (int64_t)vq->coal_max_usecs * SCALE_US);
+    return true;
+}
+
+/*
+ * Override the notify-max-usecs and notify-max-frames defaults for queue @n.
+ * Must be called from the thread that processes the queue.
+ */
+void virtio_queue_set_notify_coalesce(VirtIODevice *vdev, int n,
+                                      uint32_t max_usecs, uint32_t max_frames)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    vq->coal_max_usecs = max_usecs;
+    vq->coal_max_frames = max_frames;
+}
+
+/*
+ * Deferred interrupts are not migrated, and the guest may be waiting for
+ * one after the VM is started; send it unconditionally.  A spurious
+ * interrupt is harmless.
+ */
+static void virtio_notify_coalesce_resume(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        if (vq->vring.num == 0) {
+            break;
+        }
+        if (vq->coal_max_usecs && vq->vring.desc) {
+            virtio_irq(vq);
+        }
+    }
+}
+
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (!virtio_should_notify(vdev, vq) && !vq->coal_deferred) {
+            return;
+        }
+    }
+
+    if (virtio_notify_coalesce(vq, true)) {
+        return;
+    }
+
+    trace_virtio_notify_irqfd(vdev, vq);
+    virtio_irqfd(vq);
+}
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
-        if (!virtio_should_notify(vdev, vq)) {
+        if (!virtio_should_notify(vdev, vq) && !vq->coal_deferred) {
             return;
         }
     }
 
+    if (virtio_notify_coalesce(vq, false)) {
+        return;
+    }
+
     trace_virtio_notify(vdev, vq);
     virtio_irq(vq);
 }
@@ -3241,6 +3793,10 @@ static void virtio_vmstate_change(void *opaque, bool running, RunState state)
         k->vmstate_change(qbus->parent, backend_run);
     }
 
+    if (backend_run) {
+        virtio_notify_coalesce_resume(vdev);
+    }
+
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
@@ -3658,11 +4214,30 @@ void G_GNUC_PRINTF(2, 3) virtio_error(VirtIODevice *vdev, const char *fmt, ...)
     vdev->broken = true;
 }
 
+static void virtio_map_cache_invalidate(VirtIODevice *vdev)
+{
+    qatomic_store_release(&vdev->map_cache_gen, vdev->map_cache_gen + 1);
+}
+
+static void virtio_memory_listener_begin(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+
+    /*
+     * Invalidate before the old flatview can go away, so that nobody
+     * still using an old entry can outlive its memory region.
+     */
+    virtio_map_cache_invalidate(vdev);
+}
+
 static void virtio_memory_listener_commit(MemoryListener *listener)
 {
     VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
     int i;
 
+    /* Drop entries filled in from the old flatview during the update */
+    virtio_map_cache_invalidate(vdev);
+
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         if (vdev->vq[i].vring.num == 0) {
             break;
@@ -3695,6 +4270,7 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    vdev->listener.begin = virtio_memory_listener_begin;
     vdev->listener.commit = virtio_memory_listener_commit;
     vdev->listener.name = "virtio";
     memory_listener_register(&vdev->listener, vdev->dma_as);
@@ -3728,6 +4304,8 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
             break;
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        g_free(vdev->vq[i].map_cache);
+        timer_free(vdev->vq[i].coal_timer);
     }
     g_free(vdev->vq);
 }
@@ -3748,6 +4326,13 @@ static Property virtio_properties[] = {
     DEFINE_PROP_BOOL("use-disabled-flag", VirtIODevice, use_disabled_flag, true),
     DEFINE_PROP_BOOL("x-disable-legacy-check", VirtIODevice,
                      disable_legacy_check, false),
+    /*
+     * Coalescing parameters given to every queue of the device when it is
+     * created; virtio_queue_set_notify_coalesce() changes a single queue.
+     */
+    DEFINE_PROP_UINT32("notify-max-usecs", VirtIODevice, notify_max_usecs, 0),
+    DEFINE_PROP_UINT32("notify-max-frames", VirtIODevice,
+                       notify_max_frames, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3895,6 +4480,87 @@ bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev)
     return virtio_bus_ioeventfd_enabled(vbus);
 }
 
+static void virtio_batch_hist_print(GString *buf, int n, const char *op,
+                                    const uint64_t *hist)
+{
+    int i;
+
+    for (i = 0; i < VIRTQUEUE_BATCH_HIST_SIZE && !hist[i]; i++) {
+        /* skip to the first non-empty bucket */
+    }
+    if (i == VIRTQUEUE_BATCH_HIST_SIZE) {
+        return;
+    }
+
+    g_string_append_printf(buf, "  queue %d %-4s:", n, op);
+    for (i = 0; i < VIRTQUEUE_BATCH_HIST_SIZE; i++) {
+        if (i == 0) {
+            g_string_append_printf(buf, " 1: %" PRIu64, hist[i]);
+        } else if (i == VIRTQUEUE_BATCH_HIST_SIZE - 1) {
+            g_string_append_printf(buf, " %u+: %" PRIu64, 1u << i, hist[i]);
+        } else {
+            g_string_append_printf(buf, " %u-%u: %" PRIu64,
+                                   1u << i, (2u << i) - 1, hist[i]);
+        }
+    }
+    g_string_append_c(buf, '\n');
+}
+
+static void virtio_coalesce_stats_print(GString *buf, int n, VirtQueue *vq)
+{
+    VirtQueueCoalesceStats *stats = &vq->coal_stats;
+    uint64_t deferred = stats->timer_irqs + stats->frame_irqs;
+
+    if (!stats->irqs) {
+        return;
+    }
+
+    g_string_append_printf(buf, "  queue %d irq : %" PRIu64
+                           " (timer %" PRIu64 ", frames %" PRIu64 ")"
+                           " %.1f elems/irq, %.1f us avg delay\n",
+                           n, stats->irqs, stats->timer_irqs,
+                           stats->frame_irqs,
+                           (double)stats->frames / stats->irqs,
+                           deferred ? stats->delay_ns / 1000.0 / deferred : 0);
+}
+
+static int virtio_batch_stats_one(Object *obj, void *opaque)
+{
+    GString *buf = opaque;
+    VirtIODevice *vdev;
+    g_autofree char *path = NULL;
+    int i;
+
+    vdev = (VirtIODevice *)object_dynamic_cast(obj, TYPE_VIRTIO_DEVICE);
+    if (!vdev || !DEVICE(vdev)->realized) {
+        return 0;
+    }
+
+    path = object_get_canonical_path(obj);
+    g_string_append_printf(buf, "%s (%s)\n", path, vdev->name);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        if (vq->vring.num == 0) {
+            continue;
+        }
+        virtio_batch_hist_print(buf, i, "pop", vq->pop_batch_hist);
+        virtio_batch_hist_print(buf, i, "fill", vq->fill_batch_hist);
+        virtio_coalesce_stats_print(buf, i, vq);
+    }
+    return 0;
+}
+
+HumanReadableText *qmp_x_query_virtio_batch(Error **errp)
+{
+    g_autoptr(GString) buf = g_string_new("");
+
+    object_child_foreach_recursive(object_get_root(),
+                                   virtio_batch_stats_one, buf);
+
+    return human_readable_text_from_str(buf);
+}
+
 static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_DEVICE,
     .parent = TYPE_DEVICE,
@@ -20,8 +20,10 @@
 #include "qemu/coroutine.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/qht.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qemu/stats64.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -234,9 +236,25 @@ struct AioContext {
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /*
+     * Percentage of CPU time that adaptive polling may spend, 0 means that
+     * poll_ns is adjusted with poll_grow and poll_shrink instead.
+     */
+    int64_t poll_cpu_budget;
+    int64_t poll_budget_start; /* start of the current budget period */
+    int64_t poll_budget_used;  /* time spent polling in the current period */
+
+    /* Polling statistics, can be read from other threads */
+    Stat64 poll_hits;       /* polling found an event */
+    Stat64 poll_misses;     /* polling timed out */
+    Stat64 poll_time_ns;    /* total time spent polling */
+
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
+    /* AioCallbackStats for the callbacks dispatched by this AioContext */
+    struct qht callback_stats;
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -374,6 +392,106 @@ void aio_notify_accept(AioContext *ctx);
  */
 void aio_bh_call(QEMUBH *bh);
 
+typedef enum AioCallbackKind {
+    AIO_CALLBACK_FD,
+    AIO_CALLBACK_BH,
+    AIO_CALLBACK_TIMER,
+} AioCallbackKind;
+
+/*
+ * Cumulative dispatch count and time of an event loop callback.  The
+ * counters are only written by the thread that runs the AioContext, but
+ * they can be read from any thread.
+ *
+ * Reading the clock twice would cost more than many callbacks do, so only
+ * one invocation in AIO_CALLBACK_STATS_SAMPLE is timed; @ns is the time of
+ * the @timed invocations.
+ */
+#define AIO_CALLBACK_STATS_SAMPLE 16
+
+typedef struct AioCallbackStats {
+    AioCallbackKind kind;
+    const void *func;  /* the callback */
+    const char *name;  /* name of the bottom half, or NULL */
+    int fd;            /* file descriptor for AIO_CALLBACK_FD, or -1 */
+    aligned_uint64_t count;
+    aligned_uint64_t timed;
+    aligned_uint64_t ns;
+} AioCallbackStats;
+
+/**
+ * aio_callback_stats_get: Find the statistics for an event loop callback
+ * @ctx: the AioContext that dispatches the callback
+ * @kind: the kind of callback
+ * @func: the callback function
+ * @name: the name of the bottom half, or NULL
+ * @fd: the file descriptor of an fd handler, or -1
+ *
+ * Returns the AioCallbackStats for the callback, creating it if it does
+ * not exist yet.  The result remains valid until @ctx is destroyed, so
+ * callers can cache it.  Must be called from @ctx's home thread.
+ */
+AioCallbackStats *aio_callback_stats_get(AioContext *ctx,
+                                         AioCallbackKind kind,
+                                         const void *func, const char *name,
+                                         int fd);
+
+/**
+ * aio_callback_stats_start: Prepare to account one invocation of a callback
+ * @stats: the statistics for the callback
+ *
+ * Returns the value of get_clock() if this invocation is to be timed,
+ * 0 otherwise.  Pass it to aio_callback_stats_add() after the callback.
+ */
+static inline int64_t aio_callback_stats_start(AioCallbackStats *stats)
+{
+    return stats->count % AIO_CALLBACK_STATS_SAMPLE ? 0 : get_clock();
+}
+
+/**
+ * aio_callback_stats_add: Account one invocation of a callback
+ * @stats: the statistics for the callback
+ * @start: the return value of aio_callback_stats_start()
+ */
+static inline void aio_callback_stats_add(AioCallbackStats *stats,
+                                          int64_t start)
+{
+    if (start) {
+        qatomic_set_u64(&stats->ns, stats->ns + (get_clock() - start));
+        qatomic_set_u64(&stats->timed, stats->timed + 1);
+    }
+    qatomic_set_u64(&stats->count, stats->count + 1);
+}
+
+/**
+ * aio_callback_stats_time_ns: Estimate the total time spent in a callback
+ * @stats: the statistics for the callback
+ *
+ * Extrapolates from the timed invocations to all of them.
+ */
+static inline uint64_t aio_callback_stats_time_ns(const AioCallbackStats *stats)
+{
+    uint64_t timed = qatomic_read_u64(&stats->timed);
+
+    return timed ? (double)qatomic_read_u64(&stats->ns) *
+                   qatomic_read_u64(&stats->count) / timed : 0;
+}
+
+typedef void AioCallbackStatsFunc(const AioCallbackStats *stats,
+                                  void *opaque);
+
+/**
+ * aio_context_foreach_callback_stats: Iterate over callback statistics
+ * @ctx: the AioContext
+ * @func: function called for each callback that @ctx has dispatched
+ * @opaque: passed to @func
+ *
+ * Can be called from any thread.
+ */
+void aio_context_foreach_callback_stats(AioContext *ctx,
+                                        AioCallbackStatsFunc *func,
+                                        void *opaque);
+
 /**
  * aio_bh_poll: Poll bottom halves for an AioContext.
  *
@@ -755,12 +873,15 @@ void aio_context_use_g_source(AioContext *ctx);
  * @max_ns: how long to busy poll for, in nanoseconds
  * @grow: polling time growth factor
  * @shrink: polling time shrink factor
+ * @cpu_budget: percentage of CPU time that polling may use; if nonzero, the
+ *              polling time follows the arrival rate of events instead of
+ *              @grow and @shrink
  *
  * Poll mode can be disabled by setting poll_max_ns to 0.
  */
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
-                                 Error **errp);
+                                 int64_t cpu_budget, Error **errp);
 
 /**
  * aio_context_set_aio_params:
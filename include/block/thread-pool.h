@@ -37,4 +37,15 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
 
+/*
+ * Completion latency histogram of a pool, from submission until a worker
+ * has run the request.  Bucket 0 counts requests that took less than 1 us,
+ * bucket i (i > 0) those that took [2^(i-1), 2^i) us, and the last bucket
+ * includes everything slower.  Canceled requests are not counted.
+ */
+#define THREAD_POOL_LATENCY_BUCKETS 24
+
+void thread_pool_get_latency(ThreadPool *pool,
+                             uint64_t buckets[THREAD_POOL_LATENCY_BUCKETS]);
+
 #endif
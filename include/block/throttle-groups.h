@@ -29,6 +29,20 @@
 #include "block/block_int.h"
 #include "qom/object.h"
 
+/*
+ * Budget that a ThrottleGroup hands out in advance to one of its members, so
+ * that the member can account requests without taking the group lock. The
+ * budget is no longer valid after @expires or once the group configuration
+ * changes (tracked by @epoch).
+ */
+typedef struct ThrottleCredit {
+    double   bytes;
+    double   units;
+    uint64_t op_size;
+    int64_t  expires;
+    unsigned epoch;
+} ThrottleCredit;
+
 /* The ThrottleGroupMember structure indicates membership in a ThrottleGroup
  * and holds related data.
  */
@@ -57,6 +71,13 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /*
+     * Local budget for each type of operation. It is only used by requests
+     * running in aio_context, so the fast path can read and update it without
+     * the ThrottleGroup lock.
+     */
+    ThrottleCredit credit[2];
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
@@ -33,6 +33,8 @@ typedef struct vhost_vdpa {
     struct vhost_vdpa_iova_range iova_range;
     uint64_t acked_features;
     bool shadow_vqs_enabled;
+    /* Time the shadow virtqueues poll after a notification, in us */
+    uint32_t shadow_vq_poll_us;
     /* IOVA mapping used by the Shadow Virtqueue */
     VhostIOVATree *iova_tree;
     Error *migration_blocker;
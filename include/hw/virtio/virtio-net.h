@@ -18,7 +18,9 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
+#include "net/checksum.h"
 #include "qemu/option_int.h"
+#include "sysemu/iothread.h"
 #include "qom/object.h"
 
 #include "ebpf/ebpf_rss.h"
@@ -50,6 +52,7 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    char *iothreads;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -90,6 +93,7 @@ typedef struct VirtioNetRscStat {
     uint32_t purge_failed;
     uint32_t drain_failed;
     uint32_t final_failed;
+    uint32_t bad_csum;
     int64_t  timer;
 } VirtioNetRscStat;
 
@@ -108,6 +112,7 @@ typedef struct VirtioNetRscSeg {
     void *buf;
     size_t size;
     uint16_t packets;
+    uint16_t mss;           /* largest payload of the coalesced packets */
     uint16_t dup_ack;
     bool is_coalesced;      /* need recal ipv4 header checksum, mark here */
     VirtioNetRscUnit unit;
@@ -143,6 +148,8 @@ typedef struct VirtioNetRssData {
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
+    /* Built from key for software RSS */
+    NetToeplitzTable *toeplitz;
 } VirtioNetRssData;
 
 typedef struct VirtIONetQueue {
@@ -151,10 +158,24 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     uint32_t tx_waiting;
+    bool rx_notify_pending;
     struct {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    /* Set if the queue pair is processed outside the QEMU global mutex */
+    IOThread *iothread;
+    AioContext *ctx;
+    /* Parser state for software RSS of packets arriving on this queue */
+    struct NetRxPkt *rx_pkt;
+    /*
+     * Packets that software RSS steered here from a queue pair served by
+     * another IOThread, delivered by rss_bh in this queue's AioContext.
+     */
+    QemuMutex rss_lock;
+    QSIMPLEQ_HEAD(, VirtIONetRssPacket) rss_backlog;
+    unsigned int rss_backlog_len;
+    QEMUBH *rss_bh;
 } VirtIONetQueue;
 
 struct VirtIONet {
@@ -176,6 +197,8 @@ struct VirtIONet {
     uint32_t rsc_timeout;
     uint8_t rsc4_enabled;
     uint8_t rsc6_enabled;
+    /* Coalesce TCP segments from peers without a virtio-net header */
+    bool gro;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
@@ -185,6 +208,7 @@ struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    bool dataplane_started;
     struct {
         uint32_t in_use;
         uint32_t first_multi;
@@ -217,7 +241,6 @@ struct VirtIONet {
     bool primary_opts_from_json;
     Notifier migration_state;
     VirtioNetRssData rss_data;
-    struct NetRxPkt *rx_pkt;
     struct EBPFRSSContext ebpf_rss;
 };
 
@@ -26,12 +26,22 @@ struct iovec;
 #define CSUM_UDP    0x04
 #define CSUM_ALL    (CSUM_IP | CSUM_TCP | CSUM_UDP)
 
+/*
+ * Returns the ones' complement sum of @buf, folded to 16 bits, with the
+ * bytes swapped if @buf starts at an odd offset @seq of the summed data.
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length, int csum_flag);
 
+/*
+ * Select the next vectorized checksum routine, for unit tests.  Returns
+ * false once all of them have been used, and starts over from the best one.
+ */
+bool test_net_checksum_next_accel(void);
+
 static inline uint32_t
 net_checksum_add(int len, uint8_t *buf)
 {
@@ -108,4 +118,50 @@ void net_toeplitz_add(uint32_t *result,
     *result = accumulator;
 }
 
+/* Longest Toeplitz input used for RSS: IPv6 addresses and TCP/UDP ports */
+#define NET_TOEPLITZ_MAX_INPUT 36
+
+/*
+ * Toeplitz hash contributions of every possible input byte at every input
+ * position, so that a hash costs one table load per input byte instead of
+ * eight shift-and-xor steps.
+ */
+typedef struct NetToeplitzTable {
+    uint32_t t[NET_TOEPLITZ_MAX_INPUT][256];
+} NetToeplitzTable;
+
+/**
+ * net_toeplitz_table_init: precompute the Toeplitz hash for a key
+ *
+ * @table: table to fill
+ * @key: hash key; bytes past @key_len are taken as zero
+ * @key_len: length of @key in bytes
+ */
+void net_toeplitz_table_init(NetToeplitzTable *table, const uint8_t *key,
+                             size_t key_len);
+
+/**
+ * net_toeplitz_table_hash: Toeplitz hash of @input
+ *
+ * Returns the same value as net_toeplitz_add() with a zero initial result
+ * and the key @table was built from.
+ *
+ * @table: table built by net_toeplitz_table_init()
+ * @input: data to hash
+ * @len: length of @input, at most NET_TOEPLITZ_MAX_INPUT
+ */
+static inline uint32_t
+net_toeplitz_table_hash(const NetToeplitzTable *table, const uint8_t *input,
+                        size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    assert(len <= NET_TOEPLITZ_MAX_INPUT);
+    for (i = 0; i < len; i++) {
+        hash ^= table->t[i][input[i]];
+    }
+    return hash;
+}
+
 #endif /* QEMU_NET_CHECKSUM_H */
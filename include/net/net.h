@@ -63,6 +63,8 @@ typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
 typedef bool (NetCheckPeerType)(NetClientState *, ObjectClass *, Error **);
+typedef void (SetAioContext)(NetClientState *, AioContext *);
+typedef void (NetReceiveBatchEnd)(NetClientState *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -86,6 +88,8 @@ typedef struct NetClientInfo {
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
     NetCheckPeerType *check_peer_type;
+    SetAioContext *set_aio_context;
+    NetReceiveBatchEnd *receive_batch_end;
 } NetClientInfo;
 
 struct NetClientState {
@@ -106,6 +110,8 @@ struct NetClientState {
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
     bool is_datapath;
+    unsigned int sending_batch; /* see qemu_send_batch_begin() */
+    AioContext *ctx; /* see qemu_set_aio_context() */
     QTAILQ_HEAD(, NetFilterState) filters;
 };
 
@@ -181,6 +187,9 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+int qemu_set_aio_context(NetClientState *nc, AioContext *ctx);
+AioContext *qemu_net_client_acquire(NetClientState *nc);
+void qemu_net_client_release(AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
@@ -194,6 +203,33 @@ void net_socket_rs_init(SocketReadState *rs,
                         bool vnet_hdr);
 NetClientState *qemu_get_peer(NetClientState *nc, int queue_index);
 
+/*
+ * Mark the start of a burst of packets sent by @nc.  Until the matching
+ * qemu_send_batch_end(), a peer that implements receive_batch_end may
+ * complete packets without notifying its consumer (e.g. the guest), and
+ * issue a single notification for the whole burst instead.
+ *
+ * Batches nest; the peer only hears about the end of the outermost one.
+ */
+static inline void qemu_send_batch_begin(NetClientState *nc)
+{
+    nc->sending_batch++;
+}
+
+static inline void qemu_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    assert(nc->sending_batch);
+    if (--nc->sending_batch) {
+        return;
+    }
+
+    if (peer && peer->info->receive_batch_end) {
+        peer->info->receive_batch_end(peer);
+    }
+}
+
 /* NIC info */
 
 #define MAX_NICS 8
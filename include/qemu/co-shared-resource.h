@@ -65,5 +65,12 @@ void coroutine_fn co_get_from_shres(SharedResource *s, uint64_t n);
  */
 void coroutine_fn co_put_to_shres(SharedResource *s, uint64_t n);
 
+/*
+ * Deallocate an amount of @n outside coroutine context, e.g. what the owner
+ * of @s still holds before calling shres_destroy().  No coroutine may be
+ * waiting in co_get_from_shres() at this point.
+ */
+void shres_put(SharedResource *s, uint64_t n);
+
 
 #endif /* QEMU_CO_SHARED_RESOURCE_H */
@@ -65,6 +65,32 @@ typedef void coroutine_fn CoroutineEntry(void *opaque);
  */
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque);
 
+/**
+ * Coroutine stack size classes
+ *
+ * COROUTINE_STACK_SMALL stacks are 64 KiB instead of 1 MiB.  They are only
+ * suitable for entry points whose call chain is known to stay shallow, e.g.
+ * helpers that just wake up other coroutines.  Block layer I/O requests must
+ * keep using the default size: they recurse once per node of the graph below
+ * the BlockBackend (filters, format over protocol, each backing file), which
+ * the user controls, and overflowing the guard page kills QEMU.  Configure
+ * with --enable-debug-stack-usage to measure the actual usage of each class.
+ */
+typedef enum {
+    COROUTINE_STACK_DEFAULT,
+    COROUTINE_STACK_SMALL,
+    COROUTINE_STACK__MAX,
+} CoroutineStackClass;
+
+/**
+ * Create a new coroutine with a stack of the given size class
+ *
+ * Like qemu_coroutine_create(), which uses COROUTINE_STACK_DEFAULT.
+ */
+Coroutine *qemu_coroutine_create_with_stack(CoroutineEntry *entry,
+                                            void *opaque,
+                                            CoroutineStackClass stack_class);
+
 /**
  * Transfer control to a coroutine
  */
@@ -147,6 +173,9 @@ struct CoMutex {
     unsigned handoff, sequence;
 
     Coroutine *holder;
+
+    /* Moving average of the iterations needed to get the lock by spinning */
+    unsigned spin_avg;
 };
 
 /**
@@ -159,7 +188,15 @@ void qemu_co_mutex_init(CoMutex *mutex);
  * Locks the mutex. If the lock cannot be taken immediately, control is
  * transferred to the caller of the current coroutine.
  */
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line);
+#define qemu_co_mutex_lock(mutex) \
+        qemu_co_mutex_lock_impl(mutex, __FILE__, __LINE__)
+
+static inline coroutine_fn void (qemu_co_mutex_lock)(CoMutex *mutex)
+{
+    qemu_co_mutex_lock(mutex);
+}
 
 /**
  * Unlocks the mutex and schedules the next coroutine that was waiting for this
@@ -274,9 +311,12 @@ void qemu_co_rwlock_init(CoRwlock *lock);
 /**
  * Read locks the CoRwlock. If the lock cannot be taken immediately because
  * of a parallel writer, control is transferred to the caller of the current
- * coroutine.
+ * coroutine.  All readers that queued up behind a writer are admitted
+ * together when the writer releases the lock.
  */
-void qemu_co_rwlock_rdlock(CoRwlock *lock);
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line);
+#define qemu_co_rwlock_rdlock(lock) \
+        qemu_co_rwlock_rdlock_impl(lock, __FILE__, __LINE__)
 
 /**
  * Write Locks the CoRwlock from a reader.  This is a bit more efficient than
@@ -300,7 +340,9 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock);
  * of a parallel reader, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_wrlock(CoRwlock *lock);
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line);
+#define qemu_co_rwlock_wrlock(lock) \
+        qemu_co_rwlock_wrlock_impl(lock, __FILE__, __LINE__)
 
 /**
  * Unlocks the read/write lock and schedules the next coroutine that was
@@ -34,6 +34,7 @@ extern __thread void *__safestack_unsafe_stack_ptr;
 #endif
 
 #define COROUTINE_STACK_SIZE (1 << 20)
+#define COROUTINE_SMALL_STACK_SIZE (64 * 1024)
 
 typedef enum {
     COROUTINE_YIELD = 1,
@@ -51,6 +52,9 @@ struct Coroutine {
 
     size_t locks_held;
 
+    /* Constant for the lifetime of the stack, also across pool reuse */
+    CoroutineStackClass stack_class;
+
     /* Only used when the coroutine has yielded.  */
     AioContext *ctx;
 
@@ -69,7 +73,10 @@ struct Coroutine {
     QSLIST_ENTRY(Coroutine) co_scheduled_next;
 };
 
-Coroutine *qemu_coroutine_new(void);
+Coroutine *qemu_coroutine_new(size_t stack_size);
+#ifdef CONFIG_DEBUG_STACK_USAGE
+size_t qemu_coroutine_stack_usage(Coroutine *co);
+#endif
 void qemu_coroutine_delete(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
                                       CoroutineAction action);
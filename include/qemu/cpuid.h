@@ -71,4 +71,51 @@
 #define bit_LZCNT       (1 << 5)
 #endif
 
+/* Vector extensions used by the accelerated helpers in util/ and net/ */
+#define CPUID_HOST_SSE2     (1u << 0)
+#define CPUID_HOST_SSE4_1   (1u << 1)
+#define CPUID_HOST_AVX2     (1u << 2)
+#define CPUID_HOST_AVX512F  (1u << 3)
+
+/*
+ * Return the CPUID_HOST_* extensions of the host.  AVX2 and AVX512F are
+ * only reported if the OS has also enabled the register state they need.
+ */
+static inline unsigned cpuid_host_features(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned features = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            features |= CPUID_HOST_SSE2;
+        }
+        if (c & bit_SSE4_1) {
+            features |= CPUID_HOST_SSE4_1;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                features |= CPUID_HOST_AVX2;
+            }
+            /*
+             * 0xe6:
+             *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
+             *                    and ZMM16-ZMM31 state are enabled by OS)
+             *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
+             */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                features |= CPUID_HOST_AVX512F;
+            }
+        }
+    }
+    return features;
+}
+
 #endif /* QEMU_CPUID_H */
@@ -104,6 +104,16 @@ int hbitmap_granularity(const HBitmap *hb);
  */
 uint64_t hbitmap_count(const HBitmap *hb);
 
+/**
+ * hbitmap_memory_usage:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes of memory used by the HBitmap.  This depends
+ * on the contents of the bitmap, because regions that are entirely clear
+ * or entirely set take almost no memory.
+ */
+uint64_t hbitmap_memory_usage(const HBitmap *hb);
+
 /**
  * hbitmap_set:
  * @hb: HBitmap to operate on.
@@ -265,10 +275,38 @@ char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
  * hbitmap_free:
  * @hb: HBitmap to operate on.
  *
- * Free an HBitmap and all of its associated memory.
+ * Free an HBitmap and all of its associated memory.  @hb must not have a
+ * meta bitmap.
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_create_meta:
+ * @hb: The HBitmap to operate on.
+ * @chunk_size: How many bits in @hb does one bit in the meta track.
+ *
+ * Create a "meta" hbitmap to track dirtiness of the bits in this HBitmap.
+ * The caller owns the created bitmap and must call hbitmap_free_meta(hb) to
+ * free it.
+ *
+ * Besides hbitmap_set() and hbitmap_reset(), operations that change @hb
+ * wholesale (hbitmap_reset_all(), hbitmap_merge() and deserialization)
+ * also mark the affected chunks in the meta bitmap.
+ *
+ * Currently, we only guarantee that if a bit in the hbitmap is changed it
+ * will be reflected in the meta bitmap, but we do not yet guarantee the
+ * opposite.
+ *
+ * Returns: the newly created meta bitmap.
+ */
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size);
+
+/**
+ * hbitmap_free_meta:
+ * @hb: The HBitmap whose meta bitmap should be released.
+ */
+void hbitmap_free_meta(HBitmap *hb);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
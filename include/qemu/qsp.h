@@ -24,4 +24,13 @@ void qsp_enable(void);
 void qsp_disable(void);
 void qsp_reset(void);
 
+/*
+ * Coroutine locks cannot be intercepted like the other primitives, so they
+ * report their wait times themselves when qsp_is_enabled().
+ */
+void qsp_co_mutex_record(const void *obj, const char *file, int line,
+                         int64_t ns);
+void qsp_co_rwlock_record(const void *obj, const char *file, int line,
+                          int64_t ns);
+
 #endif /* QEMU_QSP_H */
@@ -86,7 +86,13 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+
+    /* Links in the timer list's pairing heap, see util/qemu-timer.c */
+    QEMUTimer *next;            /* next sibling */
+    QEMUTimer *prev;            /* previous sibling, or parent */
+    QEMUTimer *child;           /* first child */
+    uint64_t seq;               /* orders timers with the same expire_time */
+
     int attributes;
     int scale;
 };
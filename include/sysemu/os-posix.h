@@ -84,6 +84,17 @@ void *qemu_alloc_stack(size_t *sz);
  */
 void qemu_free_stack(void *stack, size_t sz);
 
+#ifdef CONFIG_DEBUG_STACK_USAGE
+/**
+ * qemu_stack_usage:
+ * @stack: stack allocated via qemu_alloc_stack()
+ * @sz: size of stack in bytes, as returned by qemu_alloc_stack()
+ *
+ * Returns: the maximum number of bytes used so far on the stack.
+ */
+size_t qemu_stack_usage(void *stack, size_t sz);
+#endif
+
 /* POSIX and Mingw32 differ in the name of the stdio lock functions.  */
 
 static inline void qemu_flockfile(FILE *f)
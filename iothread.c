@@ -17,6 +17,7 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/event-loop-base.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
@@ -166,6 +167,7 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
                                 iothread->poll_max_ns,
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
+                                iothread->poll_cpu_budget,
                                 errp);
     if (*errp) {
         return;
@@ -225,6 +227,7 @@ static void iothread_init(EventLoopBase *base, Error **errp)
 typedef struct {
     const char *name;
     ptrdiff_t offset; /* field's byte offset in IOThread struct */
+    int64_t max; /* maximum value, 0 means INT64_MAX */
 } IOThreadParamInfo;
 
 static IOThreadParamInfo poll_max_ns_info = {
@@ -236,6 +239,9 @@ static IOThreadParamInfo poll_grow_info = {
 static IOThreadParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static IOThreadParamInfo poll_cpu_budget_info = {
+    "poll-cpu-budget", offsetof(IOThread, poll_cpu_budget), 100,
+};
 
 static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, IOThreadParamInfo *info, Error **errp)
@@ -251,15 +257,16 @@ static bool iothread_set_param(Object *obj, Visitor *v,
 {
     IOThread *iothread = IOTHREAD(obj);
     int64_t *field = (void *)iothread + info->offset;
+    int64_t max = info->max ?: INT64_MAX;
     int64_t value;
 
     if (!visit_type_int64(v, name, &value, errp)) {
         return false;
     }
 
-    if (value < 0) {
+    if (value < 0 || value > max) {
         error_setg(errp, "%s value must be in range [0, %" PRId64 "]",
-                   info->name, INT64_MAX);
+                   info->name, max);
         return false;
     }
 
@@ -291,6 +298,7 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
                                     iothread->poll_max_ns,
                                     iothread->poll_grow,
                                     iothread->poll_shrink,
+                                    iothread->poll_cpu_budget,
                                     errp);
     }
 }
@@ -314,6 +322,10 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "poll-cpu-budget", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_cpu_budget_info);
 }
 
 static const TypeInfo iothread_info = {
@@ -359,6 +371,10 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_cpu_budget = iothread->poll_cpu_budget;
+    info->poll_hits = stat64_get(&iothread->ctx->poll_hits);
+    info->poll_misses = stat64_get(&iothread->ctx->poll_misses);
+    info->poll_time_ns = stat64_get(&iothread->ctx->poll_time_ns);
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
 
     QAPI_LIST_APPEND(*tail, info);
@@ -375,6 +391,86 @@ IOThreadInfoList *qmp_query_iothreads(Error **errp)
     return head;
 }
 
+static const AioCallbackType aio_callback_type[] = {
+    [AIO_CALLBACK_FD] = AIO_CALLBACK_TYPE_FD,
+    [AIO_CALLBACK_BH] = AIO_CALLBACK_TYPE_BH,
+    [AIO_CALLBACK_TIMER] = AIO_CALLBACK_TYPE_TIMER,
+};
+
+static void query_one_callback(const AioCallbackStats *stats, void *opaque)
+{
+    AioCallbackInfoList ***tail = opaque;
+    AioCallbackInfo *info = g_new0(AioCallbackInfo, 1);
+
+    info->type = aio_callback_type[stats->kind];
+    info->name = stats->name ? g_strdup(stats->name) :
+                               g_strdup_printf("%p", stats->func);
+    if (stats->kind == AIO_CALLBACK_FD) {
+        info->has_fd = true;
+        info->fd = stats->fd;
+    }
+    info->count = qatomic_read_u64(&stats->count);
+    info->time_ns = aio_callback_stats_time_ns(stats);
+
+    QAPI_LIST_APPEND(*tail, info);
+}
+
+static AioContextStats *query_aio_context_stats(AioContext *ctx)
+{
+    AioContextStats *stats = g_new0(AioContextStats, 1);
+    AioCallbackInfoList **tail = &stats->callbacks;
+
+    aio_context_foreach_callback_stats(ctx, query_one_callback, &tail);
+
+    if (ctx->thread_pool) {
+        uint64_t latency[THREAD_POOL_LATENCY_BUCKETS];
+        uint64List **latency_tail = &stats->thread_pool_latency;
+        int i;
+
+        thread_pool_get_latency(ctx->thread_pool, latency);
+        for (i = 0; i < THREAD_POOL_LATENCY_BUCKETS; i++) {
+            QAPI_LIST_APPEND(latency_tail, latency[i]);
+        }
+        stats->has_thread_pool_latency = true;
+    }
+    return stats;
+}
+
+static int query_one_iothread_stats(Object *object, void *opaque)
+{
+    AioContextStatsList ***tail = opaque;
+    AioContextStats *stats;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    stats = query_aio_context_stats(iothread->ctx);
+    stats->has_iothread = true;
+    stats->iothread = iothread_get_id(iothread);
+    QAPI_LIST_APPEND(*tail, stats);
+    return 0;
+}
+
+AioContextStatsList *qmp_query_aio_context_stats(Error **errp)
+{
+    AioContextStatsList *head = NULL;
+    AioContextStatsList **tail = &head;
+    Object *container = object_get_objects_root();
+
+    AioContextStats *stats;
+
+    QAPI_LIST_APPEND(tail, query_aio_context_stats(qemu_get_aio_context()));
+    stats = query_aio_context_stats(iohandler_get_aio_context());
+    stats->has_iohandler = true;
+    stats->iohandler = true;
+    QAPI_LIST_APPEND(tail, stats);
+    object_child_foreach(container, query_one_iothread_stats, &tail);
+    return head;
+}
+
 GMainContext *iothread_get_g_main_context(IOThread *iothread)
 {
     qatomic_set(&iothread->run_gcontext, 1);
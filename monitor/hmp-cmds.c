@@ -1912,11 +1912,59 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        monitor_printf(mon, "  poll-cpu-budget=%" PRId64 "\n",
+                       value->poll_cpu_budget);
+        monitor_printf(mon, "  poll-hits=%" PRId64 " poll-misses=%" PRId64
+                       " poll-time-ns=%" PRId64 "\n", value->poll_hits,
+                       value->poll_misses, value->poll_time_ns);
     }
 
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_aio(Monitor *mon, const QDict *qdict)
+{
+    AioContextStatsList *stats_list = qmp_query_aio_context_stats(NULL);
+    AioContextStatsList *stats;
+    AioCallbackInfoList *cb;
+
+    for (stats = stats_list; stats; stats = stats->next) {
+        monitor_printf(mon, "%s:\n", stats->value->has_iothread ?
+                       stats->value->iothread :
+                       stats->value->has_iohandler ? "iohandler" :
+                       "main-loop");
+        for (cb = stats->value->callbacks; cb; cb = cb->next) {
+            AioCallbackInfo *value = cb->value;
+
+            monitor_printf(mon, "  %s %s", AioCallbackType_str(value->type),
+                           value->name);
+            if (value->has_fd) {
+                monitor_printf(mon, " fd=%" PRId64, value->fd);
+            }
+            monitor_printf(mon, " count=%" PRIu64 " time-ns=%" PRIu64 "\n",
+                           value->count, value->time_ns);
+        }
+        if (stats->value->has_thread_pool_latency) {
+            uint64List *bucket;
+            int i = 0;
+
+            monitor_printf(mon, "  thread-pool latency-us:");
+            for (bucket = stats->value->thread_pool_latency; bucket;
+                 bucket = bucket->next, i++) {
+                if (bucket->value) {
+                    monitor_printf(mon, " %s%" PRIu64 "=%" PRIu64,
+                                   bucket->next ? "<" : ">=",
+                                   (uint64_t)1 << (bucket->next ? i : i - 1),
+                                   bucket->value);
+                }
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    qapi_free_AioContextStatsList(stats_list);
+}
+
 void hmp_rocker(Monitor *mon, const QDict *qdict)
 {
     const char *name = qdict_get_str(qdict, "name");
@@ -99,6 +99,9 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* Maximum number of requests processed in parallel per connection */
+    uint32_t max_requests;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -1449,6 +1452,7 @@ static int nbd_receive_request(NBDClient *client, NBDRequest *request,
 }
 
 #define MAX_NBD_REQUESTS 16
+#define MAX_NBD_REQUESTS_LIMIT 256
 
 void nbd_client_get(NBDClient *client)
 {
@@ -1503,7 +1507,7 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
 {
     NBDRequestData *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= client->exp->max_requests - 1);
     client->nb_requests++;
 
     req = g_new0(NBDRequestData, 1);
@@ -1672,6 +1676,13 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
         return -EEXIST;
     }
 
+    if (arg->has_max_requests &&
+        (arg->max_requests < 1 || arg->max_requests > MAX_NBD_REQUESTS_LIMIT)) {
+        error_setg(errp, "max-requests must be between 1 and %d",
+                   MAX_NBD_REQUESTS_LIMIT);
+        return -EINVAL;
+    }
+
     size = blk_getlength(blk);
     if (size < 0) {
         error_setg_errno(errp, -size,
@@ -1690,6 +1701,8 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     QTAILQ_INIT(&exp->clients);
     exp->name = g_strdup(arg->name);
     exp->description = g_strdup(arg->description);
+    exp->max_requests = arg->has_max_requests ? arg->max_requests
+                                              : MAX_NBD_REQUESTS;
     exp->nbdflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
 
@@ -2706,7 +2719,8 @@ disconnect:
 
 static void nbd_client_receive_next_request(NBDClient *client)
 {
-    if (!client->recv_coroutine && client->nb_requests < MAX_NBD_REQUESTS &&
+    if (!client->recv_coroutine &&
+        client->nb_requests < client->exp->max_requests &&
         !client->quiescing) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
@@ -16,27 +16,191 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/host-utils.h"
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The ones' complement sum does not depend on byte order (RFC 1071), so
+ * the helpers below add up host-endian 32-bit words into 64-bit
+ * accumulators, and only fold and byte-swap the result at the end.
+ */
+static uint64_t net_checksum_add_int(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+    for (; len >= 16; buf += 16, len -= 16) {
+        sum += (uint64_t)(uint32_t)ldl_he_p(buf) +
+               (uint32_t)ldl_he_p(buf + 4) +
+               (uint32_t)ldl_he_p(buf + 8) +
+               (uint32_t)ldl_he_p(buf + 12);
+    }
+    for (; len >= 4; buf += 4, len -= 4) {
+        sum += (uint32_t)ldl_he_p(buf);
+    }
+    if (len >= 2) {
+        sum += lduw_he_p(buf);
+        buf += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* An odd trailing byte is padded with zero */
+        uint8_t tail[2] = { buf[0], 0 };
+
+        sum += lduw_he_p(tail);
+    }
+    return sum;
+}
+
+#ifdef CONFIG_AVX2_OPT
+/* As in util/bufferiszero.c, the regions are ordered with increasing ISA */
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#include <emmintrin.h>
+
+static uint64_t net_checksum_add_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i lo32 = _mm_set_epi32(0, -1, 0, -1);
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    /* Widen each 32-bit word into a 64-bit lane so that nothing carries */
+    for (; len >= 32; buf += 32, len -= 32) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)buf);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+
+        lo = _mm_add_epi64(lo, _mm_and_si128(v0, lo32));
+        hi = _mm_add_epi64(hi, _mm_srli_epi64(v0, 32));
+        lo = _mm_add_epi64(lo, _mm_and_si128(v1, lo32));
+        hi = _mm_add_epi64(hi, _mm_srli_epi64(v1, 32));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(lo, hi));
+    return lanes[0] + lanes[1] + net_checksum_add_int(buf, len);
+}
+
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_add_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i lo32 = _mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+    __m256i lo = _mm256_setzero_si256();
+    __m256i hi = _mm256_setzero_si256();
+    uint64_t lanes[4];
+
+    for (; len >= 64; buf += 64, len -= 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)buf);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+
+        lo = _mm256_add_epi64(lo, _mm256_and_si256(v0, lo32));
+        hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v0, 32));
+        lo = _mm256_add_epi64(lo, _mm256_and_si256(v1, lo32));
+        hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v1, 32));
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(lo, hi));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           net_checksum_add_int(buf, len);
+}
+#pragma GCC pop_options
+
+/*
+ * Note that for test_net_checksum_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+static unsigned cpuid_cache;
+static uint64_t (*checksum_accel)(const uint8_t *, size_t) =
+    net_checksum_add_int;
+
+static void init_accel(unsigned cache)
+{
+    uint64_t (*fn)(const uint8_t *, size_t) = net_checksum_add_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = net_checksum_add_sse2;
+    }
+    if (cache & CACHE_AVX2) {
+        fn = net_checksum_add_avx2;
+    }
+    checksum_accel = fn;
+}
+
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned features = cpuid_host_features();
+    unsigned cache = 0;
+
+    if (features & CPUID_HOST_SSE2) {
+        cache |= CACHE_SSE2;
+    }
+    if (features & CPUID_HOST_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_net_checksum_next_accel(void)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    /*
+     * If no bits set, we just tested net_checksum_add_int, and there
+     * are no more acceleration options to test.  Go back to the best
+     * one for the next test.
+     */
+    if (cpuid_cache == 0) {
+        init_cpuid_cache();
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+static uint64_t net_checksum_add_accel(const uint8_t *buf, size_t len)
+{
+    /* Headers are too short for the vector setup to pay off */
+    if (likely(len >= 64)) {
+        return checksum_accel(buf, len);
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+    return net_checksum_add_int(buf, len);
+}
+
+#else
+#define net_checksum_add_accel net_checksum_add_int
+
+bool test_net_checksum_next_accel(void)
+{
+    return false;
+}
+#endif /* CONFIG_AVX2_OPT */
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum;
+    uint16_t folded;
+
+    if (len <= 0) {
+        return 0;
     }
 
-    if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+    sum = net_checksum_add_accel(buf, len);
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
     }
+
+    /* Host-endian sum to network order; an odd offset swaps the bytes */
+    folded = be16_to_cpu(sum);
+    return (seq & 1) ? bswap16(folded) : folded;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -182,6 +346,35 @@ void net_checksum_calculate(uint8_t *data, int length, int csum_flag)
     }
 }
 
+void net_toeplitz_table_init(NetToeplitzTable *table, const uint8_t *key,
+                             size_t key_len)
+{
+    int i, bit, byte;
+
+    for (i = 0; i < NET_TOEPLITZ_MAX_INPUT; i++) {
+        uint64_t window = 0;
+        uint32_t bit_keys[8];
+
+        /* The 40 key bits that input byte i is multiplied with */
+        for (byte = 0; byte < 5; byte++) {
+            window <<= 8;
+            if (i + byte < key_len) {
+                window |= key[i + byte];
+            }
+        }
+        for (bit = 0; bit < 8; bit++) {
+            bit_keys[bit] = window >> (8 - bit);
+        }
+
+        table->t[i][0] = 0;
+        for (byte = 1; byte < 256; byte++) {
+            /* Input bit 7 pairs with the leftmost key window */
+            bit = 7 - ctz32(byte);
+            table->t[i][byte] = table->t[i][byte & (byte - 1)] ^ bit_keys[bit];
+        }
+    }
+}
+
 uint32_t
 net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
                      uint32_t iov_off, uint32_t size, uint32_t csum_offset)
@@ -8,6 +8,7 @@
 
 #include "qemu/osdep.h"
 #include "net/filter.h"
+#include "net/net.h"
 #include "net/queue.h"
 #include "qapi/error.h"
 #include "qemu/timer.h"
@@ -31,11 +32,14 @@ struct FilterBufferState {
 static void filter_buffer_flush(NetFilterState *nf)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
+    /* The queue is filled by the datapath, which may run in an IOThread */
+    AioContext *ctx = qemu_net_client_acquire(nf->netdev);
 
     if (!qemu_net_queue_flush(s->incoming_queue)) {
         /* Unable to empty the queue, purge remaining packets */
         qemu_net_queue_purge(s->incoming_queue, nf->netdev);
     }
+    qemu_net_client_release(ctx);
 }
 
 static void filter_buffer_release_timer(void *opaque)
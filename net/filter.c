@@ -71,12 +71,16 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
     int direction;
     NetFilterState *nf = opaque;
     NetFilterState *next = NULL;
+    AioContext *ctx;
 
     if (!sender || !sender->peer) {
         /* no receiver, or sender been deleted, no need to pass it further */
         goto out;
     }
 
+    /* Filters may release packets from the main loop, e.g. from a timer */
+    ctx = qemu_net_client_acquire(nf->netdev);
+
     if (nf->direction == NET_FILTER_DIRECTION_ALL) {
         if (sender == nf->netdev) {
             /* This packet is sent by netdev itself */
@@ -99,6 +103,7 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
         ret = qemu_netfilter_receive(next, direction, sender, flags, iov,
                                      iovcnt, NULL);
         if (ret) {
+            qemu_net_client_release(ctx);
             return ret;
         }
         next = netfilter_next(next, direction);
@@ -113,6 +118,7 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
         qemu_net_queue_send_iov(sender->peer->incoming_queue,
                                 sender, flags, iov, iovcnt, NULL);
     }
+    qemu_net_client_release(ctx);
 
 out:
     /* no receiver, or sender been deleted */
@@ -220,6 +226,7 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
     NetFilterState *position = NULL;
     NetClientState *ncs[MAX_QUEUE_NUM];
     NetFilterClass *nfc = NETFILTER_GET_CLASS(uc);
+    AioContext *ctx;
     int queues;
     Error *local_err = NULL;
 
@@ -290,6 +297,8 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         }
     }
 
+    /* The datapath may walk the list of filters in an IOThread */
+    ctx = qemu_net_client_acquire(nf->netdev);
     if (position) {
         if (nf->insert_before_flag) {
             QTAILQ_INSERT_BEFORE(position, nf, next);
@@ -301,6 +310,7 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
     } else if (!strcmp(nf->position, "tail")) {
         QTAILQ_INSERT_TAIL(&nf->netdev->filters, nf, next);
     }
+    qemu_net_client_release(ctx);
 }
 
 static void netfilter_finalize(Object *obj)
@@ -314,7 +324,10 @@ static void netfilter_finalize(Object *obj)
 
     if (nf->netdev && !QTAILQ_EMPTY(&nf->netdev->filters) &&
         QTAILQ_IN_USE(nf, next)) {
+        AioContext *ctx = qemu_net_client_acquire(nf->netdev);
+
         QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+        qemu_net_client_release(ctx);
     }
     g_free(nf->netdev_id);
     g_free(nf->position);
@@ -547,6 +547,53 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Move the file descriptor handlers of @nc to @ctx, or back to the main
+ * loop if @ctx is NULL.  The caller is responsible for making sure that
+ * the peer of @nc can be called from @ctx.
+ *
+ * While @nc is bound to @ctx, the queues and filters between @nc and its
+ * peer belong to @ctx and are protected by its AioContext lock.
+ */
+int qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return -ENOSYS;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->ctx = ctx;
+    return 0;
+}
+
+/*
+ * Take the AioContext lock that protects the datapath between @nc and its
+ * peer, for code that runs outside of that AioContext, e.g. a main loop
+ * timer that sends a packet.  Returns the AioContext to pass to
+ * qemu_net_client_release(), or NULL if no lock was needed.
+ */
+AioContext *qemu_net_client_acquire(NetClientState *nc)
+{
+    AioContext *ctx = nc->ctx;
+
+    if (!ctx && nc->peer) {
+        ctx = nc->peer->ctx;
+    }
+    if (!ctx || ctx == qemu_get_current_aio_context()) {
+        return NULL;
+    }
+
+    aio_context_acquire(ctx);
+    return ctx;
+}
+
+void qemu_net_client_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -655,23 +702,14 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
-static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
-                                                 unsigned flags,
-                                                 const uint8_t *buf, int size,
-                                                 NetPacketSent *sent_cb)
+static ssize_t qemu_send_packet_locked(NetClientState *sender,
+                                       unsigned flags,
+                                       const uint8_t *buf, int size,
+                                       NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     int ret;
 
-#ifdef DEBUG_NET
-    printf("qemu_send_packet_async:\n");
-    qemu_hexdump(stdout, "net", buf, size);
-#endif
-
-    if (sender->link_down || !sender->peer) {
-        return size;
-    }
-
     /* Let filters handle the packet first */
     ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
                          sender, flags, buf, size, sent_cb);
@@ -690,6 +728,31 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
 }
 
+static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
+                                                 unsigned flags,
+                                                 const uint8_t *buf, int size,
+                                                 NetPacketSent *sent_cb)
+{
+    AioContext *ctx;
+    ssize_t ret;
+
+#ifdef DEBUG_NET
+    printf("qemu_send_packet_async:\n");
+    qemu_hexdump(stdout, "net", buf, size);
+#endif
+
+    if (sender->link_down || !sender->peer) {
+        return size;
+    }
+
+    /* Main loop senders, e.g. self-announcements, may reach an IOThread */
+    ctx = qemu_net_client_acquire(sender);
+    ret = qemu_send_packet_locked(sender, flags, buf, size, sent_cb);
+    qemu_net_client_release(ctx);
+
+    return ret;
+}
+
 ssize_t qemu_send_packet_async(NetClientState *sender,
                                const uint8_t *buf, int size,
                                NetPacketSent *sent_cb)
@@ -790,22 +853,13 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_locked(NetClientState *sender,
+                                        const struct iovec *iov, int iovcnt,
+                                        NetPacketSent *sent_cb)
 {
     NetQueue *queue;
-    size_t size = iov_size(iov, iovcnt);
     int ret;
 
-    if (size > NET_BUFSIZE) {
-        return size;
-    }
-
-    if (sender->link_down || !sender->peer) {
-        return size;
-    }
-
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
                              QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
@@ -826,6 +880,29 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    AioContext *ctx;
+    size_t size = iov_size(iov, iovcnt);
+    ssize_t ret;
+
+    if (size > NET_BUFSIZE) {
+        return size;
+    }
+
+    if (sender->link_down || !sender->peer) {
+        return size;
+    }
+
+    ctx = qemu_net_client_acquire(sender);
+    ret = qemu_sendv_packet_locked(sender, iov, iovcnt, sent_cb);
+    qemu_net_client_release(ctx);
+
+    return ret;
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1007,6 +1084,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1105,6 +1185,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -355,8 +355,10 @@ static void net_slirp_poll_notify(Notifier *notifier, void *data)
         break;
     case MAIN_LOOP_POLL_OK:
     case MAIN_LOOP_POLL_ERR:
+        qemu_send_batch_begin(&s->nc);
         slirp_pollfds_poll(s->slirp, poll->state == MAIN_LOOP_POLL_ERR,
                            net_slirp_get_revents, poll->pollfds);
+        qemu_send_batch_end(&s->nc);
         break;
     default:
         g_assert_not_reached();
@@ -185,7 +185,9 @@ static void net_socket_send(void *opaque)
     }
     buf = buf1;
 
+    qemu_send_batch_begin(&s->nc);
     ret = net_fill_rstate(&s->rs, buf, size);
+    qemu_send_batch_end(&s->nc);
 
     if (ret == -1) {
         goto eoc;
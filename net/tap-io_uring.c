@@ -0,0 +1,183 @@
+/*
+ * Batched tap reads with Linux io_uring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "net/net.h"
+#include "qapi/error.h"
+#include "tap_int.h"
+#include "trace.h"
+
+typedef struct TapUringSlot {
+    uint8_t *buf;
+    ssize_t len;
+} TapUringSlot;
+
+struct TapUring {
+    struct io_uring ring;
+
+    /* Number of reads to submit next, adapted to the recent burst size */
+    int depth;
+
+    /* Slots of the packets returned by the last tap_uring_read() */
+    int order[TAP_URING_BATCH];
+
+    TapUringSlot slots[TAP_URING_BATCH];
+};
+
+/*
+ * Reads are submitted with RWF_NOWAIT, so that all of them complete while
+ * io_uring_submit() runs: either with a packet, in the order in which the
+ * tap queued them, or with -EAGAIN once the queue is empty.  Without it,
+ * the kernel would arm a poll handler for the reads that find the queue
+ * empty, and later packets could complete them in any order.
+ *
+ * The tap fd is registered with the ring, which saves looking it up for
+ * every read.
+ */
+static void tap_uring_prep_read(TapUring *u, int i)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    TapUringSlot *slot = &u->slots[i];
+
+    io_uring_prep_read(sqe, 0, slot->buf, slot->buf ? NET_BUFSIZE : 0, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->rw_flags = RWF_NOWAIT;
+    io_uring_sqe_set_data(sqe, slot);
+}
+
+/* Returns the number of reads that were submitted, or -errno */
+static int tap_uring_complete(TapUring *u)
+{
+    struct io_uring_cqe *cqe;
+    int i, ret, submitted;
+
+    submitted = io_uring_submit(&u->ring);
+    if (submitted < 0) {
+        return submitted;
+    }
+
+    /* With RWF_NOWAIT, all completions are already there */
+    for (i = 0; i < submitted; i++) {
+        TapUringSlot *slot;
+
+        do {
+            ret = io_uring_wait_cqe(&u->ring, &cqe);
+        } while (ret == -EINTR);
+        if (ret < 0) {
+            return ret;
+        }
+        slot = io_uring_cqe_get_data(cqe);
+        slot->len = cqe->res;
+        io_uring_cqe_seen(&u->ring, cqe);
+    }
+    return submitted;
+}
+
+int tap_uring_read(TapUring *u, int max)
+{
+    int n = MIN(u->depth, max);
+    int i, ret, packets = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!u->slots[i].buf) {
+            u->slots[i].buf = g_malloc(NET_BUFSIZE);
+        }
+        u->slots[i].len = 0;
+        tap_uring_prep_read(u, i);
+    }
+
+    ret = tap_uring_complete(u);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * A read that finds the queue empty does not stop the ones after it, so
+     * a packet that arrives meanwhile can still show up in a later slot.
+     */
+    for (i = 0; i < n; i++) {
+        if (u->slots[i].len > 0) {
+            u->order[packets++] = i;
+        }
+    }
+
+    if (packets < n) {
+        u->depth = packets + 1;
+    } else {
+        u->depth = MIN(u->depth * 2, TAP_URING_BATCH);
+    }
+
+    trace_tap_uring_read(u, n, packets);
+    return packets;
+}
+
+uint8_t *tap_uring_packet(TapUring *u, int i, size_t *len)
+{
+    TapUringSlot *slot = &u->slots[u->order[i]];
+
+    *len = slot->len;
+    return slot->buf;
+}
+
+TapUring *tap_uring_new(int fd, Error **errp)
+{
+    TapUring *u = g_new0(TapUring, 1);
+    int ret;
+
+    ret = io_uring_queue_init(TAP_URING_BATCH, &u->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to init tap io_uring");
+        g_free(u);
+        return NULL;
+    }
+
+    ret = io_uring_register_files(&u->ring, &fd, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to register tap with io_uring");
+        goto fail;
+    }
+
+    /*
+     * A zero-length read, into the slot that has no buffer yet, does not
+     * consume a packet but tells whether the kernel can read from a tap
+     * with RWF_NOWAIT.
+     */
+    u->slots[0].len = -EIO;
+    tap_uring_prep_read(u, 0);
+    ret = tap_uring_complete(u);
+    if (ret >= 0) {
+        ret = u->slots[0].len;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "tap does not support io_uring reads");
+        goto fail;
+    }
+
+    u->depth = 1;
+    return u;
+
+fail:
+    io_uring_queue_exit(&u->ring);
+    g_free(u);
+    return NULL;
+}
+
+void tap_uring_free(TapUring *u)
+{
+    int i;
+
+    if (!u) {
+        return;
+    }
+
+    io_uring_queue_exit(&u->ring);
+    for (i = 0; i < TAP_URING_BATCH; i++) {
+        g_free(u->slots[i].buf);
+    }
+    g_free(u);
+}
@@ -35,6 +35,7 @@
 #include "net/eth.h"
 #include "net/net.h"
 #include "clients.h"
+#include "block/aio-wait.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
@@ -61,16 +62,34 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx;
+#ifdef CONFIG_LIBURING_PREP_READ
+    TapUring *uring;
+#endif
 } TAPState;
 
+/* Maximum number of packets that one tap_send() passes to the peer */
+#define TAP_SEND_BUDGET 50
+
 static void launch_script(const char *setup_script, const char *ifname,
                           int fd, Error **errp);
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+static void tap_aio_send(void *opaque);
+static void tap_aio_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, true,
+                           s->read_poll && s->enabled ? tap_aio_send : NULL,
+                           s->write_poll && s->enabled ?
+                           tap_aio_writable : NULL,
+                           NULL, NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -181,35 +200,71 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Returns the result of qemu_send_packet_async() */
+static ssize_t tap_send_packet(TAPState *s, uint8_t *buf, int size)
+{
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
+
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
+        }
+    }
+
+    return qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+}
+
+#ifdef CONFIG_LIBURING_PREP_READ
+/*
+ * Like the read() loop in tap_send(), but with one io_uring_enter() for the
+ * whole burst.  If the peer stops accepting packets halfway through, the
+ * rest of the burst has already been read from the tap; it goes into the
+ * peer's queue as well, which TAP_SEND_BUDGET bounds.
+ */
+static void tap_send_uring(TAPState *s)
+{
+    int i, n;
+
+    n = tap_uring_read(s->uring, TAP_SEND_BUDGET);
+    for (i = 0; i < n; i++) {
+        size_t size;
+        uint8_t *buf = tap_uring_packet(s->uring, i, &size);
+
+        if (tap_send_packet(s, buf, size) == 0) {
+            tap_read_poll(s, false);
+        }
+    }
+}
+#endif
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
+    qemu_send_batch_begin(&s->nc);
+#ifdef CONFIG_LIBURING_PREP_READ
+    if (s->uring) {
+        tap_send_uring(s);
+        qemu_send_batch_end(&s->nc);
+        return;
+    }
+#endif
     while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
-
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
-
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
-            }
-        }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+        size = tap_send_packet(s, s->buf, size);
         if (size == 0) {
             tap_read_poll(s, false);
             break;
@@ -224,10 +279,35 @@ static void tap_send(void *opaque)
          * stalling the guest.
          */
         packets++;
-        if (packets >= 50) {
+        if (packets >= TAP_SEND_BUDGET) {
             break;
         }
     }
+    qemu_send_batch_end(&s->nc);
+}
+
+/*
+ * When the tap is polled from an IOThread, its handlers run without the
+ * QEMU global mutex and the peer relies on the AioContext lock instead.
+ */
+static void tap_aio_send(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    tap_send(s);
+    aio_context_release(ctx);
+}
+
+static void tap_aio_writable(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    tap_writable(s);
+    aio_context_release(ctx);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -318,9 +398,29 @@ static void tap_exit_notify(Notifier *notifier, void *data)
     }
 }
 
+/* Context: BH in the IOThread that polls the tap */
+static void tap_detach_aio_context_bh(void *opaque)
+{
+    TAPState *s = opaque;
+
+    qemu_set_aio_context(&s->nc, NULL);
+}
+
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    AioContext *ctx = s->ctx;
+
+    /*
+     * The tap may be removed while its peer still runs in an IOThread.  Take
+     * the fd handlers back from the IOThread itself, so that none of them is
+     * running anymore, and keep the peer's datapath out while the tap goes
+     * away.
+     */
+    if (ctx) {
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, tap_detach_aio_context_bh, s);
+    }
 
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
@@ -335,8 +435,16 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LIBURING_PREP_READ
+    tap_uring_free(s->uring);
+    s->uring = NULL;
+#endif
     close(s->fd);
     s->fd = -1;
+
+    if (ctx) {
+        aio_context_release(ctx);
+    }
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -354,6 +462,26 @@ static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
     return tap_fd_set_steering_ebpf(s->fd, prog_fd) == 0;
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+
+    /* After tap_cleanup() there is no fd left to poll */
+    if (s->ctx == ctx || s->fd == -1) {
+        return;
+    }
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, true, NULL, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -380,6 +508,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -689,6 +818,15 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+#ifdef CONFIG_LIBURING_PREP_READ
+    if (tap->has_io_uring && tap->io_uring) {
+        s->uring = tap_uring_new(s->fd, errp);
+        if (!s->uring) {
+            return;
+        }
+    }
+#endif
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
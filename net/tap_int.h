@@ -46,4 +46,22 @@ int tap_fd_disable(int fd);
 int tap_fd_get_ifname(int fd, char *ifname);
 int tap_fd_set_steering_ebpf(int fd, int prog_fd);
 
+#ifdef CONFIG_LIBURING_PREP_READ
+/* Maximum number of packets that tap_uring_read() reads at once */
+#define TAP_URING_BATCH 64
+
+typedef struct TapUring TapUring;
+
+TapUring *tap_uring_new(int fd, Error **errp);
+void tap_uring_free(TapUring *u);
+
+/*
+ * Read up to @max packets with a single io_uring_enter().  Returns the
+ * number of packets, which tap_uring_packet() then returns in the order in
+ * which they were queued by the tap, or -errno.
+ */
+int tap_uring_read(TapUring *u, int max);
+uint8_t *tap_uring_packet(TapUring *u, int i, size_t *len);
+#endif
+
 #endif /* NET_TAP_INT_H */
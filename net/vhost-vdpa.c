@@ -28,6 +28,9 @@
 #include "monitor/monitor.h"
 #include "hw/virtio/vhost.h"
 
+/* SVQ busy polling holds the BQL, so keep it short */
+#define VHOST_VDPA_SVQ_POLL_US_MAX 1000
+
 /* Todo:need to add the multiqueue support here */
 typedef struct VhostVDPAState {
     NetClientState nc;
@@ -465,6 +468,7 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
                                            int nvqs,
                                            bool is_datapath,
                                            bool svq,
+                                           uint32_t svq_poll_us,
                                            VhostIOVATree *iova_tree)
 {
     NetClientState *nc = NULL;
@@ -484,6 +488,7 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
     s->vhost_vdpa.device_fd = vdpa_device_fd;
     s->vhost_vdpa.index = queue_pair_index;
     s->vhost_vdpa.shadow_vqs_enabled = svq;
+    s->vhost_vdpa.shadow_vq_poll_us = svq_poll_us;
     s->vhost_vdpa.iova_tree = iova_tree;
     if (!is_datapath) {
         s->cvq_cmd_out_buffer = qemu_memalign(qemu_real_host_page_size(),
@@ -575,6 +580,16 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
         return -1;
     }
 
+    if (opts->x_svq_poll_us && !opts->x_svq) {
+        error_setg(errp, "x-svq-poll-us requires x-svq=on");
+        return -1;
+    }
+    if (opts->x_svq_poll_us > VHOST_VDPA_SVQ_POLL_US_MAX) {
+        error_setg(errp, "x-svq-poll-us must not exceed %u",
+                   VHOST_VDPA_SVQ_POLL_US_MAX);
+        return -1;
+    }
+
     vdpa_device_fd = qemu_open(opts->vhostdev, O_RDWR, errp);
     if (vdpa_device_fd == -1) {
         return -errno;
@@ -616,7 +631,7 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
     for (i = 0; i < queue_pairs; i++) {
         ncs[i] = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                      vdpa_device_fd, i, 2, true, opts->x_svq,
-                                     iova_tree);
+                                     opts->x_svq_poll_us, iova_tree);
         if (!ncs[i])
             goto err;
     }
@@ -624,7 +639,7 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
     if (has_cvq) {
         nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                  vdpa_device_fd, i, 1, false,
-                                 opts->x_svq, iova_tree);
+                                 opts->x_svq, 0, iova_tree);
         if (!nc)
             goto err;
     }
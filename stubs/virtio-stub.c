@@ -0,0 +1,17 @@
+/*
+ * QEMU virtio device emulation stubs
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/qapi-commands-machine.h"
+#include "qapi/type-helpers.h"
+
+HumanReadableText *qmp_x_query_virtio_batch(Error **errp)
+{
+    g_autoptr(GString) buf = g_string_new("");
+
+    /* No virtio devices, nothing to report */
+    return human_readable_text_from_str(buf);
+}
@@ -0,0 +1,168 @@
+/*
+ * Microbenchmark for arming and cancelling QEMUTimers
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+
+static QEMUTimerListGroup tlg;
+static QEMUTimer *timers;
+static unsigned int n_timers = 10000;
+static unsigned int duration = 1;
+static unsigned int del_percent = 25;
+static uint64_t mods;
+static uint64_t dels;
+
+static const char commands_string[] =
+    " -d = duration in seconds\n"
+    " -n = number of armed timers\n"
+    " -c = percentage of operations that cancel the timer first";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static void timer_cb(void *opaque)
+{
+    /* timers are armed far enough in the future that they never fire */
+    g_assert_not_reached();
+}
+
+static void notify_cb(void *opaque, QEMUClockType type)
+{
+}
+
+static void create_timers(void)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t r = time(NULL);
+    unsigned int i;
+
+    init_clocks(NULL);
+    timerlistgroup_init(&tlg, notify_cb, NULL);
+
+    timers = g_new0(QEMUTimer, n_timers);
+    for (i = 0; i < n_timers; i++) {
+        r = xorshift64star(r);
+        timer_init_full(&timers[i], &tlg, QEMU_CLOCK_REALTIME, SCALE_NS, 0,
+                        timer_cb, NULL);
+        timer_mod_ns(&timers[i], now + NANOSECONDS_PER_SECOND * 3600 +
+                     r % NANOSECONDS_PER_SECOND);
+    }
+}
+
+static void run_test(void)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t end = start + duration * NANOSECONDS_PER_SECOND;
+    int64_t now = start;
+    uint64_t r = time(NULL);
+
+    while (now < end) {
+        unsigned int i;
+
+        for (i = 0; i < 1024; i++) {
+            QEMUTimer *ts;
+
+            r = xorshift64star(r);
+            ts = &timers[(r >> 32) % n_timers];
+            if ((r >> 8) % 100 < del_percent) {
+                timer_del(ts);
+                dels++;
+            }
+            timer_mod_ns(ts, now + NANOSECONDS_PER_SECOND * 3600 +
+                         r % NANOSECONDS_PER_SECOND);
+            mods++;
+        }
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+}
+
+static void destroy_timers(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_timers; i++) {
+        timer_del(&timers[i]);
+    }
+    timerlistgroup_deinit(&tlg);
+    g_free(timers);
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of timers:       %u\n", n_timers);
+    printf(" duration:          %u\n", duration);
+    printf(" cancel ratio:      %u%%\n", del_percent);
+}
+
+static void pr_stats(void)
+{
+    double tx = (mods + dels) / duration / 1e6;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" timer_mod_ns:       %" PRIu64 "\n", mods);
+    printf(" timer_del:          %" PRIu64 "\n", dels);
+    printf(" Throughput:         %.2f Mops/s\n", tx);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:c:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "duration must be a positive number "
+                        "of seconds\n");
+                exit(1);
+            }
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_timers = MAX(atoi(optarg), 1);
+            break;
+        case 'c':
+            del_percent = MIN(atoi(optarg), 100);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pr_params();
+    create_timers();
+    run_test();
+    destroy_timers();
+    pr_stats();
+    return 0;
+}
@@ -130,6 +130,7 @@ QVirtQueue *qvirtqueue_setup(QVirtioDevice *d,
 void qvirtqueue_cleanup(const QVirtioBus *bus, QVirtQueue *vq,
                         QGuestAllocator *alloc)
 {
+    g_free(vq->chain_len);
     return bus->virtqueue_cleanup(vq, alloc);
 }
 
@@ -234,11 +235,47 @@ void qvirtio_wait_config_isr(QVirtioDevice *d, gint64 timeout_us)
     d->bus->wait_config_isr_status(d, timeout_us);
 }
 
+/*
+ * Packed layout: the descriptor ring, then the driver event suppression
+ * structure at vq->avail and the device one at vq->used.  This fits in the
+ * area that qvring_size() computes for a split ring of the same size.
+ */
+static void qvring_init_packed(QTestState *qts, QVirtQueue *vq, uint64_t addr)
+{
+    int i;
+
+    vq->desc = addr;
+    vq->avail = vq->desc + vq->size * sizeof(struct vring_packed_desc);
+    vq->used = (uint64_t)((vq->avail +
+                           sizeof(struct vring_packed_desc_event) +
+                           vq->align - 1) & ~(vq->align - 1));
+    vq->avail_wrap_counter = true;
+    vq->used_wrap_counter = true;
+    vq->in_chain = false;
+    vq->chain_len = g_new0(uint16_t, vq->size);
+
+    for (i = 0; i < vq->size; i++) {
+        /* vq->desc[i].flags */
+        qvirtio_writew(vq->vdev, qts, vq->desc + (16 * i) + 14, 0);
+    }
+
+    /* vq->driver_event->off_wrap, vq->driver_event->flags */
+    qvirtio_writel(vq->vdev, qts, vq->avail, 0);
+    /* vq->device_event->off_wrap, vq->device_event->flags */
+    qvirtio_writel(vq->vdev, qts, vq->used, 0);
+}
+
 void qvring_init(QTestState *qts, const QGuestAllocator *alloc, QVirtQueue *vq,
                  uint64_t addr)
 {
     int i;
 
+    vq->packed = vq->vdev->features & (1ull << VIRTIO_F_RING_PACKED);
+    if (vq->packed) {
+        qvring_init_packed(qts, vq, addr);
+        return;
+    }
+
     vq->desc = addr;
     vq->avail = vq->desc + vq->size * sizeof(struct vring_desc);
     vq->used = (uint64_t)((vq->avail + sizeof(uint16_t) * (3 + vq->size)
@@ -317,6 +354,56 @@ void qvring_indirect_desc_add(QVirtioDevice *d, QTestState *qts,
     indirect->index++;
 }
 
+/*
+ * Every descriptor of a chain carries the index of the chain head as buffer
+ * id.  The flags of the head are written last, so that the device never sees
+ * a partial chain.
+ */
+static uint32_t qvirtqueue_add_packed(QTestState *qts, QVirtQueue *vq,
+                                      uint64_t data, uint32_t len,
+                                      uint16_t flags, bool next)
+{
+    uint16_t idx = vq->free_head;
+
+    if (vq->avail_wrap_counter) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+    } else {
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+
+    if (!vq->in_chain) {
+        vq->chain_head = idx;
+        vq->chain_len[idx] = 0;
+    }
+    vq->chain_len[vq->chain_head]++;
+
+    /* vq->desc[idx].addr */
+    qvirtio_writeq(vq->vdev, qts, vq->desc + (16 * idx), data);
+    /* vq->desc[idx].len */
+    qvirtio_writel(vq->vdev, qts, vq->desc + (16 * idx) + 8, len);
+    /* vq->desc[idx].id */
+    qvirtio_writew(vq->vdev, qts, vq->desc + (16 * idx) + 12,
+                   vq->chain_head);
+    if (idx == vq->chain_head) {
+        vq->chain_head_flags = flags;
+    } else {
+        /* vq->desc[idx].flags */
+        qvirtio_writew(vq->vdev, qts, vq->desc + (16 * idx) + 14, flags);
+    }
+    if (!next) {
+        /* vq->desc[vq->chain_head].flags */
+        qvirtio_writew(vq->vdev, qts, vq->desc + (16 * vq->chain_head) + 14,
+                       vq->chain_head_flags);
+    }
+    vq->in_chain = next;
+
+    if (++vq->free_head == vq->size) {
+        vq->free_head = 0;
+        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+    }
+    return idx;
+}
+
 uint32_t qvirtqueue_add(QTestState *qts, QVirtQueue *vq, uint64_t data,
                         uint32_t len, bool write, bool next)
 {
@@ -331,6 +418,10 @@ uint32_t qvirtqueue_add(QTestState *qts, QVirtQueue *vq, uint64_t data,
         flags |= VRING_DESC_F_NEXT;
     }
 
+    if (vq->packed) {
+        return qvirtqueue_add_packed(qts, vq, data, len, flags, next);
+    }
+
     /* vq->desc[vq->free_head].addr */
     qvirtio_writeq(vq->vdev, qts, vq->desc + (16 * vq->free_head), data);
     /* vq->desc[vq->free_head].len */
@@ -373,6 +464,15 @@ void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
     /* vq->used->avail_event */
     uint16_t avail_event;
 
+    if (vq->packed) {
+        /* vq->device_event->flags */
+        flags = qvirtio_readw(d, qts, vq->used + 2);
+        if (flags != VRING_PACKED_EVENT_FLAG_DISABLE) {
+            d->bus->virtqueue_kick(d, vq);
+        }
+        return;
+    }
+
     /* vq->avail->ring[idx % vq->size] */
     qvirtio_writew(d, qts, vq->avail + 4 + (2 * (idx % vq->size)), free_head);
     /* vq->avail->idx */
@@ -400,12 +500,51 @@ void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
  *
  * Returns: true if an element was ready, false otherwise
  */
+static bool qvirtqueue_get_buf_packed(QTestState *qts, QVirtQueue *vq,
+                                      uint32_t *desc_idx, uint32_t *len)
+{
+    uint64_t desc_addr = vq->desc + (16 * vq->last_used_idx);
+    uint16_t flags, id;
+    bool avail, used;
+
+    /* vq->desc[vq->last_used_idx].flags */
+    flags = qvirtio_readw(vq->vdev, qts, desc_addr + 14);
+    avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    if (avail != used || used != vq->used_wrap_counter) {
+        return false;
+    }
+
+    /* vq->desc[vq->last_used_idx].id */
+    id = qvirtio_readw(vq->vdev, qts, desc_addr + 12);
+    g_assert_cmpint(id, <, vq->size);
+    g_assert_cmpint(vq->chain_len[id], !=, 0);
+    if (desc_idx) {
+        *desc_idx = id;
+    }
+    if (len) {
+        /* vq->desc[vq->last_used_idx].len */
+        *len = qvirtio_readl(vq->vdev, qts, desc_addr + 8);
+    }
+
+    vq->last_used_idx += vq->chain_len[id];
+    if (vq->last_used_idx >= vq->size) {
+        vq->last_used_idx -= vq->size;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    return true;
+}
+
 bool qvirtqueue_get_buf(QTestState *qts, QVirtQueue *vq, uint32_t *desc_idx,
                         uint32_t *len)
 {
     uint16_t idx;
     uint64_t elem_addr, addr;
 
+    if (vq->packed) {
+        return qvirtqueue_get_buf_packed(qts, vq, desc_idx, len);
+    }
+
     idx = qvirtio_readw(vq->vdev, qts,
                         vq->used + offsetof(struct vring_used, idx));
     if (idx == vq->last_used_idx) {
@@ -39,6 +39,15 @@ typedef struct QVirtQueue {
     uint16_t last_used_idx;
     bool indirect;
     bool event;
+
+    /* Packed ring state; free_head and last_used_idx index the ring */
+    bool packed;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    uint16_t chain_head;        /* Head of the chain being added */
+    uint16_t chain_head_flags;  /* Written once the chain is complete */
+    bool in_chain;
+    uint16_t *chain_len;        /* Descriptors per buffer id */
 } QVirtQueue;
 
 typedef struct QVRingIndirectDesc {
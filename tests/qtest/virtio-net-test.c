@@ -9,6 +9,8 @@
 
 #include "qemu/osdep.h"
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qdict.h"
@@ -16,6 +18,13 @@
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
 
+#ifdef CONFIG_LINUX
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#endif
+
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
 #endif
@@ -165,6 +174,238 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+#define PACKED_TX_PKT_LEN 1000
+#define PACKED_TX_BURST 48
+#define PACKED_TX_ROUNDS 6
+
+/*
+ * Send header/payload chains on a packed ring while the backend socket is
+ * full.  virtio-net then gives back the descriptors that it popped but could
+ * not send, and must pop them again as whole chains.  The rounds go around
+ * the ring a few times, so that this also happens across a wrap.
+ */
+static void packed_tx_unpop_test(void *obj, void *data,
+                                 QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *vq = net_if->queues[1];
+    QTestState *qts = global_qtest;
+    int *sv = data;
+    int sndbuf = 4096;
+    uint64_t hdr_addr, data_addr[PACKED_TX_BURST];
+    uint32_t heads[PACKED_TX_BURST];
+    uint8_t buffer[PACKED_TX_PKT_LEN];
+    int round, i, j, ret;
+
+    if (!vq->packed) {
+        g_test_skip("packed ring not negotiated");
+        return;
+    }
+
+    /* Make QEMU's end of the socket fill up after a few packets */
+    ret = setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    g_assert_cmpint(ret, ==, 0);
+
+    hdr_addr = guest_alloc(t_alloc, VNET_HDR_SIZE);
+    qtest_memset(qts, hdr_addr, 0, VNET_HDR_SIZE);
+    for (i = 0; i < PACKED_TX_BURST; i++) {
+        data_addr[i] = guest_alloc(t_alloc, PACKED_TX_PKT_LEN);
+    }
+
+    for (round = 0; round < PACKED_TX_ROUNDS; round++) {
+        for (i = 0; i < PACKED_TX_BURST; i++) {
+            qtest_memset(qts, data_addr[i], round * PACKED_TX_BURST + i,
+                         PACKED_TX_PKT_LEN);
+            heads[i] = qvirtqueue_add(qts, vq, hdr_addr, VNET_HDR_SIZE,
+                                      false, true);
+            qvirtqueue_add(qts, vq, data_addr[i], PACKED_TX_PKT_LEN,
+                           false, false);
+        }
+        qvirtqueue_kick(qts, dev, vq, heads[0]);
+
+        /* Every packet must come out once, whole and in order */
+        for (i = 0; i < PACKED_TX_BURST; i++) {
+            uint32_t len;
+
+            ret = recv(sv[0], &len, sizeof(len), MSG_WAITALL);
+            g_assert_cmpint(ret, ==, sizeof(len));
+            g_assert_cmpint(ntohl(len), ==, PACKED_TX_PKT_LEN);
+
+            ret = recv(sv[0], buffer, PACKED_TX_PKT_LEN, MSG_WAITALL);
+            g_assert_cmpint(ret, ==, PACKED_TX_PKT_LEN);
+            for (j = 0; j < PACKED_TX_PKT_LEN; j++) {
+                g_assert_cmphex(buffer[j], ==,
+                                (uint8_t)(round * PACKED_TX_BURST + i));
+            }
+        }
+
+        for (i = 0; i < PACKED_TX_BURST; i++) {
+            gint64 start_time = g_get_monotonic_time();
+            uint32_t id;
+
+            while (!qvirtqueue_get_buf(qts, vq, &id, NULL)) {
+                qtest_clock_step(qts, 100);
+                g_assert(g_get_monotonic_time() - start_time <=
+                         QVIRTIO_NET_TIMEOUT_US);
+            }
+            g_assert_cmpint(id, ==, heads[i]);
+        }
+    }
+
+    for (i = 0; i < PACKED_TX_BURST; i++) {
+        guest_free(t_alloc, data_addr[i]);
+    }
+    guest_free(t_alloc, hdr_addr);
+}
+
+#define GRO_MSS 1000
+#define GRO_SEGS 2
+#define GRO_IP_OFF 14
+#define GRO_TCP_OFF (GRO_IP_OFF + 20)
+#define GRO_HDR_LEN (GRO_TCP_OFF + 20)
+#define GRO_TCP_LEN(payload) (20 + (payload))
+
+/* Folded 16-bit ones' complement sum; 0xffff over valid data */
+static uint16_t gro_csum(const uint8_t *buf, size_t len, uint32_t sum)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += lduw_be_p(buf + i);
+    }
+    if (i < len) {
+        sum += buf[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static uint32_t gro_pseudo_sum(const uint8_t *ip, uint16_t tcp_len)
+{
+    return gro_csum(ip + 12, 8, IPPROTO_TCP + tcp_len);
+}
+
+static uint16_t gro_hdr_field(QVirtioDevice *dev, uint16_t val)
+{
+    return qvirtio_is_big_endian(dev) ? be16_to_cpu(val) : le16_to_cpu(val);
+}
+
+/* Build one segment of a 10.0.2.2:80 -> 10.0.2.15:12345 TCP stream */
+static size_t gro_build_segment(uint8_t *frame, uint32_t seq, uint8_t fill)
+{
+    static const uint8_t macs[12] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+    };
+    static const uint8_t addrs[8] = { 10, 0, 2, 2, 10, 0, 2, 15 };
+    uint8_t *ip = frame + GRO_IP_OFF;
+    uint8_t *tcp = frame + GRO_TCP_OFF;
+
+    memset(frame, 0, GRO_HDR_LEN);
+    memcpy(frame, macs, sizeof(macs));
+    stw_be_p(frame + 12, 0x0800); /* IPv4 */
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + GRO_TCP_LEN(GRO_MSS));
+    stw_be_p(ip + 6, 0x4000); /* DF */
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    memcpy(ip + 12, addrs, sizeof(addrs));
+    stw_be_p(ip + 10, ~gro_csum(ip, 20, 0));
+
+    stw_be_p(tcp, 80);
+    stw_be_p(tcp + 2, 12345);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    stw_be_p(tcp + 12, 0x5010); /* 20 byte header, ACK */
+    stw_be_p(tcp + 14, 0xffff);
+    memset(tcp + 20, fill, GRO_MSS);
+    stw_be_p(tcp + 16, ~gro_csum(tcp, GRO_TCP_LEN(GRO_MSS),
+                                 gro_pseudo_sum(ip, GRO_TCP_LEN(GRO_MSS))));
+
+    return GRO_HDR_LEN + GRO_MSS;
+}
+
+/*
+ * Segments of a TCP stream that the socket backend reads in one go must
+ * reach the guest as a single TSO packet, with a partial checksum that the
+ * guest can complete.
+ */
+static void gro_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *vq = net_if->queues[0];
+    QTestState *qts = global_qtest;
+    int *sv = data;
+    uint8_t buf[GRO_SEGS * (4 + GRO_HDR_LEN + GRO_MSS)];
+    uint8_t frame[GRO_HDR_LEN + GRO_SEGS * GRO_MSS];
+    uint8_t *ip = frame + GRO_IP_OFF;
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    uint16_t csum_start, csum_offset, sum;
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    size_t off = 0;
+    int i, j, ret;
+
+    if (!(dev->features & (1ull << VIRTIO_NET_F_GUEST_TSO4))) {
+        g_test_skip("guest_tso4 not negotiated");
+        return;
+    }
+
+    req_addr = guest_alloc(t_alloc, 4096);
+    free_head = qvirtqueue_add(qts, vq, req_addr, 4096, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    for (i = 0; i < GRO_SEGS; i++) {
+        len = gro_build_segment(buf + off + 4, 1 + i * GRO_MSS, 'a' + i);
+        stl_be_p(buf + off, len);
+        off += 4 + len;
+    }
+
+    /* One write, so that QEMU receives all segments in a single batch */
+    ret = send(sv[0], buf, off, 0);
+    g_assert_cmpint(ret, ==, off);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, &len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + sizeof(frame));
+
+    memread(req_addr, &hdr, sizeof(hdr));
+    g_assert_cmpint(hdr.hdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmpint(hdr.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(gro_hdr_field(dev, hdr.hdr.hdr_len), ==, GRO_HDR_LEN);
+    g_assert_cmpint(gro_hdr_field(dev, hdr.hdr.gso_size), ==, GRO_MSS);
+    csum_start = gro_hdr_field(dev, hdr.hdr.csum_start);
+    csum_offset = gro_hdr_field(dev, hdr.hdr.csum_offset);
+    g_assert_cmpint(csum_start, ==, GRO_TCP_OFF);
+    g_assert_cmpint(csum_offset, ==, 16);
+
+    memread(req_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+    g_assert_cmpint(lduw_be_p(ip + 2), ==,
+                    20 + GRO_TCP_LEN(GRO_SEGS * GRO_MSS));
+    g_assert_cmphex(gro_csum(ip, 20, 0), ==, 0xffff);
+    for (i = 0; i < GRO_SEGS; i++) {
+        for (j = 0; j < GRO_MSS; j++) {
+            g_assert_cmphex(frame[GRO_HDR_LEN + i * GRO_MSS + j], ==, 'a' + i);
+        }
+    }
+
+    /* Complete the checksum the way the guest would, then verify it */
+    sum = gro_csum(frame + csum_start, sizeof(frame) - csum_start, 0);
+    stw_be_p(frame + csum_start + csum_offset, ~sum);
+    g_assert_cmphex(gro_csum(frame + GRO_TCP_OFF,
+                             GRO_TCP_LEN(GRO_SEGS * GRO_MSS),
+                             gro_pseudo_sum(ip, GRO_TCP_LEN(GRO_SEGS *
+                                                            GRO_MSS))),
+                    ==, 0xffff);
+
+    guest_free(t_alloc, req_addr);
+}
+
 #endif
 
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -317,6 +558,325 @@ static void *virtio_net_test_setup_nosocket(GString *cmd_line, void *arg)
     return arg;
 }
 
+#ifdef CONFIG_LINUX
+#define TAP_TEST_ETHERTYPE 0x88b5 /* IEEE local experimental */
+#define TAP_TEST_FRAME_LEN 60
+#define TAP_TEST_RX_TRIES 16
+
+typedef struct TapTestData {
+    int tap_fd;
+    int pkt_fd;
+    int ifindex;
+    const char *netdev_opts;
+} TapTestData;
+
+static int tap_test_open(char *ifname)
+{
+    struct ifreq ifr = {
+        .ifr_flags = IFF_TAP | IFF_NO_PI,
+    };
+    int fd;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (ifname) {
+        pstrcpy(ifname, IFNAMSIZ, ifr.ifr_name);
+    }
+    return fd;
+}
+
+/* Creating a tap device needs CAP_NET_ADMIN */
+static bool tap_test_available(void)
+{
+    int fd = tap_test_open(NULL);
+
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static void tap_test_fill_frame(uint8_t *frame, const char *payload)
+{
+    static const uint8_t src[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+
+    memset(frame, 0, TAP_TEST_FRAME_LEN);
+    memset(frame, 0xff, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, src, ETH_ALEN);
+    stw_be_p(frame + 2 * ETH_ALEN, TAP_TEST_ETHERTYPE);
+    pstrcpy((char *)frame + ETH_HLEN, TAP_TEST_FRAME_LEN - ETH_HLEN, payload);
+}
+
+/* Have the host kernel transmit a frame on the tap, i.e. towards the guest */
+static void tap_test_send(TapTestData *d, const char *payload)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = d->ifindex,
+        .sll_halen = ETH_ALEN,
+    };
+    uint8_t frame[TAP_TEST_FRAME_LEN];
+    ssize_t ret;
+
+    tap_test_fill_frame(frame, payload);
+    ret = sendto(d->pkt_fd, frame, sizeof(frame), 0,
+                 (struct sockaddr *)&sll, sizeof(sll));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+}
+
+/*
+ * Wait for a test frame in a receive buffer of the guest.  The host can
+ * still emit the odd frame of its own on the interface, so skip those.
+ */
+static void tap_test_rx_wait(QVirtioDevice *dev, QVirtQueue *vq,
+                             uint64_t req_addr,
+                             uint32_t free_head, const char *payload)
+{
+    QTestState *qts = global_qtest;
+    uint8_t frame[TAP_TEST_FRAME_LEN];
+    int i;
+
+    for (i = 0; i < TAP_TEST_RX_TRIES; i++) {
+        qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                               QVIRTIO_NET_TIMEOUT_US);
+        memread(req_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+        if (lduw_be_p(frame + 2 * ETH_ALEN) == TAP_TEST_ETHERTYPE) {
+            g_assert_cmpstr((char *)frame + ETH_HLEN, ==, payload);
+            return;
+        }
+        free_head = qvirtqueue_add(qts, vq, req_addr, 128, true, false);
+        qvirtqueue_kick(qts, dev, vq, free_head);
+    }
+    g_assert_not_reached();
+}
+
+static void tap_test_rx(QVirtioDevice *dev, QGuestAllocator *alloc,
+                        QVirtQueue *vq, TapTestData *d, bool stop_cont)
+{
+    QTestState *qts = global_qtest;
+    uint64_t req_addr;
+    uint32_t free_head;
+    QDict *rsp;
+
+    req_addr = guest_alloc(alloc, 128);
+    free_head = qvirtqueue_add(qts, vq, req_addr, 128, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    if (stop_cont) {
+        rsp = qmp("{ 'execute' : 'stop'}");
+        qobject_unref(rsp);
+    }
+
+    tap_test_send(d, "TEST");
+
+    if (stop_cont) {
+        rsp = qmp("{ 'execute' : 'query-status'}");
+        qobject_unref(rsp);
+        rsp = qmp("{ 'execute' : 'cont'}");
+        qobject_unref(rsp);
+    }
+
+    tap_test_rx_wait(dev, vq, req_addr, free_head, "TEST");
+    guest_free(alloc, req_addr);
+}
+
+static void tap_test_tx(QVirtioDevice *dev, QGuestAllocator *alloc,
+                        QVirtQueue *vq, TapTestData *d)
+{
+    QTestState *qts = global_qtest;
+    uint8_t frame[TAP_TEST_FRAME_LEN];
+    uint8_t buffer[TAP_TEST_FRAME_LEN];
+    uint64_t req_addr;
+    uint32_t free_head;
+    ssize_t ret;
+
+    req_addr = guest_alloc(alloc, 128);
+    qtest_memset(qts, req_addr, 0, VNET_HDR_SIZE);
+    tap_test_fill_frame(frame, "TEST");
+    memwrite(req_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+
+    free_head = qvirtqueue_add(qts, vq, req_addr,
+                               VNET_HDR_SIZE + sizeof(frame), false, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    ret = recv(d->pkt_fd, buffer, sizeof(buffer), 0);
+    g_assert_cmpint(ret, ==, sizeof(buffer));
+    g_assert_cmpmem(buffer, sizeof(buffer), frame, sizeof(frame));
+}
+
+/*
+ * Run the datapath in an IOThread, then take it through the paths that
+ * hand the host notifiers back and forth with the transport: stop/cont
+ * and a device reset.
+ */
+static void iothreads_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QVirtQueue *tx = net_if->queues[1];
+    TapTestData *d = data;
+    QDict *rsp;
+
+    tap_test_rx(dev, t_alloc, rx, d, false);
+    tap_test_tx(dev, t_alloc, tx, d);
+    tap_test_rx(dev, t_alloc, rx, d, true);
+    tap_test_tx(dev, t_alloc, tx, d);
+
+    qvirtio_reset(dev);
+    rsp = qmp("{ 'execute' : 'query-status'}");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+}
+
+#define TAP_BENCH_ROUNDS 16
+#define TAP_BENCH_BUF_LEN 128
+
+/*
+ * Packet rate from the host into the guest, through tap_send() and the
+ * virtio-net receive path in an IOThread.  Each round fills the receive
+ * ring, has the host send as many frames in one sendmmsg(), and times how
+ * long it takes until the last one is in the used ring.
+ */
+static void tap_rx_bench(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *vq = net_if->queues[0];
+    TapTestData *d = data;
+    QTestState *qts = global_qtest;
+    unsigned int num = vq->size;
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = d->ifindex,
+        .sll_halen = ETH_ALEN,
+    };
+    uint8_t frame[TAP_TEST_FRAME_LEN];
+    struct iovec iov = {
+        .iov_base = frame,
+        .iov_len = sizeof(frame),
+    };
+    g_autofree struct mmsghdr *msgs = g_new0(struct mmsghdr, num);
+    uint64_t bufs = guest_alloc(t_alloc, num * TAP_BENCH_BUF_LEN);
+    uint16_t used_idx = qvirtio_readw(dev, qts, vq->used + 2);
+    int64_t start, elapsed = 0;
+    unsigned int i, round;
+    double pps;
+    int ret;
+
+    tap_test_fill_frame(frame, "BENCH");
+    for (i = 0; i < num; i++) {
+        msgs[i].msg_hdr.msg_name = &sll;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sll);
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (round = 0; round < TAP_BENCH_ROUNDS; round++) {
+        /* All descriptors are back from the device, start over */
+        vq->free_head = 0;
+        vq->num_free = vq->size;
+        for (i = 0; i < num; i++) {
+            uint32_t head = qvirtqueue_add(qts, vq,
+                                           bufs + i * TAP_BENCH_BUF_LEN,
+                                           TAP_BENCH_BUF_LEN, true, false);
+            qvirtqueue_kick(qts, dev, vq, head);
+        }
+        used_idx += num;
+
+        start = g_get_monotonic_time();
+        ret = sendmmsg(d->pkt_fd, msgs, num, 0);
+        g_assert_cmpint(ret, ==, num);
+        while (qvirtio_readw(dev, qts, vq->used + 2) != used_idx) {
+            g_assert_cmpint(g_get_monotonic_time() - start, <,
+                            QVIRTIO_NET_TIMEOUT_US);
+        }
+        elapsed += g_get_monotonic_time() - start;
+    }
+
+    pps = (double)TAP_BENCH_ROUNDS * num * G_USEC_PER_SEC / elapsed;
+    g_test_maximized_result(pps, "tap%s to virtio-net: %.0f packets/s",
+                            d->netdev_opts, pps);
+    guest_free(t_alloc, bufs);
+}
+
+static void virtio_net_test_cleanup_tap(void *data)
+{
+    TapTestData *d = data;
+
+    qos_invalidate_command_line();
+    close(d->pkt_fd);
+    close(d->tap_fd);
+    g_free(d);
+}
+
+static void *virtio_net_test_setup_tap(GString *cmd_line, void *arg)
+{
+    TapTestData *d = g_new0(TapTestData, 1);
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(TAP_TEST_ETHERTYPE),
+    };
+    struct timeval tv = {
+        .tv_sec = QVIRTIO_NET_TIMEOUT_US / G_USEC_PER_SEC,
+    };
+    char ifname[IFNAMSIZ];
+    struct ifreq ifr = { 0 };
+    g_autofree char *path = NULL;
+    int sock, ret;
+
+    d->tap_fd = tap_test_open(ifname);
+    g_assert_cmpint(d->tap_fd, >=, 0);
+    d->ifindex = if_nametoindex(ifname);
+    g_assert_cmpint(d->ifindex, >, 0);
+
+    /* Keep IPv6 autoconfiguration quiet; not fatal if it cannot be done */
+    path = g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6", ifname);
+    g_file_set_contents(path, "1", 1, NULL);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(sock, >=, 0);
+    pstrcpy(ifr.ifr_name, IFNAMSIZ, ifname);
+    ret = ioctl(sock, SIOCGIFFLAGS, &ifr);
+    g_assert_cmpint(ret, ==, 0);
+    ifr.ifr_flags |= IFF_UP | IFF_NOARP;
+    ret = ioctl(sock, SIOCSIFFLAGS, &ifr);
+    g_assert_cmpint(ret, ==, 0);
+    /* Room for a whole receive ring of frames, see tap_rx_bench() */
+    ifr.ifr_qlen = 4096;
+    ret = ioctl(sock, SIOCSIFTXQLEN, &ifr);
+    g_assert_cmpint(ret, ==, 0);
+    close(sock);
+
+    d->pkt_fd = socket(AF_PACKET, SOCK_RAW, htons(TAP_TEST_ETHERTYPE));
+    g_assert_cmpint(d->pkt_fd, >=, 0);
+    sll.sll_ifindex = d->ifindex;
+    ret = bind(d->pkt_fd, (struct sockaddr *)&sll, sizeof(sll));
+    g_assert_cmpint(ret, ==, 0);
+    ret = setsockopt(d->pkt_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    g_assert_cmpint(ret, ==, 0);
+
+    d->netdev_opts = arg ? arg : "";
+    g_string_append_printf(cmd_line, " -object iothread,id=io0 "
+                           "-netdev tap,fd=%d,id=hs0%s ", d->tap_fd,
+                           d->netdev_opts);
+
+    g_test_queue_destroy(virtio_net_test_cleanup_tap, d);
+    return d;
+}
+#endif
+
 static void register_virtio_net_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -329,6 +889,33 @@ static void register_virtio_net_test(void)
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
 #endif
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
+#ifndef _WIN32
+    opts.edge.extra_device_opts = "packed=on";
+    qos_add_test("packed_tx_unpop", "virtio-net", packed_tx_unpop_test, &opts);
+    opts.edge.extra_device_opts = "gro=on";
+    qos_add_test("gro", "virtio-net", gro_test, &opts);
+    opts.edge.extra_device_opts = NULL;
+#endif
+#ifdef CONFIG_LINUX
+    if (tap_test_available()) {
+        opts.before = virtio_net_test_setup_tap;
+        opts.edge.extra_device_opts = "iothreads=io0";
+        qos_add_test("iothreads", "virtio-net", iothreads_test, &opts);
+
+        if (g_test_perf()) {
+            opts.edge.extra_device_opts = "iothreads=io0,rx_queue_size=1024";
+            qos_add_test("tap-rx-bench/read", "virtio-net", tap_rx_bench,
+                         &opts);
+#ifdef CONFIG_LIBURING_PREP_READ
+            opts.arg = (gpointer)",io-uring=on";
+            qos_add_test("tap-rx-bench/io-uring", "virtio-net", tap_rx_bench,
+                         &opts);
+            opts.arg = NULL;
+#endif
+        }
+        opts.edge.extra_device_opts = NULL;
+    }
+#endif
 
     /* These tests do not need a loopback backend.  */
     opts.before = virtio_net_test_setup_nosocket;
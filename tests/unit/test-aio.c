@@ -210,6 +210,46 @@ static void test_bh_schedule10(void)
     qemu_bh_delete(data.bh);
 }
 
+static void bh_stats_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+
+    data->n++;
+}
+
+static void find_bh_stats(const AioCallbackStats *stats, void *opaque)
+{
+    const AioCallbackStats **found = opaque;
+
+    if (stats->kind == AIO_CALLBACK_BH && stats->func == bh_stats_cb) {
+        *found = stats;
+    }
+}
+
+static void test_bh_stats(void)
+{
+    BHTestData data = { .n = 0 };
+    const AioCallbackStats *stats = NULL;
+    int i;
+
+    data.bh = aio_bh_new(ctx, bh_stats_cb, &data);
+    for (i = 0; i < 3; i++) {
+        qemu_bh_schedule(data.bh);
+        g_assert(aio_poll(ctx, false));
+    }
+    aio_bh_schedule_oneshot(ctx, bh_stats_cb, &data);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 4);
+
+    aio_context_foreach_callback_stats(ctx, find_bh_stats, &stats);
+    g_assert(stats);
+    g_assert_cmpstr(stats->name, ==, "bh_stats_cb");
+    g_assert_cmpint(stats->count, ==, 4);
+    /* Only the first of AIO_CALLBACK_STATS_SAMPLE invocations is timed */
+    g_assert_cmpint(stats->timed, ==, 1);
+    qemu_bh_delete(data.bh);
+}
+
 static void test_bh_cancel(void)
 {
     BHTestData data = { .n = 0 };
@@ -456,6 +496,72 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+#define ORDER_TIMERS 64
+
+typedef struct {
+    int fired[ORDER_TIMERS];
+    int n_fired;
+} OrderTestData;
+
+typedef struct {
+    QEMUTimer timer;
+    OrderTestData *data;
+    int index;
+    int64_t expire;
+    int armed;      /* order of the last timer_mod() */
+} OrderTimer;
+
+static void order_timer_cb(void *opaque)
+{
+    OrderTimer *t = opaque;
+
+    t->data->fired[t->data->n_fired++] = t->index;
+}
+
+/*
+ * Check that timers fire in order of expiry, and in the order they were
+ * armed if they expire at the same time, also after they have been
+ * modified and deleted.
+ */
+static void test_timer_order(void)
+{
+    OrderTimer timers[ORDER_TIMERS];
+    OrderTestData data = { .n_fired = 0 };
+    int n_armed = 0;
+    int64_t base;
+    int i;
+
+    base = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - SCALE_MS * 1000;
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        aio_timer_init(ctx, &timers[i].timer, QEMU_CLOCK_REALTIME,
+                       SCALE_NS, order_timer_cb, &timers[i]);
+        timers[i].data = &data;
+        timers[i].index = i;
+        timers[i].expire = base + ((i * 37) % 8) * SCALE_MS;
+        timers[i].armed = n_armed++;
+        timer_mod(&timers[i].timer, timers[i].expire);
+    }
+    for (i = 0; i < ORDER_TIMERS; i += 3) {
+        timers[i].expire = base + ((i * 11) % 8) * SCALE_MS;
+        timers[i].armed = n_armed++;
+        timer_mod(&timers[i].timer, timers[i].expire);
+    }
+    for (i = 0; i < ORDER_TIMERS; i += 5) {
+        timer_del(&timers[i].timer);
+    }
+
+    do {} while (aio_poll(ctx, false));
+
+    g_assert_cmpint(data.n_fired, ==, ORDER_TIMERS - (ORDER_TIMERS + 4) / 5);
+    for (i = 1; i < data.n_fired; i++) {
+        OrderTimer *prev = &timers[data.fired[i - 1]];
+        OrderTimer *cur = &timers[data.fired[i]];
+
+        g_assert(prev->expire < cur->expire ||
+                 (prev->expire == cur->expire && prev->armed < cur->armed));
+    }
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -931,12 +1037,14 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/bh/stats",                test_bh_stats);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
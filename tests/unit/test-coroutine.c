@@ -423,6 +423,85 @@ static void test_co_rwlock_downgrade(void)
     g_assert(c1_done);
 }
 
+/*
+ * Check that readers queued behind a writer are admitted together
+ *
+ * | w1     | r1..r3     | w2         |
+ * |--------+------------+------------|
+ * | wrlock |            |            |
+ * | yield  |            |            |
+ * |        | rdlock     |            |
+ * |        | <queued>   |            |
+ * |        |            | wrlock     |
+ * |        |            | <queued>   |
+ * | unlock |            |            |
+ * |        | <dequeued> |            |
+ * |        | yield      |            |
+ * |        | unlock     |            |
+ * |        |            | <dequeued> |
+ * |        |            | unlock     |
+ */
+
+#define NUM_BATCHED_READERS 3
+
+static void coroutine_fn rwlock_wrlock_unlock_batch(void *opaque)
+{
+    qemu_co_rwlock_wrlock(&rwlock);
+    qemu_coroutine_yield();
+
+    qemu_co_rwlock_unlock(&rwlock);
+
+    /* All readers own the lock before any of them has run */
+    g_assert_cmpint(rwlock.owners, ==, NUM_BATCHED_READERS);
+    *(bool *)opaque = true;
+}
+
+static void coroutine_fn rwlock_rdlock_count(void *opaque)
+{
+    int *readers = opaque;
+
+    qemu_co_rwlock_rdlock(&rwlock);
+    (*readers)++;
+    qemu_coroutine_yield();
+
+    qemu_co_rwlock_unlock(&rwlock);
+}
+
+static void test_co_rwlock_reader_batch(void)
+{
+    Coroutine *readers[NUM_BATCHED_READERS];
+    Coroutine *w1, *w2;
+    bool w1_done = false;
+    bool w2_done = false;
+    int n_readers = 0;
+    int i;
+
+    qemu_co_rwlock_init(&rwlock);
+
+    w1 = qemu_coroutine_create(rwlock_wrlock_unlock_batch, &w1_done);
+    w2 = qemu_coroutine_create(rwlock_wrlock, &w2_done);
+    for (i = 0; i < NUM_BATCHED_READERS; i++) {
+        readers[i] = qemu_coroutine_create(rwlock_rdlock_count, &n_readers);
+    }
+
+    qemu_coroutine_enter(w1);
+    for (i = 0; i < NUM_BATCHED_READERS; i++) {
+        qemu_coroutine_enter(readers[i]);
+    }
+    qemu_coroutine_enter(w2);
+    g_assert_cmpint(n_readers, ==, 0);
+
+    qemu_coroutine_enter(w1);
+    g_assert(w1_done);
+    g_assert_cmpint(n_readers, ==, NUM_BATCHED_READERS);
+    g_assert(!w2_done);
+
+    for (i = 0; i < NUM_BATCHED_READERS; i++) {
+        qemu_coroutine_enter(readers[i]);
+    }
+    g_assert(w2_done);
+}
+
 /*
  * Check that creation, enter, and return work
  */
@@ -451,6 +530,42 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that coroutines with small stacks are never recycled for the default
+ * class, by using more stack than COROUTINE_STACK_SMALL provides.
+ */
+static void coroutine_fn use_big_stack(void *opaque)
+{
+    volatile char buf[256 * 1024]; /* do not let the compiler drop it */
+    bool *done = opaque;
+
+    memset((char *)buf, 0, sizeof(buf));
+    *done = buf[sizeof(buf) - 1] == 0;
+}
+
+static void test_stack_classes(void)
+{
+    Coroutine *coroutines[256];
+    bool done;
+    int i;
+
+    /* Fill the pool with small stacks */
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        coroutines[i] = qemu_coroutine_create_with_stack(set_and_exit, &done,
+                                                         COROUTINE_STACK_SMALL);
+    }
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        done = false;
+        qemu_coroutine_enter(coroutines[i]);
+        g_assert(done);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        done = false;
+        qemu_coroutine_enter(qemu_coroutine_create(use_big_stack, &done));
+        g_assert(done);
+    }
+}
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -652,6 +767,7 @@ int main(int argc, char **argv)
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/stack-classes", test_stack_classes);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
@@ -662,6 +778,8 @@ int main(int argc, char **argv)
     g_test_add_func("/locking/co-mutex/lockable", test_co_mutex_lockable);
     g_test_add_func("/locking/co-rwlock/upgrade", test_co_rwlock_upgrade);
     g_test_add_func("/locking/co-rwlock/downgrade", test_co_rwlock_downgrade);
+    g_test_add_func("/locking/co-rwlock/reader-batch",
+                    test_co_rwlock_reader_batch);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
+#include "qemu/units.h"
 #include "block/block.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -1042,6 +1043,167 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+/*
+ * Page-sized regions in the last level are stored specially when they are
+ * all clear or all set; exercise the transitions around page boundaries.
+ */
+static void test_hbitmap_sparse_pages(TestHBitmapData *data,
+                                      const void *unused)
+{
+    hbitmap_test_init(data, L3 * 2, 0);
+    hbitmap_test_set(data, 0, L3 * 2);
+    hbitmap_test_reset(data, L2, L3);
+    hbitmap_test_set(data, L3 / 2 - 1, 2);
+    hbitmap_test_reset(data, L3 - L1, L1 * 2);
+    hbitmap_test_set(data, L2, L3);
+    hbitmap_test_reset(data, 1, L3 * 2 - 2);
+    hbitmap_test_check_get(data);
+    hbitmap_test_truncate_impl(data, L3 + 7);
+    hbitmap_test_set(data, L3, 7);
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_sparse_memory(TestHBitmapData *data,
+                                       const void *unused)
+{
+    uint64_t size = 1ULL << 30;
+    uint64_t empty, usage;
+    HBitmap *hb;
+
+    data->hb = hbitmap_alloc(size, 0);
+    empty = hbitmap_memory_usage(data->hb);
+    g_assert_cmpint(empty, <, size / BITS_PER_BYTE / 16);
+
+    hbitmap_set(data->hb, 0, size);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, size);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty);
+
+    hbitmap_reset(data->hb, size / 2, 1);
+    usage = hbitmap_memory_usage(data->hb);
+    g_assert_cmpint(usage, >, empty);
+    g_assert_cmpint(usage, <, empty + 64 * KiB);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, size), ==, size / 2);
+    g_assert_cmpint(hbitmap_next_dirty(data->hb, size / 2, size), ==,
+                    size / 2 + 1);
+
+    hbitmap_set(data->hb, size / 2, 1);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, size), ==, -1);
+
+    hbitmap_reset_all(data->hb);
+    hb = hbitmap_alloc(size, 0);
+    hbitmap_set(hb, 12345, 1);
+    hbitmap_set(hb, size - 1, 1);
+    hbitmap_merge(data->hb, hb, data->hb);
+    hbitmap_free(hb);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 2);
+    g_assert_cmpint(hbitmap_next_dirty(data->hb, 0, size), ==, 12345);
+    g_assert_cmpint(hbitmap_next_dirty(data->hb, 12346, size), ==, size - 1);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), <, empty + 64 * KiB);
+}
+
+static void test_hbitmap_meta(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *meta;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, L2, L2);
+    meta = hbitmap_create_meta(data->hb, L1);
+    g_assert_cmpint(hbitmap_count(meta), ==, 0);
+
+    /* No change, nothing is marked */
+    hbitmap_test_set(data, L2, L1);
+    hbitmap_test_reset(data, 0, L1);
+    g_assert_cmpint(hbitmap_count(meta), ==, 0);
+
+    /* A partial word is enough to mark the chunk */
+    hbitmap_test_reset(data, L2 + 3, 1);
+    g_assert(hbitmap_get(meta, L2));
+    g_assert_cmpint(hbitmap_count(meta), ==, L1);
+    hbitmap_test_set(data, L2 * 3 + 5, 2);
+    g_assert(hbitmap_get(meta, L2 * 3));
+    g_assert_cmpint(hbitmap_count(meta), ==, 2 * L1);
+
+    hbitmap_reset_all(meta);
+    hbitmap_test_reset_all(data);
+    g_assert_cmpint(hbitmap_count(meta), ==, L3);
+
+    hbitmap_free_meta(data->hb);
+}
+
+/* 64 TiB at 64 KiB granularity, the case that motivated sparse pages */
+#define PERF_HBITMAP_SIZE (1ULL << 30)
+
+static void perf_hbitmap_sparse_set(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_HBITMAP_SIZE, 0);
+    unsigned int i, max = 1000000;
+    uint64_t usage;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        uint64_t pos = g_test_rand_int_range(0, INT32_MAX) %
+                       PERF_HBITMAP_SIZE;
+
+        hbitmap_set(hb, pos, 1);
+        hbitmap_reset(hb, pos, 1);
+    }
+    duration = g_test_timer_elapsed();
+    usage = hbitmap_memory_usage(hb);
+
+    g_test_message("Set/reset %u random bits: %f s, %" PRIu64 " KiB",
+                   max, duration, usage / KiB);
+    hbitmap_free(hb);
+}
+
+static void perf_hbitmap_next_dirty_area(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_HBITMAP_SIZE, 0);
+    unsigned int i, max = 10000;
+    int64_t offset, count, total = 0;
+    uint64_t usage;
+    double duration;
+
+    /* Some dirty runs in an otherwise clean bitmap */
+    for (i = 0; i < max; i++) {
+        hbitmap_set(hb, (PERF_HBITMAP_SIZE / max) * i, 1024);
+    }
+    usage = hbitmap_memory_usage(hb);
+
+    g_test_timer_start();
+    for (offset = 0;
+         hbitmap_next_dirty_area(hb, offset, PERF_HBITMAP_SIZE, INT64_MAX,
+                                 &offset, &count);
+         offset += count)
+    {
+        total += count;
+    }
+    duration = g_test_timer_elapsed();
+    g_assert_cmpint(total, ==, (int64_t)max * 1024);
+
+    g_test_message("Walk %u dirty areas: %f s, %" PRIu64 " KiB",
+                   max, duration, usage / KiB);
+    hbitmap_free(hb);
+}
+
+static void perf_hbitmap_set_reset_all(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_HBITMAP_SIZE, 0);
+    unsigned int i, max = 100;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        hbitmap_set(hb, 0, PERF_HBITMAP_SIZE);
+        hbitmap_reset(hb, 0, PERF_HBITMAP_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Set/reset all %u times: %f s", max, duration);
+    hbitmap_free(hb);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1275,18 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/sparse/pages", test_hbitmap_sparse_pages);
+    hbitmap_test_add("/hbitmap/sparse/memory", test_hbitmap_sparse_memory);
+    hbitmap_test_add("/hbitmap/meta", test_hbitmap_meta);
+
+    if (g_test_perf()) {
+        g_test_add_func("/hbitmap/perf/sparse-set", perf_hbitmap_sparse_set);
+        g_test_add_func("/hbitmap/perf/next-dirty-area",
+                        perf_hbitmap_next_dirty_area);
+        g_test_add_func("/hbitmap/perf/set-reset-all",
+                        perf_hbitmap_set_reset_all);
+    }
+
     g_test_run();
 
     return 0;
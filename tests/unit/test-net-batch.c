@@ -0,0 +1,169 @@
+/*
+ * Unit tests for qemu_send_batch_begin() and qemu_send_batch_end()
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/net.h"
+
+/*
+ * A receiver that completes packets like virtio-net does: while its peer
+ * is sending a batch, the notification of its consumer waits for the end
+ * of the batch.
+ */
+typedef struct TestReceiver {
+    NetClientState nc;
+    unsigned int packets;
+    unsigned int notifications;
+    unsigned int batch_ends;
+    bool notify_pending;
+} TestReceiver;
+
+static void test_receiver_batch_end(NetClientState *nc)
+{
+    TestReceiver *r = container_of(nc, TestReceiver, nc);
+
+    r->batch_ends++;
+    if (r->notify_pending) {
+        r->notify_pending = false;
+        r->notifications++;
+    }
+}
+
+static NetClientInfo test_receiver_info = {
+    .type = NET_CLIENT_DRIVER_NIC,
+    .size = sizeof(TestReceiver),
+    .receive_batch_end = test_receiver_batch_end,
+};
+
+static NetClientInfo test_sender_info = {
+    .type = NET_CLIENT_DRIVER_NIC,
+    .size = sizeof(NetClientState),
+};
+
+static void test_receive(TestReceiver *r)
+{
+    r->packets++;
+    if (r->nc.peer && r->nc.peer->sending_batch) {
+        r->notify_pending = true;
+    } else {
+        r->notifications++;
+    }
+}
+
+static void test_pair_init(NetClientState *sender, TestReceiver *r)
+{
+    memset(sender, 0, sizeof(*sender));
+    memset(r, 0, sizeof(*r));
+    sender->info = &test_sender_info;
+    r->nc.info = &test_receiver_info;
+    sender->peer = &r->nc;
+    r->nc.peer = sender;
+}
+
+static void test_batch_single(void)
+{
+    NetClientState sender;
+    TestReceiver r;
+    int i;
+
+    test_pair_init(&sender, &r);
+
+    qemu_send_batch_begin(&sender);
+    g_assert_cmpuint(sender.sending_batch, ==, 1);
+    for (i = 0; i < 8; i++) {
+        test_receive(&r);
+    }
+    g_assert_cmpuint(r.notifications, ==, 0);
+    qemu_send_batch_end(&sender);
+
+    g_assert_cmpuint(sender.sending_batch, ==, 0);
+    g_assert_cmpuint(r.packets, ==, 8);
+    g_assert_cmpuint(r.batch_ends, ==, 1);
+    g_assert_cmpuint(r.notifications, ==, 1);
+
+    /* Outside of a batch, each packet is notified on its own */
+    test_receive(&r);
+    test_receive(&r);
+    g_assert_cmpuint(r.notifications, ==, 3);
+    g_assert_cmpuint(r.batch_ends, ==, 1);
+}
+
+static void test_batch_nested(void)
+{
+    NetClientState sender;
+    TestReceiver r;
+
+    test_pair_init(&sender, &r);
+
+    qemu_send_batch_begin(&sender);
+    test_receive(&r);
+
+    qemu_send_batch_begin(&sender);
+    g_assert_cmpuint(sender.sending_batch, ==, 2);
+    test_receive(&r);
+    qemu_send_batch_end(&sender);
+
+    /* The inner end is not seen by the receiver */
+    g_assert_cmpuint(sender.sending_batch, ==, 1);
+    g_assert_cmpuint(r.batch_ends, ==, 0);
+    g_assert_cmpuint(r.notifications, ==, 0);
+
+    test_receive(&r);
+    qemu_send_batch_end(&sender);
+
+    g_assert_cmpuint(sender.sending_batch, ==, 0);
+    g_assert_cmpuint(r.packets, ==, 3);
+    g_assert_cmpuint(r.batch_ends, ==, 1);
+    g_assert_cmpuint(r.notifications, ==, 1);
+}
+
+static void test_batch_empty(void)
+{
+    NetClientState sender;
+    TestReceiver r;
+
+    test_pair_init(&sender, &r);
+
+    /* The receiver is told, but has nothing to notify */
+    qemu_send_batch_begin(&sender);
+    qemu_send_batch_end(&sender);
+    g_assert_cmpuint(r.batch_ends, ==, 1);
+    g_assert_cmpuint(r.notifications, ==, 0);
+}
+
+static void test_batch_no_peer(void)
+{
+    NetClientState sender;
+    TestReceiver r;
+
+    test_pair_init(&sender, &r);
+    sender.peer = NULL;
+
+    qemu_send_batch_begin(&sender);
+    qemu_send_batch_end(&sender);
+    g_assert_cmpuint(sender.sending_batch, ==, 0);
+    g_assert_cmpuint(r.batch_ends, ==, 0);
+
+    /* A peer without receive_batch_end is fine too */
+    sender.peer = &r.nc;
+    r.nc.info = &test_sender_info;
+    qemu_send_batch_begin(&sender);
+    qemu_send_batch_end(&sender);
+    g_assert_cmpuint(sender.sending_batch, ==, 0);
+    g_assert_cmpuint(r.batch_ends, ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/net/batch/single", test_batch_single);
+    g_test_add_func("/net/batch/nested", test_batch_nested);
+    g_test_add_func("/net/batch/empty", test_batch_empty);
+    g_test_add_func("/net/batch/no-peer", test_batch_no_peer);
+
+    return g_test_run();
+}
@@ -0,0 +1,210 @@
+/*
+ * Unit tests for the network checksum and hash helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+/* The byte-pair loop that net_checksum_add_cont() used to be */
+static uint32_t checksum_ref(int len, const uint8_t *buf, int seq)
+{
+    uint32_t sum1 = 0, sum2 = 0;
+    int i;
+
+    for (i = 0; i < len - 1; i += 2) {
+        sum1 += buf[i];
+        sum2 += buf[i + 1];
+    }
+    if (i < len) {
+        sum1 += buf[i];
+    }
+    return (seq & 1) ? sum1 + (sum2 << 8) : sum2 + (sum1 << 8);
+}
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int_range(0, 256);
+    }
+}
+
+static void test_checksum_add(void)
+{
+    g_autofree uint8_t *buf = g_malloc(65536 + 8);
+
+    do {
+        int i;
+
+        for (i = 0; i < 2000; i++) {
+            int len = g_test_rand_int_range(0, i < 50 ? 65536 : 512);
+            int off = g_test_rand_int_range(0, 8);
+            int seq = g_test_rand_int_range(0, 4);
+            uint32_t sum;
+
+            /* All-ones data exercises the end-around carry */
+            if (i % 5 == 0) {
+                memset(buf + off, i % 10 ? 0xff : 0, len);
+            } else {
+                fill_random(buf + off, len);
+            }
+
+            sum = net_checksum_add_cont(len, buf + off, seq);
+            g_assert_cmphex(sum, <=, 0xffff);
+            g_assert_cmphex(net_checksum_finish(sum), ==,
+                            net_checksum_finish(checksum_ref(len, buf + off,
+                                                             seq)));
+        }
+    } while (test_net_checksum_next_accel());
+}
+
+static void test_checksum_add_iov(void)
+{
+    g_autofree uint8_t *buf = g_malloc(4096);
+    struct iovec iov[8];
+    int i, j;
+
+    do {
+        for (i = 0; i < 200; i++) {
+            size_t len = 0, off, size;
+
+            /* Chunks of odd and even lengths, so that seq matters */
+            for (j = 0; j < ARRAY_SIZE(iov); j++) {
+                iov[j].iov_base = buf + len;
+                iov[j].iov_len = g_test_rand_int_range(0, 512);
+                len += iov[j].iov_len;
+            }
+            fill_random(buf, len);
+            off = len ? g_test_rand_int_range(0, len) : 0;
+            size = len - off;
+
+            g_assert_cmphex(net_checksum_finish(
+                                net_checksum_add_iov(iov, ARRAY_SIZE(iov),
+                                                     off, size, 0)), ==,
+                            net_checksum_finish(checksum_ref(size, buf + off,
+                                                             0)));
+        }
+    } while (test_net_checksum_next_accel());
+}
+
+/* Key and inputs of the Microsoft RSS verification suite */
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct {
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    size_t len;
+    uint32_t hash;
+} ToeplitzTestCase;
+
+static const ToeplitzTestCase toeplitz_cases[] = {
+    {
+        /* 66.9.149.187:2794 -> 161.142.100.80:1766 */
+        .input = { 66, 9, 149, 187, 161, 142, 100, 80 },
+        .len = 8,
+        .hash = 0x323e8fc2,
+    }, {
+        .input = { 66, 9, 149, 187, 161, 142, 100, 80,
+                   0x0a, 0xea, 0x06, 0xe6 },
+        .len = 12,
+        .hash = 0x51ccc178,
+    }, {
+        /* [3ffe:2501:200:1fff::7]:2794 -> [3ffe:2501:200:3::1]:1766 */
+        .input = { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+                   0, 0, 0, 0, 0, 0, 0, 0x07,
+                   0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+                   0, 0, 0, 0, 0, 0, 0, 0x01 },
+        .len = 32,
+        .hash = 0x2cc18cd5,
+    }, {
+        .input = { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+                   0, 0, 0, 0, 0, 0, 0, 0x07,
+                   0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+                   0, 0, 0, 0, 0, 0, 0, 0x01,
+                   0x0a, 0xea, 0x06, 0xe6 },
+        .len = 36,
+        .hash = 0x40207d3d,
+    },
+};
+
+static uint32_t toeplitz_scalar(const uint8_t *input, size_t len)
+{
+    net_toeplitz_key key;
+    uint32_t hash = 0;
+
+    net_toeplitz_key_init(&key, (uint8_t *)rss_key);
+    net_toeplitz_add(&hash, (uint8_t *)input, len, &key);
+    return hash;
+}
+
+static void test_toeplitz_vectors(void)
+{
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    int i;
+
+    net_toeplitz_table_init(table, rss_key, sizeof(rss_key));
+    for (i = 0; i < ARRAY_SIZE(toeplitz_cases); i++) {
+        const ToeplitzTestCase *tc = &toeplitz_cases[i];
+
+        g_assert_cmphex(toeplitz_scalar(tc->input, tc->len), ==, tc->hash);
+        g_assert_cmphex(net_toeplitz_table_hash(table, tc->input, tc->len),
+                        ==, tc->hash);
+    }
+}
+
+static void test_toeplitz_random(void)
+{
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    int i, j;
+
+    net_toeplitz_table_init(table, rss_key, sizeof(rss_key));
+    for (i = 0; i < 1000; i++) {
+        size_t len = g_test_rand_int_range(0, NET_TOEPLITZ_MAX_INPUT + 1);
+
+        for (j = 0; j < len; j++) {
+            input[j] = g_test_rand_int_range(0, 256);
+        }
+        g_assert_cmphex(net_toeplitz_table_hash(table, input, len), ==,
+                        toeplitz_scalar(input, len));
+    }
+}
+
+static void test_toeplitz_short_key(void)
+{
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t key[40] = { 0 };
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    net_toeplitz_key key_data;
+    uint32_t hash = 0;
+
+    /* Key bytes that are not given must behave as zeroes */
+    memcpy(key, rss_key, 16);
+    memset(input, 0xa5, sizeof(input));
+    net_toeplitz_table_init(table, rss_key, 16);
+    net_toeplitz_key_init(&key_data, key);
+    net_toeplitz_add(&hash, input, sizeof(input), &key_data);
+    g_assert_cmphex(net_toeplitz_table_hash(table, input, sizeof(input)), ==,
+                    hash);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/add", test_checksum_add);
+    g_test_add_func("/net/checksum/add-iov", test_checksum_add_iov);
+    g_test_add_func("/net/toeplitz/vectors", test_toeplitz_vectors);
+    g_test_add_func("/net/toeplitz/random", test_toeplitz_random);
+    g_test_add_func("/net/toeplitz/short-key", test_toeplitz_short_key);
+    return g_test_run();
+}
@@ -231,6 +231,179 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+/* A pool of its own, with at most @max workers */
+static ThreadPool *thread_pool_new_max(int max)
+{
+    ThreadPool *p;
+
+    aio_context_set_thread_pool_params(ctx, 0, max, &error_abort);
+    p = thread_pool_new(ctx);
+    aio_context_set_thread_pool_params(ctx, 0, THREAD_POOL_MAX_THREADS_DEFAULT,
+                                       &error_abort);
+    return p;
+}
+
+#define ORDER_REQS 1000
+
+static int order_seq;
+
+static int order_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+
+    data->n = qatomic_fetch_inc(&order_seq);
+    return 0;
+}
+
+/*
+ * Requests are pushed onto a LIFO list without the lock, while the worker
+ * keeps taking them off; a single worker must still run them in order.
+ */
+static void test_submit_order(void)
+{
+    ThreadPool *p = thread_pool_new_max(1);
+    WorkerTestData data[ORDER_REQS];
+    uint64_t latency[THREAD_POOL_LATENCY_BUCKETS];
+    uint64_t completed = 0;
+    int i;
+
+    order_seq = 0;
+    for (i = 0; i < ORDER_REQS; i++) {
+        data[i].n = -1;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(p, order_cb, &data[i], done_cb, &data[i]);
+    }
+
+    active = ORDER_REQS;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < ORDER_REQS; i++) {
+        g_assert_cmpint(data[i].n, ==, i);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    thread_pool_get_latency(p, latency);
+    for (i = 0; i < THREAD_POOL_LATENCY_BUCKETS; i++) {
+        completed += latency[i];
+    }
+    g_assert_cmpint(completed, ==, ORDER_REQS);
+
+    thread_pool_free(p);
+}
+
+#define CONCURRENT_SUBMITTERS 8
+#define CONCURRENT_REQS 200
+
+static ThreadPool *concurrent_pool;
+static int concurrent_done;
+
+static void co_submitter(void *opaque)
+{
+    WorkerTestData *data = opaque;
+    int i;
+
+    for (i = 0; i < CONCURRENT_REQS; i++) {
+        g_assert_cmpint(thread_pool_submit_co(concurrent_pool, worker_cb,
+                                              &data[i]), ==, 0);
+    }
+    concurrent_done++;
+}
+
+/*
+ * Several submitters keep requests in flight at the same time, so that
+ * submissions race with workers of a small pool draining the queue.
+ */
+static void test_submit_concurrent(void)
+{
+    WorkerTestData data[CONCURRENT_SUBMITTERS][CONCURRENT_REQS] = { 0 };
+    int i, j;
+
+    concurrent_pool = thread_pool_new_max(4);
+    concurrent_done = 0;
+    for (i = 0; i < CONCURRENT_SUBMITTERS; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(co_submitter, data[i]));
+    }
+    while (concurrent_done < CONCURRENT_SUBMITTERS) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < CONCURRENT_SUBMITTERS; i++) {
+        for (j = 0; j < CONCURRENT_REQS; j++) {
+            g_assert_cmpint(data[i][j].n, ==, 1);
+        }
+    }
+
+    thread_pool_free(concurrent_pool);
+}
+
+#define QUEUED_REQS 10
+
+static QemuEvent unblock_event;
+static int blocker_running;
+
+static int blocking_cb(void *opaque)
+{
+    qatomic_set(&blocker_running, 1);
+    qemu_event_wait(&unblock_event);
+    return 0;
+}
+
+/*
+ * A request canceled while it is queued completes only once a worker
+ * dequeues it, with -ECANCELED and without running.
+ */
+static void test_cancel_queued(void)
+{
+    ThreadPool *p = thread_pool_new_max(1);
+    WorkerTestData blocker = { .n = 0, .ret = -EINPROGRESS };
+    WorkerTestData data[QUEUED_REQS];
+    int i;
+
+    qemu_event_init(&unblock_event, false);
+    blocker_running = 0;
+
+    /* Keep the only worker busy */
+    thread_pool_submit_aio(p, blocking_cb, &blocker, done_cb, &blocker);
+    active = 1;
+    while (!qatomic_read(&blocker_running)) {
+        aio_poll(ctx, false);
+        g_usleep(1000);
+    }
+
+    for (i = 0; i < QUEUED_REQS; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        data[i].aiocb = thread_pool_submit_aio(p, worker_cb, &data[i],
+                                               done_cb, &data[i]);
+        active++;
+    }
+    for (i = 0; i < QUEUED_REQS; i++) {
+        bdrv_aio_cancel_async(data[i].aiocb);
+    }
+
+    /* Nothing completes while the worker is busy */
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    g_assert_cmpint(active, ==, 1 + QUEUED_REQS);
+    for (i = 0; i < QUEUED_REQS; i++) {
+        g_assert_cmpint(data[i].ret, ==, -EINPROGRESS);
+    }
+
+    qemu_event_set(&unblock_event);
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(blocker.ret, ==, 0);
+    for (i = 0; i < QUEUED_REQS; i++) {
+        g_assert_cmpint(data[i].n, ==, 0);
+        g_assert_cmpint(data[i].ret, ==, -ECANCELED);
+    }
+
+    thread_pool_free(p);
+    qemu_event_destroy(&unblock_event);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_abort);
@@ -244,6 +417,9 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/submit-order", test_submit_order);
+    g_test_add_func("/thread-pool/submit-concurrent", test_submit_concurrent);
+    g_test_add_func("/thread-pool/cancel-queued", test_cancel_queued);
 
     return g_test_run();
 }
@@ -22,6 +22,7 @@
 #include "qemu/module.h"
 #include "block/throttle-groups.h"
 #include "sysemu/block-backend.h"
+#include "iothread.h"
 
 static AioContext     *ctx;
 static LeakyBucket    bkt;
@@ -738,6 +739,129 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+static void coroutine_fn throttle_read_entry(void *opaque)
+{
+    throttle_group_co_io_limits_intercept(opaque, 512, false);
+}
+
+static void do_throttle_read(ThrottleGroupMember *member)
+{
+    Coroutine *co = qemu_coroutine_create(throttle_read_entry, member);
+    qemu_coroutine_enter(co);
+}
+
+static double get_ops_level(ThrottleGroupMember *member)
+{
+    ThrottleConfig config;
+
+    throttle_group_get_config(member, &config);
+    return config.buckets[THROTTLE_OPS_TOTAL].level;
+}
+
+static void test_groups_credit(void)
+{
+    ThrottleGroupMember tgm1 = {}, tgm2 = {};
+    ThrottleConfig config;
+
+    throttle_group_register_tgm(&tgm1, "credit", ctx);
+    throttle_group_register_tgm(&tgm2, "credit", ctx);
+
+    /* 1000 ops/s split between two members: 5 operations every 10 ms */
+    throttle_config_init(&config);
+    config.buckets[THROTTLE_OPS_TOTAL].avg = 1000;
+    throttle_group_config(&tgm1, &config);
+
+    /* The first request takes the slow path and gets a budget for later */
+    do_throttle_read(&tgm1);
+    g_assert(double_cmp(tgm1.credit[0].units, 5));
+    g_assert(double_cmp(get_ops_level(&tgm1), 1 + 5));
+
+    /* Changing the configuration invalidates it */
+    throttle_group_config(&tgm2, &config);
+    g_assert(double_cmp(get_ops_level(&tgm1), 0));
+    do_throttle_read(&tgm1);
+    g_assert(double_cmp(get_ops_level(&tgm1), 1 + 5));
+
+    /* The unused budget is given back when the member leaves the group */
+    throttle_group_unregister_tgm(&tgm1);
+    g_assert(double_cmp(get_ops_level(&tgm2), 1));
+
+    throttle_group_unregister_tgm(&tgm2);
+}
+
+#define PERF_IOTHREADS 8
+#define PERF_MEMBERS   32
+#define PERF_REQUESTS  100000
+
+typedef struct {
+    ThrottleGroupMember tgm;
+    QemuSemaphore *done;
+} PerfMember;
+
+static void coroutine_fn perf_groups_entry(void *opaque)
+{
+    PerfMember *member = opaque;
+    int i;
+
+    for (i = 0; i < PERF_REQUESTS; i++) {
+        throttle_group_co_io_limits_intercept(&member->tgm, 4096, i & 1);
+    }
+    qemu_sem_post(member->done);
+}
+
+static void perf_groups(void)
+{
+    IOThread *iothreads[PERF_IOTHREADS];
+    PerfMember members[PERF_MEMBERS] = {};
+    ThrottleConfig config;
+    QemuSemaphore done;
+    double duration;
+    int i;
+
+    qemu_sem_init(&done, 0);
+    for (i = 0; i < PERF_IOTHREADS; i++) {
+        iothreads[i] = iothread_new();
+    }
+    for (i = 0; i < PERF_MEMBERS; i++) {
+        IOThread *iothread = iothreads[i % PERF_IOTHREADS];
+        members[i].done = &done;
+        throttle_group_register_tgm(&members[i].tgm, "perf",
+                                    iothread_get_aio_context(iothread));
+    }
+
+    /* High enough that no request ever has to wait */
+    throttle_config_init(&config);
+    config.buckets[THROTTLE_OPS_TOTAL].avg = THROTTLE_VALUE_MAX;
+    config.buckets[THROTTLE_BPS_TOTAL].avg = THROTTLE_VALUE_MAX;
+    throttle_group_config(&members[0].tgm, &config);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_MEMBERS; i++) {
+        Coroutine *co = qemu_coroutine_create(perf_groups_entry, &members[i]);
+        aio_co_enter(members[i].tgm.aio_context, co);
+    }
+    for (i = 0; i < PERF_MEMBERS; i++) {
+        qemu_sem_wait(&done);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d members on %d iothreads: %d requests in %f s, "
+                   "%f Mreq/s", PERF_MEMBERS, PERF_IOTHREADS,
+                   PERF_MEMBERS * PERF_REQUESTS, duration,
+                   PERF_MEMBERS * PERF_REQUESTS / duration / 1000000);
+
+    for (i = 0; i < PERF_MEMBERS; i++) {
+        AioContext *aio = members[i].tgm.aio_context;
+        aio_context_acquire(aio);
+        throttle_group_unregister_tgm(&members[i].tgm);
+        aio_context_release(aio);
+    }
+    for (i = 0; i < PERF_IOTHREADS; i++) {
+        iothread_join(iothreads[i]);
+    }
+    qemu_sem_destroy(&done);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -765,6 +889,10 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/credit",      test_groups_credit);
+    if (g_test_perf()) {
+        g_test_add_func("/throttle/perf/groups",    perf_groups);
+    }
     return g_test_run();
 }
 
@@ -27,6 +27,9 @@
 /* Stop userspace polling on a handler if it isn't active for some time */
 #define POLL_IDLE_INTERVAL_NS (7 * NANOSECONDS_PER_SECOND)
 
+/* Period over which ctx->poll_cpu_budget is enforced */
+#define POLL_BUDGET_PERIOD_NS (100 * SCALE_MS)
+
 bool aio_poll_disabled(AioContext *ctx)
 {
     return qatomic_read(&ctx->poll_disable_cnt);
@@ -322,10 +325,25 @@ static void aio_free_deleted_handlers(AioContext *ctx)
     qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
 }
 
+static AioCallbackStats *aio_handler_stats(AioContext *ctx, AioHandler *node)
+{
+    if (!node->stats) {
+        const void *func = node->io_read ? (void *)node->io_read :
+                           node->io_write ? (void *)node->io_write :
+                           (void *)node->io_poll_ready;
+
+        node->stats = aio_callback_stats_get(ctx, AIO_CALLBACK_FD, func,
+                                             NULL, node->pfd.fd);
+    }
+    return node->stats;
+}
+
 static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
 {
     bool progress = false;
     bool poll_ready;
+    AioCallbackStats *stats = NULL;
+    int64_t start = 0;
     int revents;
 
     revents = node->pfd.revents & node->pfd.events;
@@ -349,11 +367,27 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         }
         QLIST_INSERT_HEAD(&ctx->poll_aio_handlers, node, node_poll);
     }
+    /* Track the arrival rate of events for adaptive polling */
+    if (ctx->poll_cpu_budget && node->io_poll && (poll_ready || revents)) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        if (node->poll_last_event) {
+            int64_t sample = now - node->poll_last_event;
+
+            node->poll_interval = node->poll_interval ?
+                (node->poll_interval * 7 + sample) / 8 : sample;
+        }
+        node->poll_last_event = now;
+    }
+
     if (!QLIST_IS_INSERTED(node, node_deleted) &&
         poll_ready && revents == 0 &&
         aio_node_check(ctx, node->is_external) &&
         node->io_poll_ready) {
+        stats = aio_handler_stats(ctx, node);
+        start = aio_callback_stats_start(stats);
         node->io_poll_ready(node->opaque);
+        aio_callback_stats_add(stats, start);
 
         /*
          * Return early since revents was zero. aio_notify() does not count as
@@ -366,6 +400,8 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
         node->io_read) {
+        stats = aio_handler_stats(ctx, node);
+        start = aio_callback_stats_start(stats);
         node->io_read(node->opaque);
 
         /* aio_notify() does not count as progress */
@@ -377,10 +413,17 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         (revents & (G_IO_OUT | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
         node->io_write) {
+        if (!stats) {
+            stats = aio_handler_stats(ctx, node);
+            start = aio_callback_stats_start(stats);
+        }
         node->io_write(node->opaque);
         progress = true;
     }
 
+    if (stats) {
+        aio_callback_stats_add(stats, start);
+    }
     return progress;
 }
 
@@ -547,6 +590,10 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    ctx->poll_budget_used += elapsed_time;
+    stat64_add(&ctx->poll_time_ns, elapsed_time);
+    stat64_add(progress ? &ctx->poll_hits : &ctx->poll_misses, 1);
+
     if (remove_idle_poll_handlers(ctx, ready_list,
                                   start_time + elapsed_time)) {
         *timeout = 0;
@@ -564,6 +611,64 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
     return progress;
 }
 
+/*
+ * adjust_poll_window:
+ * @ctx: the AioContext
+ * @now: the current time
+ *
+ * Pick the polling time for adaptive polling.  Each polled handler predicts
+ * its next event from the average time between its past events; poll until
+ * the earliest prediction, unless it is further away than ctx->poll_max_ns,
+ * and never use more than ctx->poll_cpu_budget percent of the time.
+ *
+ * Note that the caller must have incremented ctx->list_lock.
+ */
+static void adjust_poll_window(AioContext *ctx, int64_t now)
+{
+    AioHandler *node;
+    int64_t old = ctx->poll_ns;
+    int64_t window = 0;
+    int64_t budget;
+
+    if (now - ctx->poll_budget_start >= POLL_BUDGET_PERIOD_NS) {
+        ctx->poll_budget_start = now;
+        ctx->poll_budget_used = 0;
+    }
+    budget = POLL_BUDGET_PERIOD_NS / 100 * ctx->poll_cpu_budget -
+             ctx->poll_budget_used;
+
+    if (budget > 0) {
+        window = INT64_MAX;
+        QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+            int64_t next;
+
+            if (!node->poll_interval) {
+                continue;
+            }
+
+            /* Ignore handlers that went quiet */
+            next = node->poll_last_event + node->poll_interval - now;
+            if (next < -node->poll_interval) {
+                continue;
+            }
+
+            /* Leave some slack for jitter */
+            next = MAX(next, 0) + node->poll_interval / 4;
+            window = MIN(window, next);
+        }
+
+        if (window > ctx->poll_max_ns) {
+            window = 0;
+        }
+        window = MIN(window, budget);
+    }
+
+    ctx->poll_ns = window;
+    if (window != old) {
+        trace_poll_window(ctx, old, window, budget);
+    }
+}
+
 /* try_poll_mode:
  * @ctx: the AioContext
  * @ready_list: list to add handlers that need to be run
@@ -624,6 +729,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     if (ctx->poll_max_ns) {
         start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_cpu_budget) {
+            adjust_poll_window(ctx, start);
+        }
     }
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
@@ -669,7 +777,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     aio_notify_accept(ctx);
 
     /* Adjust polling time */
-    if (ctx->poll_max_ns) {
+    if (ctx->poll_max_ns && !ctx->poll_cpu_budget) {
         int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
 
         if (block_ns <= ctx->poll_ns) {
@@ -754,7 +862,8 @@ void aio_context_use_g_source(AioContext *ctx)
 }
 
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
-                                 int64_t grow, int64_t shrink, Error **errp)
+                                 int64_t grow, int64_t shrink,
+                                 int64_t cpu_budget, Error **errp)
 {
     /* No thread synchronization here, it doesn't matter if an incorrect value
      * is used once.
@@ -763,6 +872,9 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     ctx->poll_ns = 0;
     ctx->poll_grow = grow;
     ctx->poll_shrink = shrink;
+    ctx->poll_cpu_budget = cpu_budget;
+    ctx->poll_budget_start = 0;
+    ctx->poll_budget_used = 0;
 
     aio_notify(ctx);
 }
@@ -37,6 +37,9 @@ struct AioHandler {
     unsigned flags; /* see fdmon-io_uring.c */
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_last_event; /* when the last event happened */
+    int64_t poll_interval; /* moving average of the time between events */
+    AioCallbackStats *stats; /* looked up on the first dispatch */
     bool poll_ready; /* has polling detected an event? */
     bool is_external;
 };
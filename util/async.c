@@ -30,6 +30,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/xxhash.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine_int.h"
 #include "qemu/coroutine-tls.h"
@@ -64,6 +65,7 @@ struct QEMUBH {
     void *opaque;
     QSLIST_ENTRY(QEMUBH) next;
     unsigned flags;
+    AioCallbackStats *stats;
 };
 
 /* Called concurrently from any thread */
@@ -147,7 +149,16 @@ QEMUBH *aio_bh_new_full(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
 
 void aio_bh_call(QEMUBH *bh)
 {
+    int64_t start;
+
+    if (!bh->stats) {
+        bh->stats = aio_callback_stats_get(bh->ctx, AIO_CALLBACK_BH, bh->cb,
+                                           bh->name, -1);
+    }
+
+    start = aio_callback_stats_start(bh->stats);
     bh->cb(bh->opaque);
+    aio_callback_stats_add(bh->stats, start);
 }
 
 /* Multiple occurrences of aio_bh_poll cannot be called concurrently. */
@@ -321,6 +332,84 @@ aio_ctx_dispatch(GSource     *source,
     return true;
 }
 
+static bool aio_callback_stats_cmp(const void *a, const void *b)
+{
+    const AioCallbackStats *sa = a;
+    const AioCallbackStats *sb = b;
+
+    return sa->kind == sb->kind && sa->func == sb->func &&
+        sa->fd == sb->fd && !g_strcmp0(sa->name, sb->name);
+}
+
+/* Bottom halves with the same callback but different names collide */
+static uint32_t aio_callback_stats_hash(AioCallbackKind kind, const void *func,
+                                        int fd)
+{
+    return qemu_xxhash4((uintptr_t)func, (uint64_t)(uint32_t)fd << 2 | kind);
+}
+
+/*
+ * Entries are never removed until the AioContext is destroyed, and the
+ * table is never resized, so lookups do not need RCU.
+ */
+AioCallbackStats *aio_callback_stats_get(AioContext *ctx,
+                                         AioCallbackKind kind,
+                                         const void *func, const char *name,
+                                         int fd)
+{
+    AioCallbackStats key = {
+        .kind = kind,
+        .func = func,
+        .name = name,
+        .fd = fd,
+    };
+    uint32_t hash = aio_callback_stats_hash(kind, func, fd);
+    AioCallbackStats *stats;
+    void *existing = NULL;
+
+    stats = qht_lookup(&ctx->callback_stats, &key, hash);
+    if (stats) {
+        return stats;
+    }
+
+    stats = g_new(AioCallbackStats, 1);
+    *stats = key;
+    if (!qht_insert(&ctx->callback_stats, stats, hash, &existing)) {
+        g_free(stats);
+        stats = existing;
+    }
+    return stats;
+}
+
+typedef struct AioCallbackStatsIter {
+    AioCallbackStatsFunc *func;
+    void *opaque;
+} AioCallbackStatsIter;
+
+static void aio_callback_stats_iter(void *p, uint32_t h, void *up)
+{
+    AioCallbackStatsIter *iter = up;
+
+    iter->func(p, iter->opaque);
+}
+
+void aio_context_foreach_callback_stats(AioContext *ctx,
+                                        AioCallbackStatsFunc *func,
+                                        void *opaque)
+{
+    AioCallbackStatsIter iter = {
+        .func = func,
+        .opaque = opaque,
+    };
+
+    qht_iter(&ctx->callback_stats, aio_callback_stats_iter, &iter);
+}
+
+static void aio_callback_stats_free(void *p, uint32_t h, void *up)
+{
+    g_free(p);
+}
+
 static void
 aio_ctx_finalize(GSource     *source)
 {
@@ -349,6 +438,9 @@ aio_ctx_finalize(GSource     *source)
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
+    qht_iter(&ctx->callback_stats, aio_callback_stats_free, NULL);
+    qht_destroy(&ctx->callback_stats);
+
     /* There must be no aio_bh_poll() calls going on */
     assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
 
@@ -535,6 +627,8 @@ AioContext *aio_context_new(Error **errp)
     QSLIST_INIT(&ctx->bh_list);
     QSIMPLEQ_INIT(&ctx->bh_slice_list);
     aio_context_setup(ctx);
+    qht_init(&ctx->callback_stats, aio_callback_stats_cmp, 64,
+             QHT_MODE_RAW_MUTEXES);
 
     ret = event_notifier_init(&ctx->notifier, false);
     if (ret < 0) {
@@ -568,6 +662,7 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_max_ns = 0;
     ctx->poll_grow = 0;
     ctx->poll_shrink = 0;
+    ctx->poll_cpu_budget = 0;
 
     ctx->aio_max_batch = 0;
 
@@ -272,36 +272,20 @@ static void init_accel(unsigned cache)
 
 static void __attribute__((constructor)) init_cpuid_cache(void)
 {
-    unsigned max = __get_cpuid_max(0, NULL);
-    int a, b, c, d;
+    unsigned features = cpuid_host_features();
     unsigned cache = 0;
 
-    if (max >= 1) {
-        __cpuid(1, a, b, c, d);
-        if (d & bit_SSE2) {
-            cache |= CACHE_SSE2;
-        }
-        if (c & bit_SSE4_1) {
-            cache |= CACHE_SSE4;
-        }
-
-        /* We must check that AVX is not just available, but usable.  */
-        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
-            int bv;
-            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
-            __cpuid_count(7, 0, a, b, c, d);
-            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
-                cache |= CACHE_AVX2;
-            }
-            /* 0xe6:
-            *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
-            *                    and ZMM16-ZMM31 state are enabled by OS)
-            *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
-            */
-            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
-                cache |= CACHE_AVX512F;
-            }
-        }
+    if (features & CPUID_HOST_SSE2) {
+        cache |= CACHE_SSE2;
+    }
+    if (features & CPUID_HOST_SSE4_1) {
+        cache |= CACHE_SSE4;
+    }
+    if (features & CPUID_HOST_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    if (features & CPUID_HOST_AVX512F) {
+        cache |= CACHE_AVX512F;
     }
     cpuid_cache = cache;
     init_accel(cache);
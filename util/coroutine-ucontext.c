@@ -179,7 +179,7 @@ static void coroutine_trampoline(int i0, int i1)
     }
 }
 
-Coroutine *qemu_coroutine_new(void)
+Coroutine *qemu_coroutine_new(size_t stack_size)
 {
     CoroutineUContext *co;
     ucontext_t old_uc, uc;
@@ -200,10 +200,10 @@ Coroutine *qemu_coroutine_new(void)
     }
 
     co = g_malloc0(sizeof(*co));
-    co->stack_size = COROUTINE_STACK_SIZE;
+    co->stack_size = stack_size;
     co->stack = qemu_alloc_stack(&co->stack_size);
 #ifdef CONFIG_SAFESTACK
-    co->unsafe_stack_size = COROUTINE_STACK_SIZE;
+    co->unsafe_stack_size = stack_size;
     co->unsafe_stack = qemu_alloc_stack(&co->unsafe_stack_size);
 #endif
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
@@ -284,6 +284,15 @@ void qemu_coroutine_delete(Coroutine *co_)
     g_free(co);
 }
 
+#ifdef CONFIG_DEBUG_STACK_USAGE
+size_t qemu_coroutine_stack_usage(Coroutine *co_)
+{
+    CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
+
+    return qemu_stack_usage(co->stack, co->stack_size);
+}
+#endif
+
 /* This function is marked noinline to prevent GCC from inlining it
  * into coroutine_trampoline(). If we allow it to do that then it
  * hoists the code to get the address of the TLS variable "current"
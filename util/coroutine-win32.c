@@ -69,9 +69,8 @@ static void CALLBACK coroutine_trampoline(void *co_)
     }
 }
 
-Coroutine *qemu_coroutine_new(void)
+Coroutine *qemu_coroutine_new(size_t stack_size)
 {
-    const size_t stack_size = COROUTINE_STACK_SIZE;
     CoroutineWin32 *co;
 
     co = g_malloc0(sizeof(*co));
@@ -87,6 +86,14 @@ void qemu_coroutine_delete(Coroutine *co_)
     g_free(co);
 }
 
+#ifdef CONFIG_DEBUG_STACK_USAGE
+size_t qemu_coroutine_stack_usage(Coroutine *co_)
+{
+    /* Fiber stacks are not filled with a pattern, nothing to measure */
+    return 0;
+}
+#endif
+
 Coroutine *qemu_coroutine_self(void)
 {
     Coroutine *current = get_current();
@@ -50,8 +50,26 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level holds almost all of the memory, so it is not stored as a
+ * flat array.  Instead it is split into pages of HB_PAGE_WORDS words; pages
+ * that are entirely clear or entirely set all point to a shared read-only
+ * page, and only pages that mix set and clear bits are allocated.  A mostly
+ * clean (or mostly dirty) bitmap thus costs little more than its upper
+ * levels, i.e. about 1/BITS_PER_LONG of the flat representation.  Each
+ * page keeps a count of its set bits, which tells when to switch between
+ * the shared and the allocated representation.
  */
 
+#define HB_PAGE_SHIFT 9
+#define HB_PAGE_WORDS (1 << HB_PAGE_SHIFT)
+#define HB_PAGE_BITS  (HB_PAGE_WORDS * BITS_PER_LONG)
+
+static const unsigned long hb_zero_page[HB_PAGE_WORDS];
+static const unsigned long hb_full_page[HB_PAGE_WORDS] = {
+    [0 ... HB_PAGE_WORDS - 1] = ~0UL
+};
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -93,14 +111,140 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays.  The last level is
+     * stored in @pages instead, so levels[HBITMAP_LEVELS - 1] is NULL.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /*
+     * Pages of the last level, either allocated or hb_zero_page/hb_full_page
+     * (see above), and the number of set bits in each of them.
+     */
+    unsigned long **pages;
+    uint32_t *page_count;
+    uint64_t nr_pages;
 };
 
+static inline bool hb_page_is_shared(const unsigned long *page)
+{
+    return page == hb_zero_page || page == hb_full_page;
+}
+
+/* Read word @pos of level @level.  */
+static inline unsigned long hb_word(const HBitmap *hb, int level, size_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb->pages[pos >> HB_PAGE_SHIFT][pos & (HB_PAGE_WORDS - 1)];
+    }
+    return hb->levels[level][pos];
+}
+
+/*
+ * Make page @p of the last level all clear (@page == hb_zero_page) or all
+ * set (@page == hb_full_page), releasing its memory.
+ */
+static void hb_share_page(HBitmap *hb, size_t p, const unsigned long *page)
+{
+    assert(hb_page_is_shared(page));
+    if (!hb_page_is_shared(hb->pages[p])) {
+        g_free(hb->pages[p]);
+    }
+    hb->pages[p] = (unsigned long *)page;
+    hb->page_count[p] = page == hb_full_page ? HB_PAGE_BITS : 0;
+}
+
+static void hb_store_last(HBitmap *hb, size_t pos, unsigned long val)
+{
+    size_t p = pos >> HB_PAGE_SHIFT;
+    unsigned long *page = hb->pages[p];
+    unsigned long old = page[pos & (HB_PAGE_WORDS - 1)];
+
+    if (old == val) {
+        return;
+    }
+
+    if (hb_page_is_shared(page)) {
+        page = g_new(unsigned long, HB_PAGE_WORDS);
+        memcpy(page, hb->pages[p], HB_PAGE_WORDS * sizeof(unsigned long));
+        hb->pages[p] = page;
+    }
+    page[pos & (HB_PAGE_WORDS - 1)] = val;
+
+    hb->page_count[p] -= ctpopl(old);
+    hb->page_count[p] += ctpopl(val);
+    if (hb->page_count[p] == 0) {
+        hb_share_page(hb, p, hb_zero_page);
+    } else if (hb->page_count[p] == HB_PAGE_BITS) {
+        hb_share_page(hb, p, hb_full_page);
+    }
+}
+
+/* Write word @pos of level @level.  */
+static inline void hb_store(HBitmap *hb, int level, size_t pos,
+                            unsigned long val)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        hb_store_last(hb, pos, val);
+    } else {
+        hb->levels[level][pos] = val;
+    }
+}
+
+/*
+ * Fill a whole page of the last level with ones (@set) or zeroes.
+ * Returns true if any word of the page goes from zero to nonzero (@set) or
+ * from nonzero to zero (!@set).
+ */
+static bool hb_fill_page(HBitmap *hb, size_t p, bool set)
+{
+    bool changed = false;
+    size_t i;
+
+    if (!set) {
+        changed = hb->page_count[p] != 0;
+    } else if (hb->pages[p] == hb_zero_page) {
+        changed = true;
+    } else if (hb->pages[p] != hb_full_page) {
+        for (i = 0; i < HB_PAGE_WORDS; i++) {
+            changed |= hb->pages[p][i] == 0;
+        }
+    }
+
+    hb_share_page(hb, p, set ? hb_full_page : hb_zero_page);
+    return changed;
+}
+
+/*
+ * Whether the words [@pos, @lastpos) of the last level cover the page
+ * starting at @pos.
+ */
+static inline bool hb_covers_page(size_t pos, size_t lastpos)
+{
+    return !(pos & (HB_PAGE_WORDS - 1)) && lastpos - pos >= HB_PAGE_WORDS;
+}
+
+/* Resize the last level to @size words.  */
+static void hb_resize_pages(HBitmap *hb, uint64_t size)
+{
+    uint64_t nr_pages = DIV_ROUND_UP(size, HB_PAGE_WORDS);
+    uint64_t p;
+
+    for (p = nr_pages; p < hb->nr_pages; p++) {
+        hb_share_page(hb, p, hb_zero_page);
+    }
+
+    hb->pages = g_renew(unsigned long *, hb->pages, nr_pages);
+    hb->page_count = g_renew(uint32_t, hb->page_count, nr_pages);
+    for (p = hb->nr_pages; p < nr_pages; p++) {
+        hb->pages[p] = (unsigned long *)hb_zero_page;
+        hb->page_count[p] = 0;
+    }
+    hb->nr_pages = nr_pages;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +280,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +293,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +326,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +364,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +375,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -247,13 +391,19 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+            /* Skip whole pages that are known to be full */
+            while (pos < sz && !(pos & (HB_PAGE_WORDS - 1)) &&
+                   hb->pages[pos >> HB_PAGE_SHIFT] == hb_full_page) {
+                pos += HB_PAGE_WORDS;
+            }
+        } while (pos < sz &&
+                 hb_word(hb, HBITMAP_LEVELS - 1, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -411,7 +561,8 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
-static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_set_elem(HBitmap *hb, int level, size_t pos,
+                               uint64_t start, uint64_t last)
 {
     unsigned long mask;
     unsigned long old;
@@ -421,9 +572,9 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    old = *elem;
-    *elem |= mask;
-    return old != *elem;
+    old = hb_word(hb, level, pos);
+    hb_store(hb, level, pos, old | mask);
+    return old != (old | mask);
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
@@ -439,18 +590,19 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
+        changed |= hb_set_elem(hb, level, i, start, next - 1);
+        for (i++; i < lastpos; i++) {
+            if (level == HBITMAP_LEVELS - 1 && hb_covers_page(i, lastpos)) {
+                changed |= hb_fill_page(hb, i >> HB_PAGE_SHIFT, true);
+                i += HB_PAGE_WORDS - 1;
+                continue;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            changed |= (hb_word(hb, level, i) == 0);
+            hb_store(hb, level, i, ~0UL);
         }
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb, level, i, start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -479,9 +631,11 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
     n = last - first + 1;
 
-    hb->count += n - hb_count_between(hb, first, last);
-    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
+    /* Only the number of newly set bits tells reliably whether any changed */
+    n -= hb_count_between(hb, first, last);
+    hb->count += n;
+    hb_set_between(hb, HBITMAP_LEVELS - 1, first, last);
+    if (n && hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
 }
@@ -489,9 +643,11 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
-static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_reset_elem(HBitmap *hb, int level, size_t pos,
+                                 uint64_t start, uint64_t last)
 {
     unsigned long mask;
+    unsigned long old;
     bool blanked;
 
     assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
@@ -499,8 +655,9 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    blanked = *elem != 0 && ((*elem & ~mask) == 0);
-    *elem &= ~mask;
+    old = hb_word(hb, level, pos);
+    blanked = old != 0 && ((old & ~mask) == 0);
+    hb_store(hb, level, pos, old & ~mask);
     return blanked;
 }
 
@@ -523,25 +680,26 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb, level, i, start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
+        for (i++; i < lastpos; i++) {
+            if (level == HBITMAP_LEVELS - 1 && hb_covers_page(i, lastpos)) {
+                changed |= hb_fill_page(hb, i >> HB_PAGE_SHIFT, false);
+                i += HB_PAGE_WORDS - 1;
+                continue;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            changed |= (hb_word(hb, level, i) != 0);
+            hb_store(hb, level, i, 0UL);
         }
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb, level, i, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -558,7 +716,7 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
-    uint64_t first;
+    uint64_t first, cleared;
     uint64_t last = start + count - 1;
     uint64_t gran = 1ULL << hb->granularity;
 
@@ -576,9 +734,10 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     last >>= hb->granularity;
     assert(last < hb->size);
 
-    hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
+    cleared = hb_count_between(hb, first, last);
+    hb->count -= cleared;
+    hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last);
+    if (cleared && hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
 }
@@ -586,9 +745,17 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
+    uint64_t p;
+
+    if (hb->meta && hb->count) {
+        hbitmap_set(hb->meta, 0, hb->orig_size);
+    }
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (p = 0; p < hb->nr_pages; p++) {
+        hb_share_page(hb, p, hb_zero_page);
+    }
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -621,7 +788,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +805,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,7 +819,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -660,7 +827,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -674,7 +841,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -683,8 +850,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, cur);
+
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
@@ -697,7 +865,8 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
+    unsigned long el;
 
     if (!count) {
         return;
@@ -706,17 +875,21 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
         }
+        hb_store_last(hb, cur, el);
 
         buf += sizeof(unsigned long);
         cur++;
     }
+    if (hb->meta) {
+        hbitmap_set(hb->meta, start, count);
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -726,14 +899,19 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        hb_store_last(hb, i, 0UL);
+    }
+    if (hb->meta) {
+        hbitmap_set(hb->meta, start, count);
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -743,14 +921,19 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        hb_store_last(hb, i, ~0UL);
+    }
+    if (hb->meta) {
+        hbitmap_set(hb->meta, start, count);
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -770,7 +953,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -785,12 +968,50 @@ void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
     assert(!hb->meta);
+    hb_resize_pages(hb, 0);
+    g_free(hb->pages);
+    g_free(hb->page_count);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
 }
 
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size)
+{
+    assert(!(chunk_size & (chunk_size - 1)));
+    assert(!hb->meta);
+    hb->meta = hbitmap_alloc(hb->size << hb->granularity,
+                             hb->granularity + ctz32(chunk_size));
+    return hb->meta;
+}
+
+void hbitmap_free_meta(HBitmap *hb)
+{
+    assert(hb->meta);
+    hbitmap_free(hb->meta);
+    hb->meta = NULL;
+}
+
+uint64_t hbitmap_memory_usage(const HBitmap *hb)
+{
+    uint64_t usage = sizeof(*hb);
+    uint64_t p;
+    unsigned i;
+
+    for (i = 0; i < HBITMAP_LEVELS - 1; i++) {
+        usage += hb->sizes[i] * sizeof(unsigned long);
+    }
+    usage += hb->nr_pages * (sizeof(*hb->pages) + sizeof(*hb->page_count));
+    for (p = 0; p < hb->nr_pages; p++) {
+        if (!hb_page_is_shared(hb->pages[p])) {
+            usage += HB_PAGE_WORDS * sizeof(unsigned long);
+        }
+    }
+
+    return usage;
+}
+
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
@@ -808,7 +1029,11 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_pages(hb, size);
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -862,6 +1087,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_pages(hb, size);
+            continue;
+        }
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -892,6 +1121,49 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* result = a | b for page @p of the last level */
+static void hbitmap_merge_page(const HBitmap *a, const HBitmap *b,
+                               HBitmap *result, uint64_t p)
+{
+    const unsigned long *src = NULL;
+    uint64_t pos = p << HB_PAGE_SHIFT;
+    uint64_t i;
+
+    if (a->pages[p] == hb_full_page || b->pages[p] == hb_full_page) {
+        hb_share_page(result, p, hb_full_page);
+        return;
+    }
+
+    if (a->pages[p] == hb_zero_page) {
+        src = b->pages[p];
+    } else if (b->pages[p] == hb_zero_page) {
+        src = a->pages[p];
+    }
+
+    if (src) {
+        if (src == result->pages[p]) {
+            return;
+        }
+        if (hb_page_is_shared(src)) {
+            hb_share_page(result, p, src);
+            return;
+        }
+        if (hb_page_is_shared(result->pages[p])) {
+            result->pages[p] = g_new(unsigned long, HB_PAGE_WORDS);
+        }
+        memcpy(result->pages[p], src, HB_PAGE_WORDS * sizeof(unsigned long));
+        result->page_count[p] = src == a->pages[p] ? a->page_count[p] :
+                                                     b->page_count[p];
+        return;
+    }
+
+    /* Both pages are allocated; @result may alias @a or @b */
+    for (i = pos; i < pos + HB_PAGE_WORDS; i++) {
+        hb_store_last(result, i, hb_word(a, HBITMAP_LEVELS - 1, i) |
+                                 hb_word(b, HBITMAP_LEVELS - 1, i));
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -902,6 +1174,7 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
     uint64_t j;
+    uint64_t old_count;
 
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
@@ -934,22 +1207,40 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (j = 0; j < a->nr_pages; j++) {
+        hbitmap_merge_page(a, b, result, j);
+    }
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
     /* Recompute the dirty count */
+    old_count = result->count;
     result->count = hb_count_between(result, 0, result->size - 1);
+
+    /* Not worth tracking precisely; merging into a tracked bitmap is rare */
+    if (result->meta && result->count != old_count) {
+        hbitmap_set(result->meta, 0, result->orig_size);
+    }
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
+    g_autofree struct iovec *iov = g_new(struct iovec, bitmap->nr_pages);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t p;
+
+    /* Hash the same bytes as the flat last level would contain */
+    for (p = 0; p < bitmap->nr_pages; p++) {
+        iov[p].iov_base = bitmap->pages[p];
+        iov[p].iov_len = MIN(size, HB_PAGE_WORDS * sizeof(unsigned long));
+        size -= iov[p].iov_len;
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, bitmap->nr_pages,
+                         &hash, errp);
 
     return hash;
 }
@@ -692,12 +692,9 @@ void *qemu_alloc_stack(size_t *sz)
 
 #ifdef CONFIG_DEBUG_STACK_USAGE
 static __thread unsigned int max_stack_usage;
-#endif
 
-void qemu_free_stack(void *stack, size_t sz)
+size_t qemu_stack_usage(void *stack, size_t sz)
 {
-#ifdef CONFIG_DEBUG_STACK_USAGE
-    unsigned int usage;
     void *ptr;
 
     for (ptr = stack + qemu_real_host_page_size(); ptr < stack + sz;
@@ -706,7 +703,15 @@ void qemu_free_stack(void *stack, size_t sz)
             break;
         }
     }
-    usage = sz - (uintptr_t) (ptr - stack);
+    return sz - (uintptr_t) (ptr - stack);
+}
+#endif
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+#ifdef CONFIG_DEBUG_STACK_USAGE
+    unsigned int usage = qemu_stack_usage(stack, sz);
+
     if (usage > max_stack_usage) {
         error_report("thread %d max stack usage increased from %u to %u",
                      qemu_get_thread_id(), max_stack_usage, usage);
@@ -88,3 +88,11 @@ void coroutine_fn co_put_to_shres(SharedResource *s, uint64_t n)
     s->available += n;
     qemu_co_queue_restart_all(&s->queue);
 }
+
+void shres_put(SharedResource *s, uint64_t n)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+    assert(qemu_co_queue_empty(&s->queue));
+    assert(s->total - s->available >= n);
+    s->available += n;
+}
@@ -31,6 +31,8 @@
 #include "qemu/coroutine_int.h"
 #include "qemu/processor.h"
 #include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "block/aio.h"
 #include "trace.h"
 
@@ -223,11 +225,20 @@ static void coroutine_fn qemu_co_mutex_lock_slowpath(AioContext *ctx,
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
 
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
+/*
+ * Upper bound on the spinning done by qemu_co_mutex_lock().  The actual
+ * limit adapts to how long it took to get the lock in the past, so that
+ * a mutex whose holder rarely releases it quickly does not waste CPU.
+ */
+#define CO_MUTEX_MAX_SPIN 1000
+
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line)
 {
     AioContext *ctx = qemu_get_current_aio_context();
     Coroutine *self = qemu_coroutine_self();
-    int waiters, i;
+    int64_t t0 = qsp_is_enabled() ? get_clock() : 0;
+    int waiters, i, spin_limit;
 
     /* Running a very small critical section on pthread_mutex_t and CoMutex
      * shows that pthread_mutex_t is much faster because it doesn't actually
@@ -235,12 +246,17 @@ void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
      * than the latency of entering the kernel and thus FUTEX_WAIT always
      * fails.  With CoMutex there is no such latency but you still want to
      * avoid wait and wakeup.  So introduce it artificially.
+     *
+     * The number of iterations is bounded by twice the average needed
+     * in the past, similar to glibc's adaptive mutexes.
      */
     i = 0;
+    spin_limit = MIN(2 * qatomic_read(&mutex->spin_avg) + 10,
+                     CO_MUTEX_MAX_SPIN);
 retry_fast_path:
     waiters = qatomic_cmpxchg(&mutex->locked, 0, 1);
     if (waiters != 0) {
-        while (waiters == 1 && ++i < 1000) {
+        while (waiters == 1 && ++i < spin_limit) {
             if (qatomic_read(&mutex->ctx) == ctx) {
                 break;
             }
@@ -252,6 +268,11 @@ retry_fast_path:
         waiters = qatomic_fetch_inc(&mutex->locked);
     }
 
+    if (i) {
+        int avg = qatomic_read(&mutex->spin_avg);
+        qatomic_set(&mutex->spin_avg, avg + (i - avg) / 8);
+    }
+
     if (waiters == 0) {
         /* Uncontended.  */
         trace_qemu_co_mutex_lock_uncontended(mutex, self);
@@ -261,6 +282,10 @@ retry_fast_path:
     }
     mutex->holder = self;
     self->locks_held++;
+
+    if (t0) {
+        qsp_co_mutex_record(mutex, file, line, get_clock() - t0);
+    }
 }
 
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
@@ -331,11 +356,15 @@ void qemu_co_rwlock_init(CoRwlock *lock)
     QSIMPLEQ_INIT(&lock->tickets);
 }
 
-/* Releases the internal CoMutex.  */
+/*
+ * Releases the internal CoMutex.  If the first ticket is a reader, all
+ * the readers at the head of the queue are admitted at once, instead of
+ * each of them waking up the next one after it has run.
+ */
 static void qemu_co_rwlock_maybe_wake_one(CoRwlock *lock)
 {
+    QSIMPLEQ_HEAD(, CoRwTicket) wake = QSIMPLEQ_HEAD_INITIALIZER(wake);
     CoRwTicket *tkt = QSIMPLEQ_FIRST(&lock->tickets);
-    Coroutine *co = NULL;
 
     /*
      * Setting lock->owners here prevents rdlock and wrlock from
@@ -344,30 +373,39 @@ static void qemu_co_rwlock_maybe_wake_one(CoRwlock *lock)
 
     if (tkt) {
         if (tkt->read) {
-            if (lock->owners >= 0) {
+            while (lock->owners >= 0 && tkt && tkt->read) {
                 lock->owners++;
-                co = tkt->co;
+                QSIMPLEQ_REMOVE_HEAD(&lock->tickets, next);
+                QSIMPLEQ_INSERT_TAIL(&wake, tkt, next);
+                tkt = QSIMPLEQ_FIRST(&lock->tickets);
             }
         } else {
             if (lock->owners == 0) {
                 lock->owners = -1;
-                co = tkt->co;
+                QSIMPLEQ_REMOVE_HEAD(&lock->tickets, next);
+                QSIMPLEQ_INSERT_TAIL(&wake, tkt, next);
             }
         }
     }
 
-    if (co) {
-        QSIMPLEQ_REMOVE_HEAD(&lock->tickets, next);
-        qemu_co_mutex_unlock(&lock->mutex);
+    qemu_co_mutex_unlock(&lock->mutex);
+
+    /*
+     * The tickets live on the stack of the coroutines being woken, so
+     * do not touch a ticket after waking its owner.
+     */
+    while ((tkt = QSIMPLEQ_FIRST(&wake))) {
+        Coroutine *co = tkt->co;
+
+        QSIMPLEQ_REMOVE_HEAD(&wake, next);
         aio_co_wake(co);
-    } else {
-        qemu_co_mutex_unlock(&lock->mutex);
     }
 }
 
-void qemu_co_rwlock_rdlock(CoRwlock *lock)
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
+    int64_t t0 = qsp_is_enabled() ? get_clock() : 0;
 
     qemu_co_mutex_lock(&lock->mutex);
     /* For fairness, wait if a writer is in line.  */
@@ -381,13 +419,13 @@ void qemu_co_rwlock_rdlock(CoRwlock *lock)
         qemu_co_mutex_unlock(&lock->mutex);
         qemu_coroutine_yield();
         assert(lock->owners >= 1);
-
-        /* Possibly wake another reader, which will wake the next in line.  */
-        qemu_co_mutex_lock(&lock->mutex);
-        qemu_co_rwlock_maybe_wake_one(lock);
     }
 
     self->locks_held++;
+
+    if (t0) {
+        qsp_co_rwlock_record(lock, file, line, get_clock() - t0);
+    }
 }
 
 void qemu_co_rwlock_unlock(CoRwlock *lock)
@@ -414,13 +452,14 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock)
     assert(lock->owners == -1);
     lock->owners = 1;
 
-    /* Possibly wake another reader, which will wake the next in line.  */
+    /* Possibly wake the readers that are waiting in line.  */
     qemu_co_rwlock_maybe_wake_one(lock);
 }
 
-void qemu_co_rwlock_wrlock(CoRwlock *lock)
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
+    int64_t t0 = qsp_is_enabled() ? get_clock() : 0;
 
     qemu_co_mutex_lock(&lock->mutex);
     if (lock->owners == 0) {
@@ -436,6 +475,10 @@ void qemu_co_rwlock_wrlock(CoRwlock *lock)
     }
 
     self->locks_held++;
+
+    if (t0) {
+        qsp_co_rwlock_record(lock, file, line, get_clock() - t0);
+    }
 }
 
 void qemu_co_rwlock_upgrade(CoRwlock *lock)
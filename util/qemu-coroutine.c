@@ -19,6 +19,7 @@
 #include "qemu/coroutine.h"
 #include "qemu/coroutine_int.h"
 #include "qemu/coroutine-tls.h"
+#include "qemu/error-report.h"
 #include "block/aio.h"
 
 /**
@@ -26,68 +27,171 @@
  * reused as soon as there are 64 coroutines in it. The maximum pool size starts
  * with 64 and is increased on demand so that coroutines are not deleted even if
  * they are not immediately reused.
+ *
+ * Coroutines that stay in a thread's alloc_pool for a whole trim interval are
+ * deleted, so that the pool follows the high-water mark of recent usage
+ * instead of keeping the stacks of a past burst forever.
  */
 enum {
     POOL_MIN_BATCH_SIZE = 64,
     POOL_INITIAL_MAX_SIZE = 64,
+    POOL_TRIM_CHECK_PERIOD = 64, /* in deletions, to avoid reading the clock */
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_max_size = POOL_INITIAL_MAX_SIZE;
-static unsigned int release_pool_size;
+#define POOL_TRIM_INTERVAL_NS (10 * NANOSECONDS_PER_SECOND)
+
+static const size_t coroutine_stack_sizes[COROUTINE_STACK__MAX] = {
+    [COROUTINE_STACK_DEFAULT] = COROUTINE_STACK_SIZE,
+    [COROUTINE_STACK_SMALL] = COROUTINE_SMALL_STACK_SIZE,
+};
 
 typedef QSLIST_HEAD(, Coroutine) CoroutineQSList;
-QEMU_DEFINE_STATIC_CO_TLS(CoroutineQSList, alloc_pool);
-QEMU_DEFINE_STATIC_CO_TLS(unsigned int, alloc_pool_size);
+
+/** Free lists to speed up creation, one per stack size class */
+static CoroutineQSList release_pool[COROUTINE_STACK__MAX];
+static unsigned int pool_max_size = POOL_INITIAL_MAX_SIZE;
+static unsigned int release_pool_size[COROUTINE_STACK__MAX];
+
+typedef struct {
+    CoroutineQSList list;
+    unsigned int size;
+    unsigned int low_water; /* smallest size since the last trim */
+} CoroutinePool;
+
+typedef struct {
+    CoroutinePool pools[COROUTINE_STACK__MAX];
+    unsigned int deletions;
+    int64_t next_trim;
+} CoroutineAllocPools;
+
+QEMU_DEFINE_STATIC_CO_TLS(CoroutineAllocPools, alloc_pools);
 QEMU_DEFINE_STATIC_CO_TLS(Notifier, coroutine_pool_cleanup_notifier);
 
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
     Coroutine *tmp;
-    CoroutineQSList *alloc_pool = get_ptr_alloc_pool();
+    CoroutineAllocPools *alloc_pools = get_ptr_alloc_pools();
+    int i;
+
+    for (i = 0; i < COROUTINE_STACK__MAX; i++) {
+        CoroutinePool *pool = &alloc_pools->pools[i];
 
-    QSLIST_FOREACH_SAFE(co, alloc_pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(alloc_pool, pool_next);
-        qemu_coroutine_delete(co);
+        QSLIST_FOREACH_SAFE(co, &pool->list, pool_next, tmp) {
+            QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+            qemu_coroutine_delete(co);
+        }
+        pool->size = 0;
     }
 }
 
-Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
+static void coroutine_pool_register_cleanup(void)
+{
+    Notifier *notifier = get_ptr_coroutine_pool_cleanup_notifier();
+
+    if (!notifier->notify) {
+        notifier->notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(notifier);
+    }
+}
+
+/*
+ * Delete the coroutines that were not needed during the last trim interval,
+ * keeping at least one batch around.
+ */
+static void coroutine_pool_trim(CoroutineAllocPools *alloc_pools)
+{
+    int64_t now = get_clock();
+    int i;
+
+    if (now < alloc_pools->next_trim) {
+        return;
+    }
+    alloc_pools->next_trim = now + POOL_TRIM_INTERVAL_NS;
+
+    for (i = 0; i < COROUTINE_STACK__MAX; i++) {
+        CoroutinePool *pool = &alloc_pools->pools[i];
+        unsigned int excess = 0;
+
+        if (pool->size > POOL_MIN_BATCH_SIZE) {
+            excess = MIN(pool->low_water, pool->size - POOL_MIN_BATCH_SIZE);
+        }
+
+        trace_qemu_coroutine_pool_trim(i, pool->size, excess);
+        while (excess--) {
+            Coroutine *co = QSLIST_FIRST(&pool->list);
+
+            QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+            pool->size--;
+            qemu_coroutine_delete(co);
+        }
+        pool->low_water = pool->size;
+    }
+}
+
+#ifdef CONFIG_DEBUG_STACK_USAGE
+static size_t max_stack_usage[COROUTINE_STACK__MAX];
+
+/*
+ * Stacks are filled with a pattern when they are allocated, and coroutines
+ * are recycled through the pool, so this is the high-water mark of all
+ * coroutines that ran on this stack so far.
+ */
+static void coroutine_update_stack_usage(Coroutine *co)
+{
+    size_t usage = qemu_coroutine_stack_usage(co);
+    size_t old = qatomic_read(&max_stack_usage[co->stack_class]);
+
+    while (usage > old) {
+        size_t seen = qatomic_cmpxchg(&max_stack_usage[co->stack_class],
+                                      old, usage);
+        if (seen == old) {
+            error_report("coroutine stack class %d: max stack usage increased "
+                         "from %zu to %zu (of %zu)", co->stack_class, old,
+                         usage, coroutine_stack_sizes[co->stack_class]);
+            break;
+        }
+        old = seen;
+    }
+}
+#endif
+
+Coroutine *qemu_coroutine_create_with_stack(CoroutineEntry *entry,
+                                            void *opaque,
+                                            CoroutineStackClass stack_class)
 {
     Coroutine *co = NULL;
 
+    assert(stack_class < COROUTINE_STACK__MAX);
+
     if (CONFIG_COROUTINE_POOL) {
-        CoroutineQSList *alloc_pool = get_ptr_alloc_pool();
+        CoroutinePool *pool = &get_ptr_alloc_pools()->pools[stack_class];
 
-        co = QSLIST_FIRST(alloc_pool);
+        co = QSLIST_FIRST(&pool->list);
         if (!co) {
-            if (release_pool_size > POOL_MIN_BATCH_SIZE) {
+            if (release_pool_size[stack_class] > POOL_MIN_BATCH_SIZE) {
                 /* Slow path; a good place to register the destructor, too.  */
-                Notifier *notifier = get_ptr_coroutine_pool_cleanup_notifier();
-                if (!notifier->notify) {
-                    notifier->notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(notifier);
-                }
+                coroutine_pool_register_cleanup();
 
                 /* This is not exact; there could be a little skew between
                  * release_pool_size and the actual size of release_pool.  But
                  * it is just a heuristic, it does not need to be perfect.
                  */
-                set_alloc_pool_size(qatomic_xchg(&release_pool_size, 0));
-                QSLIST_MOVE_ATOMIC(alloc_pool, &release_pool);
-                co = QSLIST_FIRST(alloc_pool);
+                pool->size = qatomic_xchg(&release_pool_size[stack_class], 0);
+                QSLIST_MOVE_ATOMIC(&pool->list, &release_pool[stack_class]);
+                co = QSLIST_FIRST(&pool->list);
             }
         }
         if (co) {
-            QSLIST_REMOVE_HEAD(alloc_pool, pool_next);
-            set_alloc_pool_size(get_alloc_pool_size() - 1);
+            QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+            pool->size--;
+            pool->low_water = MIN(pool->low_water, pool->size);
         }
     }
 
     if (!co) {
-        co = qemu_coroutine_new();
+        co = qemu_coroutine_new(coroutine_stack_sizes[stack_class]);
+        co->stack_class = stack_class;
     }
 
     co->entry = entry;
@@ -96,19 +200,43 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
     return co;
 }
 
+Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
+{
+    return qemu_coroutine_create_with_stack(entry, opaque,
+                                            COROUTINE_STACK_DEFAULT);
+}
+
 static void coroutine_delete(Coroutine *co)
 {
+    CoroutineStackClass stack_class = co->stack_class;
+
     co->caller = NULL;
 
+#ifdef CONFIG_DEBUG_STACK_USAGE
+    coroutine_update_stack_usage(co);
+#endif
+
     if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < qatomic_read(&pool_max_size) * 2) {
-            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
-            qatomic_inc(&release_pool_size);
+        CoroutineAllocPools *alloc_pools;
+        CoroutinePool *pool;
+
+        if (release_pool_size[stack_class] < qatomic_read(&pool_max_size) * 2) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool[stack_class], co,
+                                      pool_next);
+            qatomic_inc(&release_pool_size[stack_class]);
             return;
         }
-        if (get_alloc_pool_size() < qatomic_read(&pool_max_size)) {
-            QSLIST_INSERT_HEAD(get_ptr_alloc_pool(), co, pool_next);
-            set_alloc_pool_size(get_alloc_pool_size() + 1);
+
+        alloc_pools = get_ptr_alloc_pools();
+        pool = &alloc_pools->pools[stack_class];
+        if (pool->size < qatomic_read(&pool_max_size)) {
+            QSLIST_INSERT_HEAD(&pool->list, co, pool_next);
+            pool->size++;
+
+            if (++alloc_pools->deletions % POOL_TRIM_CHECK_PERIOD == 0) {
+                coroutine_pool_register_cleanup();
+                coroutine_pool_trim(alloc_pools);
+            }
             return;
         }
     }
@@ -61,12 +61,19 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
  * reenabling the clock can call all the notifiers.
+ *
+ * The active timers are kept in a pairing heap ordered by expire_time,
+ * and by the order in which they were armed for timers that expire at
+ * the same time.  active_timers is the root of the heap, i.e. the timer
+ * that expires first.  Inserting a timer and looking at the first one
+ * are O(1); removing a timer is O(log n) amortized.
  */
 
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
     QEMUTimer *active_timers;
+    uint64_t seq;   /* protected by active_timers_lock */
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -93,6 +100,136 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static bool timer_before(const QEMUTimer *a, const QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+        (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+/*
+ * Pairing heap primitives.  The children of a node form a doubly linked
+ * list through next and prev; the prev pointer of the first child points
+ * to the parent instead.  The root has no siblings and no parent.
+ * All of these run with active_timers_lock taken.
+ */
+
+/* Meld two heaps; both arguments must be roots or NULL.  */
+static QEMUTimer *timer_heap_meld(QEMUTimer *a, QEMUTimer *b)
+{
+    QEMUTimer *tmp;
+
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    if (timer_before(b, a)) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    /* b becomes the first child of a */
+    b->prev = a;
+    b->next = a->child;
+    if (a->child) {
+        a->child->prev = b;
+    }
+    a->child = b;
+    return a;
+}
+
+/* Meld a list of siblings into a single heap, using the two-pass method.  */
+static QEMUTimer *timer_heap_merge_pairs(QEMUTimer *first)
+{
+    QEMUTimer *pairs = NULL;
+    QEMUTimer *root = NULL;
+
+    /* Left to right, meld pairs of siblings and push them on a stack */
+    while (first) {
+        QEMUTimer *a = first;
+        QEMUTimer *b = a->next;
+
+        first = b ? b->next : NULL;
+        a->next = a->prev = NULL;
+        if (b) {
+            b->next = b->prev = NULL;
+        }
+        a = timer_heap_meld(a, b);
+        a->next = pairs;
+        pairs = a;
+    }
+
+    /* Right to left, meld the pairs into one heap */
+    while (pairs) {
+        QEMUTimer *t = pairs;
+
+        pairs = t->next;
+        t->next = NULL;
+        root = timer_heap_meld(root, t);
+    }
+    return root;
+}
+
+/* Remove the first timer from the heap.  */
+static void timer_heap_pop(QEMUTimerList *timer_list)
+{
+    QEMUTimer *ts = timer_list->active_timers;
+
+    qatomic_set(&timer_list->active_timers,
+                timer_heap_merge_pairs(ts->child));
+    ts->child = NULL;
+}
+
+static void timer_heap_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    QEMUTimer *sub;
+
+    if (ts == timer_list->active_timers) {
+        timer_heap_pop(timer_list);
+        return;
+    }
+
+    /* Detach ts and its subtree from the heap */
+    if (ts->prev->child == ts) {
+        ts->prev->child = ts->next;
+    } else {
+        ts->prev->next = ts->next;
+    }
+    if (ts->next) {
+        ts->next->prev = ts->prev;
+    }
+    ts->next = ts->prev = NULL;
+
+    sub = timer_heap_merge_pairs(ts->child);
+    ts->child = NULL;
+    qatomic_set(&timer_list->active_timers,
+                timer_heap_meld(timer_list->active_timers, sub));
+}
+
+/*
+ * Return the timer after ts in a preorder walk of the heap, skipping the
+ * children of ts if requested.
+ */
+static QEMUTimer *timer_heap_walk_next(QEMUTimer *ts, bool skip_children)
+{
+    if (ts->child && !skip_children) {
+        return ts->child;
+    }
+    while (ts) {
+        if (ts->next) {
+            return ts->next;
+        }
+        /* Go back to the first sibling, whose prev is the parent */
+        while (ts->prev && ts->prev->child != ts) {
+            ts = ts->prev;
+        }
+        ts = ts->prev;
+    }
+    return NULL;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -265,17 +402,26 @@ int64_t qemu_clock_deadline_ns_all(QEMUClockType type, int attr_mask)
             continue;
         }
         qemu_mutex_lock(&timer_list->active_timers_lock);
+        /*
+         * Skip all external timers.  Children expire after their parent,
+         * so there is no need to look below a timer that is not skipped
+         * or that expires after the best candidate found so far.
+         */
+        expire_time = -1;
         ts = timer_list->active_timers;
-        /* Skip all external timers */
-        while (ts && (ts->attributes & ~attr_mask)) {
-            ts = ts->next;
+        while (ts) {
+            bool prune = expire_time != -1 && ts->expire_time >= expire_time;
+
+            if (!prune && !(ts->attributes & ~attr_mask)) {
+                expire_time = ts->expire_time;
+                prune = true;
+            }
+            ts = timer_heap_walk_next(ts, prune);
         }
-        if (!ts) {
-            qemu_mutex_unlock(&timer_list->active_timers_lock);
+        qemu_mutex_unlock(&timer_list->active_timers_lock);
+        if (expire_time == -1) {
             continue;
         }
-        expire_time = ts->expire_time;
-        qemu_mutex_unlock(&timer_list->active_timers_lock);
 
         delta = expire_time - qemu_clock_get_ns(type);
         if (delta <= 0) {
@@ -370,6 +516,7 @@ void timer_init_full(QEMUTimer *ts,
     ts->scale = scale;
     ts->attributes = attributes;
     ts->expire_time = -1;
+    ts->next = ts->prev = ts->child = NULL;
 }
 
 void timer_deinit(QEMUTimer *ts)
@@ -380,41 +527,25 @@ void timer_deinit(QEMUTimer *ts)
 
 static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            qatomic_set(pt, t->next);
-            break;
-        }
-        pt = &t->next;
+    if (ts->expire_time != -1) {
+        timer_heap_remove(timer_list, ts);
+        ts->expire_time = -1;
     }
 }
 
 static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
                                 QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
-    for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
+    /*
+     * Timers armed later fire later among those with the same expire_time,
+     * like they did when active_timers was a sorted list.
+     */
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    qatomic_set(pt, ts);
+    ts->seq = timer_list->seq++;
+    qatomic_set(&timer_list->active_timers,
+                timer_heap_meld(timer_list->active_timers, ts));
 
-    return pt == &timer_list->active_timers;
+    return timer_list->active_timers == ts;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -505,11 +636,17 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     bool progress = false;
     QEMUTimerCB *cb;
     void *opaque;
+    AioContext *ctx;
+    AioCallbackStats *stats;
+    int64_t start;
 
     if (!qatomic_read(&timer_list->active_timers)) {
         return false;
     }
 
+    /* Callbacks are accounted to the AioContext of the thread running them */
+    ctx = qemu_get_current_aio_context();
+
     qemu_event_reset(&timer_list->timers_done_ev);
     if (!timer_list->clock->enabled) {
         goto out;
@@ -565,15 +702,20 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
+        timer_heap_pop(timer_list);
         ts->expire_time = -1;
         cb = ts->cb;
         opaque = ts->opaque;
 
         /* run the callback (the timer list can be modified) */
         qemu_mutex_unlock(&timer_list->active_timers_lock);
+        stats = ctx ? aio_callback_stats_get(ctx, AIO_CALLBACK_TIMER, cb,
+                                             NULL, -1) : NULL;
+        start = stats ? aio_callback_stats_start(stats) : 0;
         cb(opaque);
+        if (stats) {
+            aio_callback_stats_add(stats, start);
+        }
         qemu_mutex_lock(&timer_list->active_timers_lock);
 
         progress = true;
@@ -10,8 +10,9 @@
  * help diagnose performance problems, e.g. scalability issues when
  * contention is high.
  *
- * The primitives currently supported are mutexes, recursive mutexes and
- * condition variables. Note that not all related functions are intercepted;
+ * The primitives currently supported are mutexes, recursive mutexes,
+ * condition variables and coroutine mutexes and rwlocks. Note that not all
+ * related functions are intercepted;
  * instead we profile only those functions that can have a performance impact,
  * either due to blocking (e.g. cond_wait, mutex_lock) or cache line
  * contention (e.g. mutex_lock, mutex_trylock).
@@ -70,6 +71,8 @@ enum QSPType {
     QSP_BQL_MUTEX,
     QSP_REC_MUTEX,
     QSP_CONDVAR,
+    QSP_CO_MUTEX,
+    QSP_CO_RWLOCK,
 };
 
 struct QSPCallSite {
@@ -122,6 +125,8 @@ static const char * const qsp_typenames[] = {
     [QSP_BQL_MUTEX] = "BQL mutex",
     [QSP_REC_MUTEX] = "rec_mutex",
     [QSP_CONDVAR]   = "condvar",
+    [QSP_CO_MUTEX]  = "CoMutex",
+    [QSP_CO_RWLOCK] = "CoRwlock",
 };
 
 QemuMutexLockFunc qemu_bql_mutex_lock_func = qemu_mutex_lock_impl;
@@ -430,6 +435,18 @@ qsp_cond_timedwait(QemuCond *cond, QemuMutex *mutex, int ms,
     return ret;
 }
 
+void qsp_co_mutex_record(const void *obj, const char *file, int line,
+                         int64_t ns)
+{
+    qsp_entry_record(qsp_entry_get(obj, file, line, QSP_CO_MUTEX), ns);
+}
+
+void qsp_co_rwlock_record(const void *obj, const char *file, int line,
+                          int64_t ns)
+{
+    qsp_entry_record(qsp_entry_get(obj, file, line, QSP_CO_RWLOCK), ns);
+}
+
 bool qsp_is_enabled(void)
 {
     return qatomic_read(&qemu_mutex_lock_func) == qsp_mutex_lock;
@@ -18,6 +18,8 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -29,6 +31,7 @@ typedef struct ThreadPoolElement ThreadPoolElement;
 enum ThreadState {
     THREAD_QUEUED,
     THREAD_ACTIVE,
+    THREAD_CANCELED,
     THREAD_DONE,
 };
 
@@ -38,15 +41,18 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /*
+     * Moving state out of THREAD_QUEUED is done with cmpxchg, either by
+     * the worker thread or by thread_pool_cancel().  After that, only the
+     * worker thread can write to it.  Reads and writes of state and ret
+     * are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
+    int64_t submit_ns;
 
-    /* Access to this list is protected by lock.  */
-    QTAILQ_ENTRY(ThreadPoolElement) reqs;
+    /* Linked into pool->submitted, and then into pool->request_list.  */
+    QSLIST_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
@@ -63,19 +69,81 @@ struct ThreadPool {
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /*
+     * New requests are pushed here without taking the lock, in LIFO
+     * order.  Workers move them to request_list in FIFO order.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) submitted;
+
+    /*
+     * The following variables are protected by lock.  cur_threads,
+     * idle_threads and max_threads are also read without the lock by
+     * thread_pool_submit_aio(), to check whether it has to wake up or
+     * create a worker.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
     int max_threads;
+
+    /* Updated by the workers without taking the lock.  */
+    Stat64 latency[THREAD_POOL_LATENCY_BUCKETS];
 };
 
+static void thread_pool_account(ThreadPool *pool, int64_t ns)
+{
+    uint64_t us = ns / SCALE_US;
+    int bucket = us ? MIN(64 - clz64(us), THREAD_POOL_LATENCY_BUCKETS - 1) : 0;
+
+    stat64_add(&pool->latency[bucket], 1);
+}
+
+void thread_pool_get_latency(ThreadPool *pool,
+                             uint64_t buckets[THREAD_POOL_LATENCY_BUCKETS])
+{
+    int i;
+
+    for (i = 0; i < THREAD_POOL_LATENCY_BUCKETS; i++) {
+        buckets[i] = stat64_get(&pool->latency[i]);
+    }
+}
+
+static bool thread_pool_has_requests(ThreadPool *pool)
+{
+    return !QSLIST_EMPTY(&pool->request_list) ||
+        qatomic_read(&pool->submitted.slh_first) != NULL;
+}
+
+static ThreadPoolElement *thread_pool_pop_request(ThreadPool *pool)
+{
+    ThreadPoolElement *req;
+
+    /* Runs with lock taken.  */
+    if (QSLIST_EMPTY(&pool->request_list)) {
+        QSLIST_HEAD(, ThreadPoolElement) reversed;
+
+        QSLIST_MOVE_ATOMIC(&reversed, &pool->submitted);
+        while (!QSLIST_EMPTY(&reversed)) {
+            req = QSLIST_FIRST(&reversed);
+            QSLIST_REMOVE_HEAD(&reversed, reqs);
+            QSLIST_INSERT_HEAD(&pool->request_list, req, reqs);
+        }
+    }
+
+    req = QSLIST_FIRST(&pool->request_list);
+    if (req) {
+        QSLIST_REMOVE_HEAD(&pool->request_list, reqs);
+    }
+    return req;
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    bool idle = false;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
@@ -85,12 +153,22 @@ static void *worker_thread(void *opaque)
         ThreadPoolElement *req;
         int ret;
 
-        if (QTAILQ_EMPTY(&pool->request_list)) {
-            pool->idle_threads++;
-            ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
-            pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
+        req = thread_pool_pop_request(pool);
+        if (!req) {
+            if (!idle) {
+                /*
+                 * Pairs with smp_mb() in thread_pool_submit_aio(): either
+                 * the submitter sees idle_threads > 0 and signals
+                 * request_cond with the lock taken, or we see its request
+                 * when we look at the queue again.
+                 */
+                idle = true;
+                qatomic_set(&pool->idle_threads, pool->idle_threads + 1);
+                smp_mb(); /* write idle_threads before reading submitted */
+                continue;
+            }
+            if (!qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000) &&
+                !thread_pool_has_requests(pool) &&
                 pool->cur_threads > pool->min_threads) {
                 /* Timed out + no work to do + no need for warm threads = exit.  */
                 break;
@@ -102,23 +180,37 @@ static void *worker_thread(void *opaque)
             continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
+        if (idle) {
+            idle = false;
+            qatomic_set(&pool->idle_threads, pool->idle_threads - 1);
+        }
         qemu_mutex_unlock(&pool->lock);
 
-        ret = req->func(req->arg);
+        if (qatomic_cmpxchg(&req->state, THREAD_QUEUED, THREAD_ACTIVE) ==
+            THREAD_QUEUED) {
+            ret = req->func(req->arg);
+            thread_pool_account(pool, get_clock() - req->submit_ns);
+        } else {
+            ret = -ECANCELED;
+        }
 
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
-        req->state = THREAD_DONE;
+        qatomic_set(&req->state, THREAD_DONE);
 
         qemu_bh_schedule(pool->completion_bh);
         qemu_mutex_lock(&pool->lock);
     }
 
-    pool->cur_threads--;
+    /*
+     * A submitter that sees idle_threads go down must also see that it
+     * can create a new worker, so update cur_threads first.
+     */
+    qatomic_set(&pool->cur_threads, pool->cur_threads - 1);
+    if (idle) {
+        qatomic_store_release(&pool->idle_threads, pool->idle_threads - 1);
+    }
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
 
@@ -156,7 +248,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
+    qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -178,7 +270,7 @@ static void thread_pool_completion_bh(void *opaque)
     aio_context_acquire(pool->ctx);
 restart:
     QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
+        if (qatomic_read(&elem->state) != THREAD_DONE) {
             continue;
         }
 
@@ -221,15 +313,11 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
-    if (elem->state == THREAD_QUEUED) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
-
-        elem->state = THREAD_DONE;
-        elem->ret = -ECANCELED;
-    }
-
+    /*
+     * The request stays in the queue; the worker that picks it up
+     * completes it with -ECANCELED instead of running it.
+     */
+    qatomic_cmpxchg(&elem->state, THREAD_QUEUED, THREAD_CANCELED);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -256,16 +344,29 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->submitted, req, reqs);
+
+    /*
+     * Pairs with smp_mb() in worker_thread().  If all workers are busy
+     * and no more can be created, one of them will pick up the request
+     * when it is done, so there is no need to take the lock.
+     */
+    smp_mb();
+    if (qatomic_load_acquire(&pool->idle_threads) == 0 &&
+        qatomic_read(&pool->cur_threads) >= qatomic_read(&pool->max_threads)) {
+        return &req->common;
+    }
+
     qemu_mutex_lock(&pool->lock);
     if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
     qemu_mutex_unlock(&pool->lock);
     qemu_cond_signal(&pool->request_cond);
     return &req->common;
@@ -304,7 +405,7 @@ void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_lock(&pool->lock);
 
     pool->min_threads = ctx->thread_pool_min;
-    pool->max_threads = ctx->thread_pool_max;
+    qatomic_set(&pool->max_threads, ctx->thread_pool_max);
 
     /*
      * We either have to:
@@ -341,7 +442,8 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSLIST_INIT(&pool->submitted);
+    QSLIST_INIT(&pool->request_list);
 
     thread_pool_update_params(pool, ctx);
 }
@@ -365,11 +467,11 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
+    qatomic_set(&pool->cur_threads, pool->cur_threads - pool->new_threads);
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->max_threads = 0;
+    qatomic_set(&pool->max_threads, 0);
     qemu_cond_broadcast(&pool->request_cond);
     while (pool->cur_threads > 0) {
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
@@ -444,6 +444,15 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -451,14 +460,6 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
     double units = 1.0;
     unsigned i;
 
@@ -484,6 +485,74 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/*
+ * compute how many bytes and operations can be performed during an
+ * interval without exceeding the average limits
+ *
+ * @is_write: the type of operation (read/write)
+ * @delta_ns: the length of the interval
+ * @bytes:    the number of bytes, or THROTTLE_VALUE_MAX if not limited
+ * @units:    the number of operations, or THROTTLE_VALUE_MAX if not limited
+ */
+void throttle_get_budget(ThrottleState *ts, bool is_write, int64_t delta_ns,
+                         double *bytes, double *units)
+{
+    unsigned i;
+
+    *bytes = THROTTLE_VALUE_MAX;
+    *units = THROTTLE_VALUE_MAX;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        if (bkt->avg) {
+            *bytes = MIN(*bytes, (bkt->avg * (double) delta_ns) /
+                                 NANOSECONDS_PER_SECOND);
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        if (bkt->avg) {
+            *units = MIN(*units, (bkt->avg * (double) delta_ns) /
+                                 NANOSECONDS_PER_SECOND);
+        }
+    }
+}
+
+/*
+ * charge a budget obtained with throttle_get_budget() to the limited
+ * buckets, or give it back if the amounts are negative
+ *
+ * @is_write: the type of operation (read/write)
+ * @bytes:    the number of bytes
+ * @units:    the number of operations
+ */
+void throttle_charge(ThrottleState *ts, bool is_write,
+                     double bytes, double units)
+{
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        if (bkt->avg) {
+            bkt->level = MAX(bkt->level + bytes, 0);
+            if (bkt->burst_length > 1) {
+                bkt->burst_level = MAX(bkt->burst_level + bytes, 0);
+            }
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        if (bkt->avg) {
+            bkt->level = MAX(bkt->level + units, 0);
+            if (bkt->burst_length > 1) {
+                bkt->burst_level = MAX(bkt->burst_level + units, 0);
+            }
+        }
+    }
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from